@@ -84,9 +84,6 @@ for k, v in model.items():
     name = k
     shape = v.shape
 
-    if name[:19] == "prompt_encoder.mask":
-        continue
-
     print("Processing variable: " + name + " with shape: ", shape, " and type: ", v.dtype)
 
     #data = tf.train.load_variable(dir_model, name).squeeze()
@@ -0,0 +1,612 @@
+// image encoder benchmarks
+//
+// default: per-NUMA-node scaling
+// runs one session per node on 1, 2, ... nodes at the same time, each session pinned to its node with
+// node-local weights (or interleaved with --numa-interleave), and reports the per-session latency and the
+// aggregate throughput, next to an unpinned session for reference
+//
+// --matmul: the matmuls of one local and one global encoder layer (ViT-B shapes) on the ggml CPU backend
+// and, when built with SAM_BLAS, on the BLAS backend
+//
+// --skip-flat T: the approximate encoder that skips the local attention in flat windows against the exact one,
+// encode time and IoU of the single-mask output for a point prompt at the image center (default image: a product shot)
+//
+// --embd-type f16|q8_0: the compressed storage of the image embedding against F32,
+// size of the embedding and IoU of the single-mask output for a point prompt at the image center
+//
+// usage: sam_bench -m model.bin [-i img.jpg] [-t threads per session] [-r repeats] [--numa-interleave]
+//        sam_bench --matmul [-t threads] [-r repeats]
+//        sam_bench -m model.bin --skip-flat T [-i img.jpg] [-t threads] [-r repeats]
+//        sam_bench -m model.bin --embd-type f16|q8_0 [-i img.jpg] [-t threads]
+
+#include "sam.h"
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#ifdef SAM_USE_BLAS
+#include "ggml-blas.h"
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+struct bench_params {
+    std::string model     = "sam_vit_b-ggml-model-f16.bin";
+    std::string fname_inp = "";
+    int32_t n_threads     = 8;
+    int32_t n_repeat      = 5;
+    bool    interleave    = false;
+    bool    matmul        = false;
+    float   skip_flat     = 0.0f;
+    std::string embd_type = "";
+};
+
+struct bench_result {
+    bool   ok         = false;
+    double ms_per_img = 0.0;
+};
+
+static void bench_print_usage(const char * argv0, const bench_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -i FNAME, --inp FNAME\n");
+    fprintf(stderr, "                        input image (default: synthetic 1024x768 image, a product shot with --skip-flat)\n");
+    fprintf(stderr, "  -t N, --threads N     number of threads per session (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  -r N, --repeat N      number of encodes per session (default: %d)\n", params.n_repeat);
+    fprintf(stderr, "  --numa-interleave     interleave the weights over all nodes instead of a node-local copy\n");
+    fprintf(stderr, "  --matmul              benchmark the encoder layer matmuls on the CPU and BLAS backends\n");
+    fprintf(stderr, "  --skip-flat FLOAT     compare the encoder skipping flat windows (pixel range within FLOAT) to the exact one\n");
+    fprintf(stderr, "  --embd-type TYPE      compare the image embedding stored as TYPE (f16, q8_0) to f32\n");
+    fprintf(stderr, "\n");
+}
+
+static bool bench_params_parse(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if ((arg == "-m" || arg == "--model") && has_value) {
+            params.model = argv[++i];
+        } else if ((arg == "-i" || arg == "--inp") && has_value) {
+            params.fname_inp = argv[++i];
+        } else if ((arg == "-t" || arg == "--threads") && has_value) {
+            params.n_threads = atoi(argv[++i]);
+        } else if ((arg == "-r" || arg == "--repeat") && has_value) {
+            params.n_repeat = atoi(argv[++i]);
+        } else if (arg == "--numa-interleave") {
+            params.interleave = true;
+        } else if (arg == "--matmul") {
+            params.matmul = true;
+        } else if (arg == "--skip-flat" && has_value) {
+            params.skip_flat = atof(argv[++i]);
+        } else if (arg == "--embd-type" && has_value) {
+            params.embd_type = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            bench_print_usage(argv[0], params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_print_usage(argv[0], params);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// synthetic product shot: a textured disk on a seamless background, the case of --skip-flat
+static void bench_product_shot(sam_image_u8 & img) {
+    img.nx = 1024;
+    img.ny = 768;
+    img.data.resize(img.nx*img.ny*3);
+    for (int y = 0; y < img.ny; ++y) {
+        for (int x = 0; x < img.nx; ++x) {
+            uint8_t * p = &img.data[3*(y*img.nx + x)];
+
+            const int dx = x - img.nx/2;
+            const int dy = y - img.ny/2;
+            if (dx*dx + dy*dy < 200*200) {
+                p[0] = (uint8_t) (128 + dx/2);
+                p[1] = (uint8_t) (96  + dy/3);
+                p[2] = (uint8_t) (64  + ((x/8 + y/8) % 2)*64);
+            } else {
+                p[0] = 236;
+                p[1] = 236;
+                p[2] = 232;
+            }
+        }
+    }
+}
+
+static bool bench_load_image(const std::string & fname, sam_image_u8 & img) {
+    if (fname.empty()) {
+        img.nx = 1024;
+        img.ny = 768;
+        img.data.resize(img.nx*img.ny*3);
+        for (int y = 0; y < img.ny; ++y) {
+            for (int x = 0; x < img.nx; ++x) {
+                uint8_t * p = &img.data[3*(y*img.nx + x)];
+                p[0] = (uint8_t) (x/4);
+                p[1] = (uint8_t) (y/3);
+                p[2] = (uint8_t) ((x + y)/7);
+            }
+        }
+        return true;
+    }
+
+    int nx, ny, nc;
+    uint8_t * data = stbi_load(fname.c_str(), &nx, &ny, &nc, 3);
+    if (!data) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    img.nx = nx;
+    img.ny = ny;
+    img.data.assign(data, data + nx*ny*3);
+
+    stbi_image_free(data);
+
+    return true;
+}
+
+// pin the calling thread to the cores of `node`: it computes a share of each graph of its session
+static void bench_pin_thread(int node) {
+#if defined(__linux__)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (const int cpu : sam_numa_node_cpus(node)) {
+        CPU_SET(cpu, &cpuset);
+    }
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0) {
+        fprintf(stderr, "%s: failed to pin thread to node %d\n", __func__, node);
+    }
+#else
+    (void) node;
+#endif
+}
+
+// load a session and encode the image n_repeat times, on the calling thread
+// in NUMA mode the thread is pinned to the node, so each session runs on its own thread
+static void bench_session(const bench_params & bparams, int numa_node, const sam_image_u8 & img, bench_result & res) {
+    if (numa_node >= 0) {
+        bench_pin_thread(numa_node);
+    }
+
+    sam_params params;
+    params.model           = bparams.model;
+    params.n_threads       = bparams.n_threads;
+    params.numa_node       = numa_node;
+    params.numa_interleave = bparams.interleave;
+
+    std::shared_ptr<sam_state> state = sam_load_model(params);
+    if (!state) {
+        return;
+    }
+
+    sam_image_u8 img1 = img;
+
+    // warm-up
+    sam_image_handle handle = sam_compute_embd_img_handle(img1, params.n_threads, *state);
+    if (handle < 0) {
+        sam_deinit(*state);
+        return;
+    }
+
+    // the embedding is released before every run, otherwise the resident one would be reused
+    const auto t_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < bparams.n_repeat; ++i) {
+        sam_release_embd_img(handle, *state);
+        handle = sam_compute_embd_img_handle(img1, params.n_threads, *state);
+    }
+    const auto t_end = std::chrono::steady_clock::now();
+
+    res.ok         = true;
+    res.ms_per_img = std::chrono::duration<double, std::milli>(t_end - t_start).count()/bparams.n_repeat;
+
+    sam_deinit(*state);
+}
+
+// run one session per entry of `nodes` concurrently
+static bool bench_run(const bench_params & bparams, const std::vector<int> & nodes, const sam_image_u8 & img, const char * label) {
+    std::vector<bench_result> results(nodes.size());
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        threads.emplace_back(bench_session, std::cref(bparams), nodes[i], std::cref(img), std::ref(results[i]));
+    }
+    for (auto & t : threads) {
+        t.join();
+    }
+
+    double ms_sum    = 0.0;
+    double img_per_s = 0.0;
+    for (const auto & r : results) {
+        if (!r.ok) {
+            fprintf(stderr, "%s: %s: session failed\n", __func__, label);
+            return false;
+        }
+        ms_sum    += r.ms_per_img;
+        img_per_s += 1e3/r.ms_per_img;
+    }
+
+    printf("| %-15s | %8zu | %7d | %13.1f | %12.2f |\n", label, nodes.size(), bparams.n_threads, ms_sum/nodes.size(), img_per_s);
+    fflush(stdout);
+
+    return true;
+}
+
+// one ggml_mul_mat of an encoder layer: src0 [ne00, ne01, ne02] x src1 [ne00, ne11, ne02]
+struct bench_matmul_shape {
+    const char * name;
+    ggml_type    type0;
+    int64_t      ne00;
+    int64_t      ne01;
+    int64_t      ne02;
+    int64_t      ne11;
+};
+
+// average time of the matmul on `backend`, in ms
+static double bench_matmul(ggml_backend_t backend, const bench_matmul_shape & shape, int n_repeat) {
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ 8*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx = ggml_init(ggml_params);
+
+    struct ggml_tensor * a = ggml_new_tensor_3d(ctx, shape.type0,   shape.ne00, shape.ne01, shape.ne02);
+    struct ggml_tensor * b = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, shape.ne00, shape.ne11, shape.ne02);
+    struct ggml_tensor * c = ggml_mul_mat(ctx, a, b);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, c);
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+
+    // the values don't matter for the timing, but keep them finite
+    {
+        std::vector<float> data(ggml_nelements(b));
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = (float) (i % 17)/17.0f - 0.5f;
+        }
+        ggml_backend_tensor_set(b, data.data(), 0, ggml_nbytes(b));
+
+        if (shape.type0 == GGML_TYPE_F16) {
+            std::vector<ggml_fp16_t> data_f16(ggml_nelements(a));
+            for (size_t i = 0; i < data_f16.size(); ++i) {
+                data_f16[i] = ggml_fp32_to_fp16((float) (i % 13)/13.0f - 0.5f);
+            }
+            ggml_backend_tensor_set(a, data_f16.data(), 0, ggml_nbytes(a));
+        } else {
+            data.resize(ggml_nelements(a));
+            for (size_t i = 0; i < data.size(); ++i) {
+                data[i] = (float) (i % 13)/13.0f - 0.5f;
+            }
+            ggml_backend_tensor_set(a, data.data(), 0, ggml_nbytes(a));
+        }
+    }
+
+    // warm-up
+    ggml_backend_graph_compute(backend, gf);
+
+    const auto t_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_repeat; ++i) {
+        ggml_backend_graph_compute(backend, gf);
+    }
+    const auto t_end = std::chrono::steady_clock::now();
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+
+    return std::chrono::duration<double, std::milli>(t_end - t_start).count()/n_repeat;
+}
+
+// the matmuls of one local and one global ViT-B encoder layer, see sam_encode_image_block
+static int bench_matmul_main(const bench_params & bparams) {
+    const int64_t n_state    = 768;
+    const int64_t n_head     = 12;
+    const int64_t n_head_dim = n_state/n_head;
+    const int64_t n_tokens   = 64*64; // the qkv, proj and MLP matmuls run on the unpadded token grid
+    const int64_t n_win_tok  = 14*14;
+
+    // the local attention runs by blocks of windows: 4x4 inside the grid, 1x4 and 4x1 cut to 8 tokens by its right
+    // and bottom edges, and the corner, with only the tokens of the grid as queries (all the window tokens are keys)
+    const bench_matmul_shape shapes[] = {
+        { "qkv",              GGML_TYPE_F16, n_state,   3*n_state, 1,             n_tokens  },
+        { "proj",             GGML_TYPE_F16, n_state,   n_state,   1,             n_tokens  },
+        { "mlp_lin1",         GGML_TYPE_F16, n_state,   4*n_state, 1,             n_tokens  },
+        { "mlp_lin2",         GGML_TYPE_F16, 4*n_state, n_state,   1,             n_tokens  },
+        { "local KQ",         GGML_TYPE_F32, n_head_dim, n_win_tok, n_head*16,    n_win_tok },
+        { "local KQ x",       GGML_TYPE_F32, n_head_dim, n_win_tok, n_head*4,     8*14      },
+        { "local KQ y",       GGML_TYPE_F32, n_head_dim, n_win_tok, n_head*4,     14*8      },
+        { "local KQ xy",      GGML_TYPE_F32, n_head_dim, n_win_tok, n_head,       8*8       },
+        { "local KQV",        GGML_TYPE_F32, n_win_tok, n_head_dim, n_head*16,    n_win_tok },
+        { "local KQV x",      GGML_TYPE_F32, n_win_tok, n_head_dim, n_head*4,     8*14      },
+        { "local KQV y",      GGML_TYPE_F32, n_win_tok, n_head_dim, n_head*4,     14*8      },
+        { "local KQV xy",     GGML_TYPE_F32, n_win_tok, n_head_dim, n_head,       8*8       },
+        { "global KQ",        GGML_TYPE_F32, n_head_dim, n_tokens,  n_head,       n_tokens  },
+        { "global KQV",       GGML_TYPE_F32, n_tokens,  n_head_dim, n_head,       n_tokens  },
+    };
+
+    ggml_backend_t backend_cpu = ggml_backend_cpu_init();
+    ggml_backend_cpu_set_n_threads(backend_cpu, bparams.n_threads);
+
+    ggml_backend_t backend_blas = nullptr;
+#ifdef SAM_USE_BLAS
+    backend_blas = ggml_backend_blas_init();
+    if (backend_blas) {
+        ggml_backend_blas_set_n_threads(backend_blas, bparams.n_threads);
+    }
+#endif
+    if (!backend_blas) {
+        fprintf(stderr, "%s: no BLAS backend (build with -DSAM_BLAS=ON), timing the CPU backend only\n", __func__);
+    }
+
+    printf("| %-12s | %10s | %10s | %7s |\n", "matmul", "cpu ms", "blas ms", "speedup");
+    printf("| %-12s | %10s | %10s | %7s |\n", "------------", "----------", "----------", "-------");
+
+    double t_cpu[2]  = { 0.0, 0.0 }; // local, global layer
+    double t_blas[2] = { 0.0, 0.0 };
+
+    for (const auto & shape : shapes) {
+        const double ms_cpu  = bench_matmul(backend_cpu, shape, bparams.n_repeat);
+        const double ms_blas = backend_blas ? bench_matmul(backend_blas, shape, bparams.n_repeat) : 0.0;
+
+        // the qkv, proj and MLP matmuls are in both layer types, the attention ones only in theirs
+        if (strncmp(shape.name, "global", 6) != 0) {
+            t_cpu[0]  += ms_cpu;
+            t_blas[0] += ms_blas;
+        }
+        if (strncmp(shape.name, "local", 5) != 0) {
+            t_cpu[1]  += ms_cpu;
+            t_blas[1] += ms_blas;
+        }
+
+        if (backend_blas) {
+            printf("| %-12s | %10.2f | %10.2f | %6.2fx |\n", shape.name, ms_cpu, ms_blas, ms_cpu/ms_blas);
+        } else {
+            printf("| %-12s | %10.2f | %10s | %7s |\n", shape.name, ms_cpu, "-", "-");
+        }
+    }
+
+    const char * layer_names[] = { "local layer", "global layer" };
+    for (int i = 0; i < 2; ++i) {
+        if (backend_blas) {
+            printf("| %-12s | %10.2f | %10.2f | %6.2fx |\n", layer_names[i], t_cpu[i], t_blas[i], t_cpu[i]/t_blas[i]);
+        } else {
+            printf("| %-12s | %10.2f | %10s | %7s |\n", layer_names[i], t_cpu[i], "-", "-");
+        }
+    }
+
+    if (backend_blas) {
+        ggml_backend_free(backend_blas);
+    }
+    ggml_backend_free(backend_cpu);
+
+    return 0;
+}
+
+static sam_params bench_sam_params(const bench_params & bparams) {
+    sam_params params;
+    params.model     = bparams.model;
+    params.n_threads = bparams.n_threads;
+
+    return params;
+}
+
+// load a session, encode the image n_repeat times and compute the masks for a point at the image center
+static bool bench_encode_and_segment(
+        const bench_params & bparams,
+          const sam_params & params,
+              sam_image_u8 & img,
+                    double & ms_per_img,
+ std::vector<sam_image_u8> & masks) {
+    std::shared_ptr<sam_state> state = sam_load_model(params);
+    if (!state) {
+        return false;
+    }
+
+    // warm-up
+    sam_image_handle handle = sam_compute_embd_img_handle(img, params.n_threads, *state);
+    if (handle < 0) {
+        sam_deinit(*state);
+        return false;
+    }
+
+    const auto t_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < bparams.n_repeat; ++i) {
+        sam_release_embd_img(handle, *state);
+        handle = sam_compute_embd_img_handle(img, params.n_threads, *state);
+    }
+    const auto t_end = std::chrono::steady_clock::now();
+
+    ms_per_img = std::chrono::duration<double, std::milli>(t_end - t_start).count()/bparams.n_repeat;
+
+    masks = sam_compute_masks(handle, params.n_threads, { { img.nx/2.0f, img.ny/2.0f, 1 } }, *state);
+
+    sam_deinit(*state);
+
+    return true;
+}
+
+static double bench_iou(const sam_image_u8 & a, const sam_image_u8 & b) {
+    size_t n_inter = 0;
+    size_t n_union = 0;
+    for (size_t i = 0; i < a.data.size() && i < b.data.size(); ++i) {
+        n_inter += a.data[i] && b.data[i];
+        n_union += a.data[i] || b.data[i];
+    }
+
+    return n_union > 0 ? (double) n_inter/n_union : 1.0;
+}
+
+// encode the image with two session settings and compare the masks for a point at the image center
+// both runs return the single-mask head, unfiltered, so the IoU compares the same output of the decoder whatever
+// the scores: pairing the sorted and filtered masks of two runs by position is meaningless when the ranking changes
+static bool bench_compare_heads(
+        const bench_params & bparams,
+                sam_params   params_a,
+                sam_params   params_b,
+              sam_image_u8 & img,
+                    double & ms_a,
+                    double & ms_b,
+                    double & iou) {
+    for (sam_params * params : { &params_a, &params_b }) {
+        params->mask_output               = SAM_MASK_OUTPUT_SINGLE;
+        params->iou_threshold             = 0.0f;
+        params->stability_score_threshold = 0.0f;
+    }
+
+    std::vector<sam_image_u8> masks_a;
+    std::vector<sam_image_u8> masks_b;
+
+    if (!bench_encode_and_segment(bparams, params_a, img, ms_a, masks_a) ||
+        !bench_encode_and_segment(bparams, params_b, img, ms_b, masks_b)) {
+        fprintf(stderr, "%s: failed to run the encoder\n", __func__);
+        return false;
+    }
+
+    if (masks_a.size() != 1 || masks_b.size() != 1) {
+        fprintf(stderr, "%s: expected one mask per run, got %zu and %zu\n", __func__, masks_a.size(), masks_b.size());
+        return false;
+    }
+
+    iou = bench_iou(masks_a[0], masks_b[0]);
+
+    return true;
+}
+
+static int bench_skip_flat_main(const bench_params & bparams, sam_image_u8 & img) {
+    sam_params params_exact  = bench_sam_params(bparams);
+    sam_params params_approx = bench_sam_params(bparams);
+    params_approx.flat_window_threshold = bparams.skip_flat;
+
+    double ms_exact  = 0.0;
+    double ms_approx = 0.0;
+    double iou       = 0.0;
+
+    if (!bench_compare_heads(bparams, params_exact, params_approx, img, ms_exact, ms_approx, iou)) {
+        return 1;
+    }
+
+    printf("| %-22s | %10s | %10s | %7s |\n", "", "exact", "skip flat", "speedup");
+    printf("| %-22s | %10s | %10s | %7s |\n", "----------------------", "----------", "----------", "-------");
+    printf("| %-22s | %10.1f | %10.1f | %6.2fx |\n", "encode ms/img", ms_exact, ms_approx, ms_exact/ms_approx);
+    printf("| %-22s | %10s | %10.4f | %7s |\n", "single-mask IoU", "", iou, "");
+
+    return 0;
+}
+
+static int bench_embd_type_main(const bench_params & bparams, sam_image_u8 & img) {
+    sam_params params_f32 = bench_sam_params(bparams);
+    sam_params params_cmp = bench_sam_params(bparams);
+
+    enum ggml_type type;
+    if (bparams.embd_type == "f16") {
+        params_cmp.embd_type = SAM_EMBD_TYPE_F16;
+        type = GGML_TYPE_F16;
+    } else if (bparams.embd_type == "q8_0") {
+        params_cmp.embd_type = SAM_EMBD_TYPE_Q8_0;
+        type = GGML_TYPE_Q8_0;
+    } else {
+        fprintf(stderr, "%s: unknown embedding type '%s'\n", __func__, bparams.embd_type.c_str());
+        return 1;
+    }
+
+    // a single encode per session, the masks are what is compared
+    bench_params bparams1 = bparams;
+    bparams1.n_repeat = 1;
+
+    double ms_f32 = 0.0;
+    double ms_cmp = 0.0;
+    double iou    = 0.0;
+
+    if (!bench_compare_heads(bparams1, params_f32, params_cmp, img, ms_f32, ms_cmp, iou)) {
+        return 1;
+    }
+
+    // ViT-B embedding: 256 channels of 64x64
+    const int64_t ne = 64*64*256;
+
+    printf("| %-22s | %10s | %10s |\n", "", "f32", bparams.embd_type.c_str());
+    printf("| %-22s | %10s | %10s |\n", "----------------------", "----------", "----------");
+    printf("| %-22s | %10.2f | %10.2f |\n", "embedding MB", ggml_row_size(GGML_TYPE_F32, ne)/1024.0/1024.0, ggml_row_size(type, ne)/1024.0/1024.0);
+    printf("| %-22s | %10s | %10.4f |\n", "single-mask IoU", "", iou);
+
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    bench_params bparams;
+    if (!bench_params_parse(argc, argv, bparams)) {
+        return 1;
+    }
+
+    if (bparams.matmul) {
+        return bench_matmul_main(bparams);
+    }
+
+    sam_image_u8 img;
+    if (!bench_load_image(bparams.fname_inp, img)) {
+        return 1;
+    }
+
+    if (bparams.skip_flat > 0.0f) {
+        if (bparams.fname_inp.empty()) {
+            bench_product_shot(img);
+        }
+        return bench_skip_flat_main(bparams, img);
+    }
+
+    if (!bparams.embd_type.empty()) {
+        return bench_embd_type_main(bparams, img);
+    }
+
+    const std::vector<int> nodes = sam_numa_nodes();
+
+    printf("| %-15s | %8s | %7s | %13s | %12s |\n", "placement", "sessions", "threads", "ms/img", "img/s total");
+    printf("| %-15s | %8s | %7s | %13s | %12s |\n", "---------------", "--------", "-------", "-------------", "------------");
+
+    if (!bench_run(bparams, { -1 }, img, "unpinned")) {
+        return 1;
+    }
+
+    if (nodes.empty()) {
+        fprintf(stderr, "%s: no NUMA topology found, skipping the per-node runs\n", __func__);
+        return 0;
+    }
+
+    const char * label = bparams.interleave ? "numa interleave" : "numa local";
+    for (size_t n = 1; n <= nodes.size(); ++n) {
+        if (!bench_run(bparams, std::vector<int>(nodes.begin(), nodes.begin() + n), img, label)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -72,12 +72,18 @@ void sam_print_usage(const char* program_name, const sam_params_t* params) {
     fprintf(stderr, "  -h, --help            show this help message and exit\n");
     fprintf(stderr, "  -s SEED, --seed SEED  RNG seed (default: -1)\n");
     fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params->n_threads);
+    fprintf(stderr, "  --poll N              thread pool polling level before sleeping, 0-100 (default: %d)\n", params->poll);
+    fprintf(stderr, "  --cpu-strict          pin each thread pool worker to its own core (default: %s)\n", params->cpu_strict ? "on" : "off");
+    fprintf(stderr, "  --numa N              run on NUMA node N with node-local weights and buffers (default: %d)\n", params->numa_node);
+    fprintf(stderr, "  --numa-interleave     with --numa: interleave the weights over all nodes (default: %s)\n", params->numa_interleave ? "on" : "off");
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
     fprintf(stderr, "                        model path (default: %s)\n", params->model);
     fprintf(stderr, "  -i FNAME, --inp FNAME\n");
     fprintf(stderr, "                        input file (default: %s)\n", params->fname_inp);
     fprintf(stderr, "  -o FNAME, --out FNAME\n");
     fprintf(stderr, "                        mask file name prefix (default: %s)\n", params->fname_out);
+    fprintf(stderr, "  --embd-in FNAME       import the image embeddings from FNAME instead of encoding the image\n");
+    fprintf(stderr, "  --embd-out FNAME      export the image embeddings to FNAME\n");
     fprintf(stderr, "SAM hyperparameters:\n");
     fprintf(stderr, "  -mt FLOAT, --mask-threshold\n");
     fprintf(stderr, "                        mask threshold (default: %f)\n", params->mask_threshold);
@@ -91,14 +97,27 @@ void sam_print_usage(const char* program_name, const sam_params_t* params) {
     fprintf(stderr, "                        epsilon (default: %f)\n", params->eps);
     fprintf(stderr, "  -ed FLOAT, --epsilon-decoder-transformer\n");
     fprintf(stderr, "                        epsilon decoder transformer (default: %f)\n", params->eps_decoder_transformer);
+    fprintf(stderr, "  --gelu-fast           use the faster sigmoid GELU approximation in the encoder (default: %s)\n", params->gelu_fast ? "on" : "off");
+    fprintf(stderr, "  --skip-flat FLOAT     approximate: skip the local attention in windows with a pixel range within FLOAT (default: %.1f, 0 - off)\n", params->flat_window_threshold);
+    fprintf(stderr, "  --mask-output MODE    masks to output: multi, single or best (default: multi)\n");
+    fprintf(stderr, "  --dec-attn-f16        keys and values of the mask decoder attention in F16 (default: %s)\n", params->dec_attn_f16 ? "on" : "off");
+    fprintf(stderr, "  --mem-max-mb N        memory limit of the session in MB (default: %d, 0 - unlimited)\n", params->mem_max_mb);
+    fprintf(stderr, "  --embd-type TYPE      storage of the image embeddings: f32, f16 or q8_0 (default: f32)\n");
+    fprintf(stderr, "  --embd-cache DIR      reuse the image embeddings stored in DIR, and store the new ones (default: off)\n");
+    fprintf(stderr, "  --embd-cache-max-mb N size limit of the embedding cache, least recently used first out (default: %d)\n", params->embd_cache_max_mb);
     fprintf(stderr, "SAM prompt:\n");
     fprintf(stderr, "  -p TUPLE, --point-prompt\n");
     fprintf(stderr, "                        point to be used as prompt for SAM (default: %f, %f, %d). Must be in a format FLOAT, FLOAT, INT \n", 
         params->pt.x, params->pt.y, params->pt.label);
+    fprintf(stderr, "  -b TUPLE, --box-prompt\n");
+    fprintf(stderr, "                        box to be used as prompt for SAM, alone or with -p. Must be in a format X0, Y0, X1, Y1\n");
+    fprintf(stderr, "  --refine FLOAT        re-encode the region of the best mask, grown by FLOAT of its size, and refine it (default: off)\n");
     fprintf(stderr, "\n");
 }
 
 bool sam_params_parse(int argc, char** argv, sam_params_t* params) {
+    bool has_pt = false;
+
     for (int i = 1; i < argc; i++) {
         const char* arg = argv[i];
 
@@ -106,6 +125,14 @@ bool sam_params_parse(int argc, char** argv, sam_params_t* params) {
             params->seed = atoi(argv[++i]);
         } else if (strcmp(arg, "-t") == 0 || strcmp(arg, "--threads") == 0) {
             params->n_threads = atoi(argv[++i]);
+        } else if (strcmp(arg, "--poll") == 0) {
+            params->poll = atoi(argv[++i]);
+        } else if (strcmp(arg, "--cpu-strict") == 0) {
+            params->cpu_strict = true;
+        } else if (strcmp(arg, "--numa") == 0) {
+            params->numa_node = atoi(argv[++i]);
+        } else if (strcmp(arg, "--numa-interleave") == 0) {
+            params->numa_interleave = true;
         } else if (strcmp(arg, "-m") == 0 || strcmp(arg, "--model") == 0) {
             params->model = argv[++i];
         } else if (strcmp(arg, "-i") == 0 || strcmp(arg, "--inp") == 0) {
@@ -124,6 +151,48 @@ bool sam_params_parse(int argc, char** argv, sam_params_t* params) {
             params->eps = (float)atof(argv[++i]);
         } else if (strcmp(arg, "-ed") == 0 || strcmp(arg, "--epsilon-decoder-transformer") == 0) {
                 params->eps_decoder_transformer = (float)atof(argv[++i]);
+        } else if (strcmp(arg, "--gelu-fast") == 0) {
+            params->gelu_fast = true;
+        } else if (strcmp(arg, "--skip-flat") == 0) {
+            params->flat_window_threshold = (float)atof(argv[++i]);
+        } else if (strcmp(arg, "--embd-in") == 0) {
+            params->fname_embd_in = argv[++i];
+        } else if (strcmp(arg, "--embd-out") == 0) {
+            params->fname_embd_out = argv[++i];
+        } else if (strcmp(arg, "--dec-attn-f16") == 0) {
+            params->dec_attn_f16 = true;
+        } else if (strcmp(arg, "--mask-output") == 0) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "multi") == 0) {
+                params->mask_output = 0;
+            } else if (strcmp(mode, "single") == 0) {
+                params->mask_output = 1;
+            } else if (strcmp(mode, "best") == 0) {
+                params->mask_output = 2;
+            } else {
+                fprintf(stderr, "error: unknown mask output mode: %s\n", mode);
+                return false;
+            }
+        } else if (strcmp(arg, "--mem-max-mb") == 0) {
+            params->mem_max_mb = atoi(argv[++i]);
+        } else if (strcmp(arg, "--embd-type") == 0) {
+            const char* type = argv[++i];
+            if (strcmp(type, "f32") == 0) {
+                params->embd_type = 0;
+            } else if (strcmp(type, "f16") == 0) {
+                params->embd_type = 1;
+            } else if (strcmp(type, "q8_0") == 0) {
+                params->embd_type = 2;
+            } else {
+                fprintf(stderr, "error: unknown embedding type: %s\n", type);
+                return false;
+            }
+        } else if (strcmp(arg, "--embd-cache") == 0) {
+            params->embd_cache_dir = argv[++i];
+        } else if (strcmp(arg, "--embd-cache-max-mb") == 0) {
+            params->embd_cache_max_mb = atoi(argv[++i]);
+        } else if (strcmp(arg, "--refine") == 0) {
+            params->roi_margin = (float)atof(argv[++i]);
         } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--point-prompt") == 0) {
             char* point = argv[++i];
             char* coord = strtok(point, ",");
@@ -146,6 +215,23 @@ bool sam_params_parse(int argc, char** argv, sam_params_t* params) {
                 return false;
             }
             params->pt.label = atoi(coord);
+
+            has_pt = true;
+        } else if (strcmp(arg, "-b") == 0 || strcmp(arg, "--box-prompt") == 0) {
+            float* coords[4] = { &params->box.x0, &params->box.y0, &params->box.x1, &params->box.y1 };
+            char* coord = strtok(argv[++i], ",");
+            for (int j = 0; j < 4; j++) {
+                if (!coord) {
+                    fprintf(stderr, "Error while parsing box prompt!\n");
+                    return false;
+                }
+                *coords[j] = (float)atof(coord);
+                coord = strtok(NULL, ",");
+            }
+            if (params->box.x1 <= params->box.x0 || params->box.y1 <= params->box.y0) {
+                fprintf(stderr, "Error: the box must be given as its top-left and bottom-right corners!\n");
+                return false;
+            }
         } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
             sam_print_usage(argv[0], params);
             exit(0);
@@ -156,6 +242,11 @@ bool sam_params_parse(int argc, char** argv, sam_params_t* params) {
         }
     }
 
+    // a box alone, without the default point
+    if (params->box.x1 > params->box.x0 && !has_pt) {
+        params->pt.label = -1;
+    }
+
     return true;
 }
 
@@ -192,16 +283,36 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    // Encode image
-    if (!sam_compute_image_embeddings(ctx, &img, params.n_threads)) {
+    // Encode image, or import its embeddings
+    int32_t handle = -1;
+    if (params.fname_embd_in) {
+        handle = sam_import_image_embeddings_file(ctx, params.fname_embd_in);
+    } else {
+        handle = sam_compute_image_embeddings_handle(ctx, &img, params.n_threads);
+    }
+    if (handle < 0) {
         fprintf(stderr, "%s: failed to encode image\n", __func__);
         free(img.data);
         sam_free(ctx);
         return 1;
     }
 
-    // Decode prompt
-    masks = sam_compute_masks(ctx, &img, params.n_threads, &params.pt, 1, &n_masks, 255, 0);
+    if (params.fname_embd_out && !sam_export_image_embeddings_file(ctx, handle, params.fname_embd_out)) {
+        fprintf(stderr, "%s: failed to export the image embeddings to '%s'\n", __func__, params.fname_embd_out);
+    }
+
+    // Decode prompt: the point and the box, as its two corners
+    sam_point_t points[3];
+    int n_points = 0;
+    if (params.pt.label >= 0) {
+        points[n_points++] = params.pt;
+    }
+    if (params.box.x1 > params.box.x0) {
+        points[n_points++] = (sam_point_t){ params.box.x0, params.box.y0, 2 };
+        points[n_points++] = (sam_point_t){ params.box.x1, params.box.y1, 3 };
+    }
+
+    masks = sam_compute_masks_handle(ctx, handle, params.n_threads, points, n_points, &n_masks, 255, 0);
     if (!masks || n_masks == 0) {
         fprintf(stderr, "%s: failed to compute masks\n", __func__);
         free(img.data);
@@ -209,6 +320,19 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    // Refine the best mask in its region of interest
+    if (params.roi_margin >= 0.0f) {
+        sam_image_t* refined = sam_refine_mask_roi(ctx, &img, &masks[0], params.n_threads, points, n_points,
+                                                   params.roi_margin, 255, 0);
+        if (refined) {
+            sam_free_masks(masks, n_masks);
+            masks = refined;
+            n_masks = 1;
+        } else {
+            fprintf(stderr, "%s: failed to refine the mask, keeping the original ones\n", __func__);
+        }
+    }
+
     // Write masks to file
     if (!sam_image_write_to_file(params.fname_out, masks, n_masks)) {
         fprintf(stderr, "%s: failed to write masks to '%s'\n", __func__, params.fname_out);
@@ -226,6 +350,13 @@ int main(int argc, char** argv) {
     fprintf(stderr, "%s:    total time = %d ms\n", __func__, 
             t_load_ms + t_compute_img_ms + t_compute_masks_ms);
 
+    // Report memory
+    size_t mem_weights = 0, mem_embd = 0, mem_compute = 0, mem_work = 0;
+    sam_get_memory_usage(ctx, &mem_weights, &mem_embd, &mem_compute, &mem_work);
+    fprintf(stderr, "%s:        memory = %.1f MB (weights %.1f, embeddings %.1f, compute %.1f, work %.1f)\n", __func__,
+            (mem_weights + mem_embd + mem_compute + mem_work)/1024.0/1024.0,
+            mem_weights/1024.0/1024.0, mem_embd/1024.0/1024.0, mem_compute/1024.0/1024.0, mem_work/1024.0/1024.0);
+
     // Cleanup
     free(img.data);
     sam_free_masks(masks, n_masks);
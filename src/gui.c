@@ -1,6 +1,7 @@
 #include "sam-c.h"
 #include "sam-config.h"
 
+#include <math.h>
 #include <string.h>
 #include <gtk/gtk.h>
 #define STB_IMAGE_IMPLEMENTATION
@@ -11,7 +12,7 @@
 typedef struct {
     float x;        // x coordinate on original image
     float y;        // y coordinate on original image
-    int label;      // 1 for positive, 0 for negative
+    int label;      // 1 for positive, 0 for negative, 2 / 3 for the top-left / bottom-right corner of the box
 } click_point;
 
 typedef struct app_context {
@@ -25,10 +26,16 @@ typedef struct app_context {
     // Click points
     GArray* points;  // Array of click_point structures
 
+    // Box being dragged with the left button, in image coordinates
+    gboolean dragging;
+    double drag_x0, drag_y0;
+    double drag_x1, drag_y1;
+
     // SAM model data
     sam_context_t* sam_ctx;
     sam_params_t sam_params;
     sam_image_t* current_image;
+    int32_t embd_handle;     // embedding of current_image, the clicks refine the mask of the previous ones on it
     sam_image_t* mask;
 
     // GUI elements
@@ -75,8 +82,10 @@ static app_context* app_context_new(void) {
     ctx->image_pixbuf = NULL;
     ctx->image_scale = 1.0;
     ctx->points = g_array_new(FALSE, TRUE, sizeof(click_point));
+    ctx->dragging = FALSE;
     ctx->sam_ctx = NULL;
     ctx->current_image = NULL;
+    ctx->embd_handle = -1;
     ctx->mask = NULL;
     ctx->computing = FALSE;
     ctx->mask_overlay = NULL;
@@ -91,6 +100,7 @@ static app_context* app_context_new(void) {
     ctx->is_encoding = FALSE;
         
     sam_params_init(&ctx->sam_params);
+    ctx->sam_params.mask_output = 2; // only the best mask is shown
     if (!get_params_from_config_file(&ctx->sam_params)) {
         g_print("Failed to initialize context due to config loading error\n");
         app_context_free(ctx);
@@ -132,6 +142,9 @@ static void app_context_clear_image(app_context* ctx) {
 static void clear_prompts(app_context* ctx) {
     // Clear points
     g_array_set_size(ctx->points, 0);
+
+    // Start a new refinement session
+    if (ctx->sam_ctx) sam_refine_reset(ctx->sam_ctx);
     
     // Clear mask
     if (ctx->mask) {
@@ -188,8 +201,9 @@ static gboolean compute_image_embedding_idle(gpointer user_data) {
     app_context* ctx = (app_context*)user_data;
     
     // Compute embeddings
-    gboolean result = sam_compute_image_embeddings(ctx->sam_ctx, ctx->current_image, 
-                                                 ctx->sam_params.n_threads);
+    ctx->embd_handle = sam_compute_image_embeddings_handle(ctx->sam_ctx, ctx->current_image,
+                                                           ctx->sam_params.n_threads);
+    if (ctx->embd_handle < 0) g_print("Failed to compute the image embeddings\n");
     
     // Update UI in main thread
     set_encoding_state(ctx, FALSE);
@@ -231,10 +245,11 @@ static gboolean compute_mask(app_context* ctx, GArray* points) {
         sam_points[i].label = pt->label;
     }
     
-    masks = sam_compute_masks(ctx->sam_ctx, ctx->current_image, 
-                              ctx->sam_params.n_threads,
-                              sam_points, points->len,
-                              &n_masks, 255, 0);
+    // The previous mask is fed back with all the clicks so far
+    masks = sam_compute_masks_refine(ctx->sam_ctx, ctx->embd_handle,
+                                     ctx->sam_params.n_threads,
+                                     sam_points, points->len,
+                                     &n_masks, 255, 0);
 
     // Hide spinner
     ctx->computing = FALSE;
@@ -450,8 +465,14 @@ static gboolean on_draw(GtkWidget* widget, cairo_t* cr, app_context* ctx) {
 
     // Draw points
     cairo_scale(cr, 1.0/ctx->image_scale, 1.0/ctx->image_scale);
+    const click_point* box_tl = NULL;
+    const click_point* box_br = NULL;
     for (guint i = 0; i < ctx->points->len; i++) {
         click_point* pt = &g_array_index(ctx->points, click_point, i);
+
+        // Box corners are drawn as the box below
+        if (pt->label == 2) { box_tl = pt; continue; }
+        if (pt->label == 3) { box_br = pt; continue; }
         
         // Calculate screen coordinates
         double screen_x = pt->x * ctx->image_scale;
@@ -467,14 +488,27 @@ static gboolean on_draw(GtkWidget* widget, cairo_t* cr, app_context* ctx) {
         cairo_arc(cr, screen_x, screen_y, 5.0, 0, 2 * G_PI);
         cairo_fill(cr);
     }
+
+    // Draw the box, and the one being dragged
+    cairo_set_line_width(cr, 2.0);
+    if (box_tl && box_br) {
+        cairo_set_source_rgb(cr, 0, 1, 0);
+        cairo_rectangle(cr, box_tl->x * ctx->image_scale, box_tl->y * ctx->image_scale,
+                        (box_br->x - box_tl->x) * ctx->image_scale, (box_br->y - box_tl->y) * ctx->image_scale);
+        cairo_stroke(cr);
+    }
+    if (ctx->dragging) {
+        cairo_set_source_rgb(cr, 1, 1, 0);
+        cairo_rectangle(cr, ctx->drag_x0 * ctx->image_scale, ctx->drag_y0 * ctx->image_scale,
+                        (ctx->drag_x1 - ctx->drag_x0) * ctx->image_scale, (ctx->drag_y1 - ctx->drag_y0) * ctx->image_scale);
+        cairo_stroke(cr);
+    }
     
     return FALSE;
 }
 
-// Callback for button press event on drawing area
-static gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, app_context* ctx) {
-    if (!ctx->image_pixbuf || ctx->is_encoding) return FALSE;
-    
+// Convert widget coordinates to image coordinates
+static void screen_to_image(GtkWidget* widget, app_context* ctx, double x, double y, double* image_x, double* image_y) {
     GtkAllocation allocation;
     gtk_widget_get_allocation(widget, &allocation);
     
@@ -484,28 +518,82 @@ static gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, app_co
     int x_offset = (allocation.width - scaled_width) / 2;
     int y_offset = (allocation.height - scaled_height) / 2;
     
-    // Convert screen coordinates to image coordinates
-    double image_x = (event->x - x_offset) / ctx->image_scale;
-    double image_y = (event->y - y_offset) / ctx->image_scale;
+    *image_x = (x - x_offset) / ctx->image_scale;
+    *image_y = (y - y_offset) / ctx->image_scale;
+}
+
+// Callback for button press event on drawing area: starts a point, or a box if the left button is dragged
+static gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, app_context* ctx) {
+    if (!ctx->image_pixbuf || ctx->is_encoding) return FALSE;
+    
+    double image_x, image_y;
+    screen_to_image(widget, ctx, event->x, event->y, &image_x, &image_y);
     
     // Check if click is within image bounds
     if (image_x >= 0 && image_x < ctx->image_width &&
         image_y >= 0 && image_y < ctx->image_height) {
         
+        ctx->dragging = TRUE;
+        ctx->drag_x0 = ctx->drag_x1 = image_x;
+        ctx->drag_y0 = ctx->drag_y1 = image_y;
+    }
+    
+    return TRUE;
+}
+
+// Callback for pointer motion with the left button held: updates the box being dragged
+static gboolean on_motion_notify(GtkWidget* widget, GdkEventMotion* event, app_context* ctx) {
+    if (!ctx->dragging) return FALSE;
+
+    double image_x, image_y;
+    screen_to_image(widget, ctx, event->x, event->y, &image_x, &image_y);
+
+    ctx->drag_x1 = CLAMP(image_x, 0, ctx->image_width - 1);
+    ctx->drag_y1 = CLAMP(image_y, 0, ctx->image_height - 1);
+
+    gtk_widget_queue_draw(widget);
+    return TRUE;
+}
+
+// Callback for button release event on drawing area: adds the point, or replaces the box
+static gboolean on_button_release(GtkWidget* widget, GdkEventButton* event, app_context* ctx) {
+    if (!ctx->dragging) return FALSE;
+    ctx->dragging = FALSE;
+
+    const double min_drag = 4.0 / ctx->image_scale; // in screen pixels
+    const gboolean is_box = event->button == 1 &&
+        fabs(ctx->drag_x1 - ctx->drag_x0) > min_drag && fabs(ctx->drag_y1 - ctx->drag_y0) > min_drag;
+
+    if (is_box) {
+        // Only one box per prompt: drop the previous one
+        for (guint i = ctx->points->len; i > 0; i--) {
+            const click_point* pt = &g_array_index(ctx->points, click_point, i - 1);
+            if (pt->label == 2 || pt->label == 3) {
+                g_array_remove_index(ctx->points, i - 1);
+            }
+        }
+
+        click_point tl = { .x = MIN(ctx->drag_x0, ctx->drag_x1), .y = MIN(ctx->drag_y0, ctx->drag_y1), .label = 2 };
+        click_point br = { .x = MAX(ctx->drag_x0, ctx->drag_x1), .y = MAX(ctx->drag_y0, ctx->drag_y1), .label = 3 };
+        fprintf(stderr, "%s: box (%f, %f) - (%f, %f)\n", __func__, tl.x, tl.y, br.x, br.y);
+
+        g_array_append_val(ctx->points, tl);
+        g_array_append_val(ctx->points, br);
+    } else {
         click_point pt = {
-            .x = image_x,
-            .y = image_y,
+            .x = ctx->drag_x0,
+            .y = ctx->drag_y0,
             .label = (event->button == 1) ? 1 : 0  // Left click = 1, Right click = 0
         };
         fprintf(stderr, "%s: point (%f, %f, %i)\n", __func__, pt.x, pt.y, pt.label);
         
         g_array_append_val(ctx->points, pt);
+    }
 
-        // Compute new mask using this point
-        compute_mask(ctx, ctx->points);
+    // Compute new mask using the points and the box, in a single pass
+    compute_mask(ctx, ctx->points);
 
-        gtk_widget_queue_draw(widget);
-    }
+    gtk_widget_queue_draw(widget);
     
     return TRUE;
 }
@@ -557,8 +645,10 @@ int main(int argc, char* argv[]) {
     
     g_signal_connect(ctx->drawing_area, "draw", G_CALLBACK(on_draw), ctx);
     g_signal_connect(ctx->drawing_area, "button-press-event", G_CALLBACK(on_button_press), ctx);
+    g_signal_connect(ctx->drawing_area, "motion-notify-event", G_CALLBACK(on_motion_notify), ctx);
+    g_signal_connect(ctx->drawing_area, "button-release-event", G_CALLBACK(on_button_release), ctx);
     gtk_widget_set_events(ctx->drawing_area, gtk_widget_get_events(ctx->drawing_area) | 
-                         GDK_BUTTON_PRESS_MASK);
+                         GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_BUTTON1_MOTION_MASK);
 
                              // Create encoding overlay
     ctx->encoding_overlay = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
@@ -13,16 +13,33 @@ void sam_params_init(sam_params_t* params) {
     sam_params cpp_params;
     params->seed = cpp_params.seed;
     params->n_threads = cpp_params.n_threads;
+    params->poll = cpp_params.poll;
+    params->cpu_strict = cpp_params.cpu_strict;
+    params->numa_node = cpp_params.numa_node;
+    params->numa_interleave = cpp_params.numa_interleave;
     params->model = "ggml-model-f16.bin";
     params->fname_inp = "img.jpg";
     params->fname_out = "img";
+    params->fname_embd_in = NULL;
+    params->fname_embd_out = NULL;
     params->mask_threshold = cpp_params.mask_threshold;
     params->iou_threshold = cpp_params.iou_threshold;
     params->stability_score_threshold = cpp_params.stability_score_threshold;
     params->stability_score_offset = cpp_params.stability_score_offset;
     params->eps = cpp_params.eps;
     params->eps_decoder_transformer = cpp_params.eps_decoder_transformer;
+    params->gelu_fast = cpp_params.gelu_fast;
+    params->flat_window_threshold = cpp_params.flat_window_threshold;
+    params->mask_output = cpp_params.mask_output;
+    params->dec_attn_f16 = cpp_params.dec_attn_f16;
+    params->embd_cache_dir = NULL;
+    params->embd_cache_max_mb = cpp_params.embd_cache_max_mb;
+    params->mem_max_mb = cpp_params.mem_max_mb;
+    params->embd_mem_max_mb = cpp_params.embd_mem_max_mb;
+    params->embd_type = cpp_params.embd_type;
     params->pt = {cpp_params.pt.x, cpp_params.pt.y};
+    params->box = {0.0f, 0.0f, 0.0f, 0.0f};
+    params->roi_margin = -1.0f;
 }
 
 sam_context_t* sam_load_model(const sam_params_t* params) {
@@ -31,6 +48,10 @@ sam_context_t* sam_load_model(const sam_params_t* params) {
     sam_params cpp_params;
     cpp_params.seed = params->seed;
     cpp_params.n_threads = params->n_threads;
+    cpp_params.poll = params->poll;
+    cpp_params.cpu_strict = params->cpu_strict;
+    cpp_params.numa_node = params->numa_node;
+    cpp_params.numa_interleave = params->numa_interleave;
     cpp_params.model = params->model ? params->model : cpp_params.model;
     cpp_params.fname_inp = params->fname_inp ? params->fname_inp : cpp_params.fname_inp;
     cpp_params.fname_out = params->fname_out ? params->fname_out : cpp_params.fname_out;
@@ -40,6 +61,15 @@ sam_context_t* sam_load_model(const sam_params_t* params) {
     cpp_params.stability_score_offset = params->stability_score_offset;
     cpp_params.eps = params->eps;
     cpp_params.eps_decoder_transformer = params->eps_decoder_transformer;
+    cpp_params.gelu_fast = params->gelu_fast;
+    cpp_params.flat_window_threshold = params->flat_window_threshold;
+    cpp_params.mask_output = (sam_mask_output) params->mask_output;
+    cpp_params.dec_attn_f16 = params->dec_attn_f16;
+    cpp_params.embd_cache_dir = params->embd_cache_dir ? params->embd_cache_dir : cpp_params.embd_cache_dir;
+    cpp_params.embd_cache_max_mb = params->embd_cache_max_mb;
+    cpp_params.mem_max_mb = params->mem_max_mb;
+    cpp_params.embd_mem_max_mb = params->embd_mem_max_mb;
+    cpp_params.embd_type = (sam_embd_type) params->embd_type;
     cpp_params.pt = {params->pt.x, params->pt.y};
 
     auto state = sam_load_model(cpp_params);
@@ -63,6 +93,100 @@ bool sam_compute_image_embeddings(sam_context_t* ctx, sam_image_t* img, int n_th
     return sam_compute_embd_img(cpp_img, n_threads, *ctx->state);
 }
 
+int32_t sam_compute_image_embeddings_handle(sam_context_t* ctx, sam_image_t* img, int n_threads) {
+    if (!ctx || !ctx->state || !img || !img->data) return -1;
+
+    sam_image_u8 cpp_img;
+    cpp_img.nx = img->nx;
+    cpp_img.ny = img->ny;
+    cpp_img.data.assign(img->data, img->data + (img->nx * img->ny * 3));
+
+    return sam_compute_embd_img_handle(cpp_img, n_threads, *ctx->state);
+}
+
+void sam_release_image_embeddings(sam_context_t* ctx, int32_t handle) {
+    if (!ctx || !ctx->state) return;
+
+    sam_release_embd_img(handle, *ctx->state);
+}
+
+bool sam_compute_image_embeddings_pipelined(sam_context_t* ctx, const sam_image_t* imgs, int n_imgs,
+                                            int n_threads, int n_stages,
+                                            sam_embd_img_callback_t callback, void* user_data) {
+    if (!ctx || !ctx->state || !imgs || n_imgs <= 0 || !callback) return false;
+
+    std::vector<sam_image_u8> cpp_imgs(n_imgs);
+    for (int i = 0; i < n_imgs; i++) {
+        if (!imgs[i].data) return false;
+
+        cpp_imgs[i].nx = imgs[i].nx;
+        cpp_imgs[i].ny = imgs[i].ny;
+        cpp_imgs[i].data.assign(imgs[i].data, imgs[i].data + (imgs[i].nx * imgs[i].ny * 3));
+    }
+
+    return sam_compute_embd_imgs_pipelined(cpp_imgs, n_threads, n_stages, *ctx->state,
+        [&](size_t idx, const float* data, size_t n) {
+            callback((int) idx, data, n, user_data);
+        });
+}
+
+uint8_t* sam_export_image_embeddings(sam_context_t* ctx, int32_t handle, size_t* size) {
+    if (!ctx || !ctx->state || !size) return nullptr;
+
+    std::vector<uint8_t> buf;
+    if (!sam_export_embd_img(handle, *ctx->state, buf)) {
+        *size = 0;
+        return nullptr;
+    }
+
+    *size = buf.size();
+    auto* result = new uint8_t[buf.size()];
+    std::memcpy(result, buf.data(), buf.size());
+
+    return result;
+}
+
+bool sam_export_image_embeddings_file(sam_context_t* ctx, int32_t handle, const char* fname) {
+    if (!ctx || !ctx->state || !fname) return false;
+
+    return sam_export_embd_img_file(handle, *ctx->state, fname);
+}
+
+int32_t sam_import_image_embeddings(sam_context_t* ctx, const uint8_t* data, size_t size) {
+    if (!ctx || !ctx->state || !data) return -1;
+
+    return sam_import_embd_img(data, size, *ctx->state);
+}
+
+int32_t sam_import_image_embeddings_file(sam_context_t* ctx, const char* fname) {
+    if (!ctx || !ctx->state || !fname) return -1;
+
+    return sam_import_embd_img_file(fname, *ctx->state);
+}
+
+void sam_free_buffer(uint8_t* buf) {
+    delete[] buf;
+}
+
+static sam_image_t* sam_masks_to_c(const std::vector<sam_image_u8>& masks, int* n_masks) {
+    if (masks.empty()) {
+        *n_masks = 0;
+        return nullptr;
+    }
+
+    *n_masks = masks.size();
+    auto* result = new sam_image_t[*n_masks];
+
+    for (size_t i = 0; i < masks.size(); i++) {
+        result[i].nx = masks[i].nx;
+        result[i].ny = masks[i].ny;
+        result[i].data = new uint8_t[masks[i].data.size()];
+        std::memcpy(result[i].data, masks[i].data.data(), masks[i].data.size());
+    }
+
+    return result;
+}
+
 sam_image_t* sam_compute_masks(sam_context_t* ctx, const sam_image_t* img, int n_threads,
                               const sam_point_t* points, int n_points, int* n_masks,
                               int mask_on_val, int mask_off_val) {
@@ -80,21 +204,134 @@ sam_image_t* sam_compute_masks(sam_context_t* ctx, const sam_image_t* img, int n
     }
 
     auto masks = sam_compute_masks(cpp_img, n_threads, cpp_points, *ctx->state, mask_on_val, mask_off_val);
+
+    return sam_masks_to_c(masks, n_masks);
+}
+
+sam_image_t* sam_compute_masks_handle(sam_context_t* ctx, int32_t handle, int n_threads,
+                                      const sam_point_t* points, int n_points, int* n_masks,
+                                      int mask_on_val, int mask_off_val) {
+    if (!ctx || !ctx->state || !points || n_points <= 0 || !n_masks) return nullptr;
+
+    std::vector<sam_point> cpp_points;
+    cpp_points.reserve(n_points);
+    for (int i = 0; i < n_points; i++) {
+        cpp_points.push_back({points[i].x, points[i].y, points[i].label});
+    }
+
+    auto masks = sam_compute_masks(handle, n_threads, cpp_points, *ctx->state, mask_on_val, mask_off_val);
+
+    return sam_masks_to_c(masks, n_masks);
+}
+
+sam_image_t* sam_compute_masks_refine(sam_context_t* ctx, int32_t handle, int n_threads,
+                                      const sam_point_t* points, int n_points, int* n_masks,
+                                      int mask_on_val, int mask_off_val) {
+    if (!ctx || !ctx->state || !points || n_points <= 0 || !n_masks) return nullptr;
+
+    std::vector<sam_point> cpp_points;
+    cpp_points.reserve(n_points);
+    for (int i = 0; i < n_points; i++) {
+        cpp_points.push_back({points[i].x, points[i].y, points[i].label});
+    }
+
+    auto masks = sam_compute_masks_refine(handle, n_threads, cpp_points, *ctx->state, mask_on_val, mask_off_val);
+
+    return sam_masks_to_c(masks, n_masks);
+}
+
+void sam_refine_reset(sam_context_t* ctx) {
+    if (!ctx || !ctx->state) return;
+
+    sam_refine_reset(*ctx->state);
+}
+
+sam_image_t* sam_compute_masks_box(sam_context_t* ctx, int32_t handle, int n_threads, const sam_box_t* box,
+                                   const sam_point_t* points, int n_points, int* n_masks,
+                                   int mask_on_val, int mask_off_val) {
+    if (!ctx || !ctx->state || !box || (!points && n_points > 0) || n_points < 0 || !n_masks) return nullptr;
+
+    std::vector<sam_point> cpp_points;
+    cpp_points.reserve(n_points + 2);
+    for (int i = 0; i < n_points; i++) {
+        cpp_points.push_back({points[i].x, points[i].y, points[i].label});
+    }
+
+    const sam_box cpp_box = {box->x0, box->y0, box->x1, box->y1};
+
+    auto masks = sam_compute_masks(handle, n_threads, cpp_box, cpp_points, *ctx->state, mask_on_val, mask_off_val);
+
+    return sam_masks_to_c(masks, n_masks);
+}
+
+sam_image_t* sam_compute_masks_batch(sam_context_t* ctx, int32_t handle, int n_threads,
+                                     const sam_point_t* points, const int* n_points_per_prompt, int n_prompts,
+                                     int* n_masks, int mask_on_val, int mask_off_val) {
+    if (!ctx || !ctx->state || !points || !n_points_per_prompt || n_prompts <= 0 || !n_masks) return nullptr;
+
+    std::vector<std::vector<sam_point>> cpp_prompts(n_prompts);
+    for (int ip = 0; ip < n_prompts; ip++) {
+        if (n_points_per_prompt[ip] <= 0) return nullptr;
+
+        cpp_prompts[ip].reserve(n_points_per_prompt[ip]);
+        for (int i = 0; i < n_points_per_prompt[ip]; i++) {
+            cpp_prompts[ip].push_back({points->x, points->y, points->label});
+            points++;
+        }
+    }
+
+    auto masks = sam_compute_masks_batch(handle, n_threads, cpp_prompts, *ctx->state, mask_on_val, mask_off_val);
     if (masks.empty()) {
-        *n_masks = 0;
+        for (int ip = 0; ip < n_prompts; ip++) {
+            n_masks[ip] = 0;
+        }
         return nullptr;
     }
-    
-    *n_masks = masks.size();
-    auto* result = new sam_image_t[*n_masks];
-    
-    for (size_t i = 0; i < masks.size(); i++) {
-        result[i].nx = masks[i].nx;
-        result[i].ny = masks[i].ny;
-        result[i].data = new uint8_t[masks[i].data.size()];
-        std::memcpy(result[i].data, masks[i].data.data(), masks[i].data.size());
+
+    std::vector<sam_image_u8> all;
+    for (int ip = 0; ip < n_prompts; ip++) {
+        n_masks[ip] = masks[ip].size();
+        for (auto & mask : masks[ip]) {
+            all.push_back(std::move(mask));
+        }
+    }
+
+    int n_all = 0;
+    return sam_masks_to_c(all, &n_all);
+}
+
+sam_image_t* sam_refine_mask_roi(sam_context_t* ctx, const sam_image_t* img, const sam_image_t* mask, int n_threads,
+                                 const sam_point_t* points, int n_points, float margin,
+                                 int mask_on_val, int mask_off_val) {
+    if (!ctx || !ctx->state || !img || !img->data || !mask || !mask->data || !points || n_points <= 0) return nullptr;
+
+    sam_image_u8 cpp_img;
+    cpp_img.nx = img->nx;
+    cpp_img.ny = img->ny;
+    cpp_img.data.assign(img->data, img->data + (img->nx * img->ny * 3));
+
+    sam_image_u8 cpp_mask;
+    cpp_mask.nx = mask->nx;
+    cpp_mask.ny = mask->ny;
+    cpp_mask.data.assign(mask->data, mask->data + (mask->nx * mask->ny));
+
+    std::vector<sam_point> cpp_points;
+    cpp_points.reserve(n_points);
+    for (int i = 0; i < n_points; i++) {
+        cpp_points.push_back({points[i].x, points[i].y, points[i].label});
     }
 
+    auto refined = sam_refine_mask_roi(cpp_img, cpp_mask, n_threads, cpp_points, *ctx->state, margin, mask_on_val, mask_off_val);
+    if (refined.data.empty()) {
+        return nullptr;
+    }
+
+    auto* result = new sam_image_t[1];
+    result->nx = refined.nx;
+    result->ny = refined.ny;
+    result->data = new uint8_t[refined.data.size()];
+    std::memcpy(result->data, refined.data.data(), refined.data.size());
+
     return result;
 }
 
@@ -116,6 +353,16 @@ void sam_free(sam_context_t* ctx) {
     delete ctx;
 }
 
+void sam_get_memory_usage(sam_context_t* ctx, size_t* weights, size_t* embeddings, size_t* compute, size_t* work) {
+    if (!ctx || !ctx->state) return;
+
+    const sam_memory_usage usage = sam_get_memory_usage(*ctx->state);
+    if (weights) *weights = usage.weights;
+    if (embeddings) *embeddings = usage.embeddings;
+    if (compute) *compute = usage.compute;
+    if (work) *work = usage.work;
+}
+
 void sam_get_timings(sam_context_t* ctx, int* t_load_ms, int* t_compute_img_ms, int* t_compute_masks_ms) {
     if (!ctx || !ctx->state) return;
 
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -14,9 +15,16 @@ typedef struct sam_context_t sam_context_t;
 typedef struct sam_point_t {
     float x;
     float y;
-    int label;
+    int label;  // 1 - positive, 0 - negative, 2 / 3 - top-left / bottom-right corner of a box
 } sam_point_t;
 
+typedef struct sam_box_t {
+    float x0;
+    float y0;
+    float x1;
+    float y1;
+} sam_box_t;
+
 typedef struct sam_image_t {
     int nx;
     int ny;
@@ -26,16 +34,33 @@ typedef struct sam_image_t {
 typedef struct sam_params_t {
     int32_t seed;
     int32_t n_threads;
+    int32_t poll;        // thread pool polling level before sleeping (0 - no polling, 100 - aggressive)
+    bool cpu_strict;     // pin each thread pool worker to its own core
+    int32_t numa_node;   // run the session on this NUMA node (-1 - off)
+    bool numa_interleave; // with numa_node: interleave the weights over all nodes
     const char* model;
     const char* fname_inp;
     const char* fname_out;
+    const char* fname_embd_in;   // CLI: import the image embeddings from this file instead of encoding (NULL - off)
+    const char* fname_embd_out;  // CLI: export the image embeddings to this file (NULL - off)
     float mask_threshold;
     float iou_threshold;
     float stability_score_threshold;
     float stability_score_offset;
     float eps;
     float eps_decoder_transformer;
+    bool gelu_fast;
+    float flat_window_threshold; // approximate: skip the local attention in near-constant windows (0 - exact)
+    int32_t mask_output;         // masks returned: 0 - the 3 multimask ones, 1 - the single-mask one, 2 - the best of the 3 only
+    bool dec_attn_f16;           // keys and values of the mask decoder attention in F16
+    const char* embd_cache_dir;  // directory of the on-disk image embedding cache (NULL or empty - off)
+    int32_t embd_cache_max_mb;   // size limit of the embedding cache
+    int32_t mem_max_mb;          // memory limit of the session: weights, embeddings, graph and work buffers (0 - unlimited)
+    int32_t embd_mem_max_mb;     // memory budget of the image embeddings resident in the session
+    int32_t embd_type;           // storage type of the image embeddings: 0 - f32, 1 - f16, 2 - q8_0 (blockwise 8-bit)
     sam_point_t pt;
+    sam_box_t box;       // CLI: box prompt (x1 <= x0 - off)
+    float roi_margin;    // refine the best mask in its region of interest grown by this margin (< 0 - off)
 } sam_params_t;
 
 // Initialize default parameters
@@ -47,18 +72,86 @@ sam_context_t* sam_load_model(const sam_params_t* params);
 // Compute image embeddings
 bool sam_compute_image_embeddings(sam_context_t* ctx, sam_image_t* img, int n_threads);
 
+// Called with the embedding of imgs[idx], from the thread of the last pipeline stage
+typedef void (*sam_embd_img_callback_t)(int idx, const float* data, size_t n, void* user_data);
+
+// Compute the embeddings of several images with the encoder split into n_stages pipeline stages
+bool sam_compute_image_embeddings_pipelined(sam_context_t* ctx, const sam_image_t* imgs, int n_imgs,
+                                            int n_threads, int n_stages,
+                                            sam_embd_img_callback_t callback, void* user_data);
+
 // Compute masks for given point
 // Returns array of masks and writes number of masks to n_masks
 sam_image_t* sam_compute_masks(sam_context_t* ctx, const sam_image_t* img, int n_threads,
                               const sam_point_t* points, int n_points, int* n_masks,
                               int mask_on_val, int mask_off_val);
 
-// Free a mask array returned by sam_compute_masks
+// Compute the embeddings of an image and keep them resident in the session, within embd_mem_max_mb
+// An image that is already resident is not encoded again
+// Returns a handle for sam_compute_masks_handle, or -1 on failure
+int32_t sam_compute_image_embeddings_handle(sam_context_t* ctx, sam_image_t* img, int n_threads);
+
+// Compute masks for given points on the image of a resident embedding
+// Returns NULL if the embedding has been released or evicted
+sam_image_t* sam_compute_masks_handle(sam_context_t* ctx, int32_t handle, int n_threads,
+                                      const sam_point_t* points, int n_points, int* n_masks,
+                                      int mask_on_val, int mask_off_val);
+
+// Compute the masks of n_prompts prompts on the image of a resident embedding, in a single decoder pass
+// points holds the points of all the prompts one after the other, n_points_per_prompt[i] of them for prompt i
+// n_masks[i] receives the number of masks of prompt i; the masks are returned one prompt after the other,
+// to be freed with sam_free_masks(masks, sum of n_masks)
+sam_image_t* sam_compute_masks_batch(sam_context_t* ctx, int32_t handle, int n_threads,
+                                     const sam_point_t* points, const int* n_points_per_prompt, int n_prompts,
+                                     int* n_masks, int mask_on_val, int mask_off_val);
+
+// Compute the masks of a box, with optional points (points may be NULL when n_points is 0), in a single pass
+// Returns NULL if the embedding has been released or evicted
+sam_image_t* sam_compute_masks_box(sam_context_t* ctx, int32_t handle, int n_threads, const sam_box_t* box,
+                                   const sam_point_t* points, int n_points, int* n_masks,
+                                   int mask_on_val, int mask_off_val);
+
+// Compute masks for given points on the image of a resident embedding, refining the best mask of the previous call:
+// its low-res logits are the mask prompt of this one, until sam_refine_reset or a call on another embedding
+// Returns NULL if the embedding has been released or evicted
+sam_image_t* sam_compute_masks_refine(sam_context_t* ctx, int32_t handle, int n_threads,
+                                      const sam_point_t* points, int n_points, int* n_masks,
+                                      int mask_on_val, int mask_off_val);
+
+// Forget the previous mask of sam_compute_masks_refine
+void sam_refine_reset(sam_context_t* ctx);
+
+// Release a resident embedding
+void sam_release_image_embeddings(sam_context_t* ctx, int32_t handle);
+
+// Serialize a resident embedding, with the model identity, the image size and a version tag
+// Returns a buffer of *size bytes to be freed with sam_free_buffer, or NULL on failure
+uint8_t* sam_export_image_embeddings(sam_context_t* ctx, int32_t handle, size_t* size);
+bool sam_export_image_embeddings_file(sam_context_t* ctx, int32_t handle, const char* fname);
+
+// Make a serialized embedding resident without encoding the image, it is also used by sam_compute_masks
+// Returns its handle, or -1 on failure (e.g. computed by a different model)
+int32_t sam_import_image_embeddings(sam_context_t* ctx, const uint8_t* data, size_t size);
+int32_t sam_import_image_embeddings_file(sam_context_t* ctx, const char* fname);
+
+// Free a buffer returned by sam_export_image_embeddings
+void sam_free_buffer(uint8_t* buf);
+
+// Refine a mask by re-encoding only its bounding box (grown by margin) at the full encoder resolution
+// Returns a single mask with the size of the image, to be freed with sam_free_masks(mask, 1)
+sam_image_t* sam_refine_mask_roi(sam_context_t* ctx, const sam_image_t* img, const sam_image_t* mask, int n_threads,
+                                 const sam_point_t* points, int n_points, float margin,
+                                 int mask_on_val, int mask_off_val);
+
+// Free a mask array returned by sam_compute_masks, sam_compute_masks_batch or sam_refine_mask_roi
 void sam_free_masks(sam_image_t* masks, int n_masks);
 
 // Free the context and associated resources
 void sam_free(sam_context_t* ctx);
 
+// Get the memory of the session in bytes, any pointer may be NULL
+void sam_get_memory_usage(sam_context_t* ctx, size_t* weights, size_t* embeddings, size_t* compute, size_t* work);
+
 // Get timing information
 void sam_get_timings(sam_context_t* ctx, int* t_load_ms, int* t_compute_img_ms, int* t_compute_masks_ms);
 
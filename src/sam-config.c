@@ -62,6 +62,22 @@ static char* get_current_path() {
     return exe_path;
 }
 
+// an absolute path is kept as is, a relative one is taken from the executable directory
+static void resolve_path(char* res, size_t size, const char* exe_dir, const char* path) {
+    const bool absolute = path[0] == '/' || path[0] == '\\' ||
+        (((path[0] >= 'A' && path[0] <= 'Z') || (path[0] >= 'a' && path[0] <= 'z')) && path[1] == ':');
+
+    if (absolute) {
+        snprintf(res, size, "%s", path);
+    } else {
+#ifdef _WIN32
+        snprintf(res, size, "%s\\%s", exe_dir, path);
+#else
+        snprintf(res, size, "%s/%s", exe_dir, path);
+#endif
+    }
+}
+
 static void create_default_config(const char* config_path) {
     FILE* f = fopen(config_path, "w");
     if (!f) {
@@ -74,13 +90,38 @@ static void create_default_config(const char* config_path) {
     fprintf(f, "model=sam_vit_b-ggml-model-f16.bin\n\n");
     fprintf(f, "# Number of CPU threads to use\n");
     fprintf(f, "n_threads=10\n\n");
+    fprintf(f, "# Thread pool polling level before sleeping (0 - no polling, 100 - aggressive)\n");
+    fprintf(f, "poll=50\n\n");
+    fprintf(f, "# Pin each thread pool worker to its own core (0 or 1)\n");
+    fprintf(f, "cpu_strict=0\n\n");
+    fprintf(f, "# Run on this NUMA node with node-local weights and buffers (-1 - off)\n");
+    fprintf(f, "numa_node=-1\n\n");
+    fprintf(f, "# With numa_node: interleave the weights over all nodes (0 or 1)\n");
+    fprintf(f, "numa_interleave=0\n\n");
     fprintf(f, "# Model parameters\n");
     fprintf(f, "mask_threshold=0.0\n");
     fprintf(f, "iou_threshold=0.88\n");
     fprintf(f, "stability_score_threshold=0.95\n");
     fprintf(f, "stability_score_offset=1.0\n");
     fprintf(f, "eps=1e-6\n");
-    fprintf(f, "eps_decoder_transformer=1e-5\n");
+    fprintf(f, "eps_decoder_transformer=1e-5\n\n");
+    fprintf(f, "# Faster sigmoid GELU approximation in the encoder (0 or 1)\n");
+    fprintf(f, "gelu_fast=0\n\n");
+    fprintf(f, "# Approximate: skip the local attention in windows with a pixel range within this (0 - off)\n");
+    fprintf(f, "flat_window_threshold=0.0\n\n");
+    fprintf(f, "# Masks computed per click: 0 - the 3 multimask ones, 1 - the single-mask one, 2 - the best of the 3 only\n");
+    fprintf(f, "mask_output=2\n\n");
+    fprintf(f, "# Keys and values of the mask decoder attention in F16 (0 or 1)\n");
+    fprintf(f, "dec_attn_f16=0\n\n");
+    fprintf(f, "# Memory limit of the session: weights, embeddings, graph and work buffers (0 - unlimited)\n");
+    fprintf(f, "mem_max_mb=0\n\n");
+    fprintf(f, "# Memory budget of the image embeddings kept in memory, reopened images skip the encoder\n");
+    fprintf(f, "embd_mem_max_mb=64\n\n");
+    fprintf(f, "# Storage of the image embeddings: 0 - f32 (4 MB), 1 - f16 (2 MB), 2 - q8_0 (1.1 MB, blockwise 8-bit)\n");
+    fprintf(f, "embd_type=0\n\n");
+    fprintf(f, "# Cache of the image embeddings (relative to executable or absolute), reopened images skip the encoder\n");
+    fprintf(f, "# embd_cache_dir=embd_cache\n");
+    fprintf(f, "embd_cache_max_mb=1024\n");
 
     fclose(f);
 }
@@ -132,8 +173,36 @@ static bool read_config_file(sam_params_t* sam_params) {
                 sam_params->eps = atof(v);
             } else if (strcmp(k, "eps_decoder_transformer") == 0) {
                 sam_params->eps_decoder_transformer = atof(v);
+            } else if (strcmp(k, "gelu_fast") == 0) {
+                sam_params->gelu_fast = atoi(v) != 0;
+            } else if (strcmp(k, "flat_window_threshold") == 0) {
+                sam_params->flat_window_threshold = atof(v);
+            } else if (strcmp(k, "dec_attn_f16") == 0) {
+                sam_params->dec_attn_f16 = atoi(v) != 0;
+            } else if (strcmp(k, "mask_output") == 0) {
+                sam_params->mask_output = atoi(v);
+            } else if (strcmp(k, "embd_cache_dir") == 0) {
+                char cache_path[1024];
+                resolve_path(cache_path, sizeof(cache_path), exe_dir, v);
+                sam_params->embd_cache_dir = strdup(cache_path);
+            } else if (strcmp(k, "embd_type") == 0) {
+                sam_params->embd_type = atoi(v);
+            } else if (strcmp(k, "mem_max_mb") == 0) {
+                sam_params->mem_max_mb = atoi(v);
+            } else if (strcmp(k, "embd_mem_max_mb") == 0) {
+                sam_params->embd_mem_max_mb = atoi(v);
+            } else if (strcmp(k, "embd_cache_max_mb") == 0) {
+                sam_params->embd_cache_max_mb = atoi(v);
             } else if (strcmp(k, "n_threads") == 0) {
                 sam_params->n_threads = atoi(v);
+            } else if (strcmp(k, "poll") == 0) {
+                sam_params->poll = atoi(v);
+            } else if (strcmp(k, "cpu_strict") == 0) {
+                sam_params->cpu_strict = atoi(v) != 0;
+            } else if (strcmp(k, "numa_node") == 0) {
+                sam_params->numa_node = atoi(v);
+            } else if (strcmp(k, "numa_interleave") == 0) {
+                sam_params->numa_interleave = atoi(v) != 0;
             }
         }
     }
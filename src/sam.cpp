@@ -8,13 +8,33 @@
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
 
+#ifdef SAM_USE_BLAS
+#include "ggml-blas.h"
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
 #include <cstdio>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <thread>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -35,12 +55,21 @@ struct sam_hparams {
     float   stability_score_offset    = 1.0f;
     float   eps                       = 1e-6f;
     float   eps_decoder_transformer   = 1e-5f;
+    bool    gelu_fast                 = false;
+    float   flat_window_threshold     = 0.0f;
+    sam_mask_output mask_output       = SAM_MASK_OUTPUT_MULTI;
+    bool    dec_attn_f16              = false;
 
     int32_t n_enc_head_dim() const { return n_enc_state / n_enc_head; }
     int32_t n_img_size()     const { return 1024; }
     int32_t n_window_size()  const { return 14; }
     int32_t n_patch_size()   const { return 16; }
     int32_t n_img_embd()     const { return n_img_size() / n_patch_size(); }
+    int32_t n_mask_in_chans() const { return 16; }
+
+    // the mask tokens that are decoded: the single-mask one, or the 3 multimask ones
+    int32_t n_dec_masks() const { return mask_output == SAM_MASK_OUTPUT_SINGLE ? 1 : 3; }
+    int32_t i_dec_mask0() const { return mask_output == SAM_MASK_OUTPUT_SINGLE ? 0 : 1; }
 
     std::vector<int32_t> global_attn_indices() const {
         switch (n_enc_state) {
@@ -76,6 +105,11 @@ struct sam_layer_enc {
     struct ggml_tensor * rel_pos_w;
     struct ggml_tensor * rel_pos_h;
 
+    // rel_pos_w/h expanded to the attention size: [n_enc_head_dim, W, W] and [n_enc_head_dim, H, H]
+    // precomputed at load time, see sam_ggml_model_precompute
+    struct ggml_tensor * rel_pos_w_exp = {};
+    struct ggml_tensor * rel_pos_h_exp = {};
+
     struct ggml_tensor * qkv_w;
     struct ggml_tensor * qkv_b;
 
@@ -114,9 +148,22 @@ struct sam_encoder_prompt {
     struct ggml_tensor * not_a_pt_embd_w;
     std::vector<struct ggml_tensor *> pt_embd;
 
+    // the label embeddings as rows: pt_embd[0..n), then not_a_pt_embd_w, see sam_prompt_label
+    // precomputed at load time, see sam_ggml_model_precompute
+    struct ggml_tensor * lbl_embd = {};
+
+    // dense positional encoding of the image embedding, token-major [n_enc_out_chans, n_img_embd*n_img_embd]
+    // precomputed at load time, see sam_ggml_model_precompute
+    struct ggml_tensor * pe_dense = {};
+
     struct ggml_tensor * no_mask_embd_w;
-    //std::vector<struct ggml_tensor *> mask_down_w;
-    //std::vector<struct ggml_tensor *> mask_down_b;
+
+    // mask downscaling: conv 2x2/2, LayerNorm2d, GELU, conv 2x2/2, LayerNorm2d, GELU, conv 1x1
+    // [0], [2], [4] are the convs, [1], [3] the norms
+    // optional, model files converted before the mask prompts were supported do not have them
+    std::vector<struct ggml_tensor *> mask_down_w;
+    std::vector<struct ggml_tensor *> mask_down_b;
+    bool has_mask_down = false;
 };
 
 struct  sam_layer_dec_transformer_attn {
@@ -237,11 +284,102 @@ struct sam_ggml_model {
     //
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
+
+    // tensors derived from the weights at load time
+    struct ggml_context * ctx_pre = {};
+
+#ifdef SAM_USE_BLAS
+    // backend buffers over the memory of `ctx` and `ctx_pre`, so that the backend scheduler uses the weights in place
+    ggml_backend_buffer_t buf_ctx     = {};
+    ggml_backend_buffer_t buf_ctx_pre = {};
+#endif
+
+    // memory of `ctx` when the weights are placed on a NUMA node
+    void * buf_numa      = {};
+    size_t buf_numa_size = 0;
+
+    // hash of the weights and of the hparams that change the image embedding, see sam_embd_cache_key
+    uint64_t id = 0;
+};
+
+// worker threads and scratch buffers for running graphs and parallel loops
+struct sam_workers {
+    // persistent worker threads, shared by all graph computes and CPU-side loops that use these workers
+    struct ggml_threadpool * threadpool = {};
+    int32_t                  n_threads  = 0;
+    int32_t                  poll       = 0;
+
+    // cores the workers may run on, empty - no restriction
+    std::vector<int> cpus;
+
+    // buffer for `ggml_graph_plan.work_data`
+    std::vector<uint8_t> work_buffer;
+
+    // buffer for the single-node graphs of `sam_parallel_for`
+    std::vector<uint8_t> buf_parallel;
+};
+
+// an image embedding [n_img_embd, n_img_embd, n_enc_out_chans] and the context that holds it
+struct sam_image_embd {
+    struct ggml_tensor  * embd = {};
+    struct ggml_context * ctx  = {};
+
+    // unique per allocation, so the decoder inputs derived from the embedding are not reused for another one
+    uint64_t id = 0;
+
+#ifdef SAM_USE_BLAS
+    // backend buffer over the memory of `ctx`, so that the backend scheduler writes the embedding in place
+    ggml_backend_buffer_t buf  = {};
+#endif
+};
+
+// an image embedding resident in the session, see sam_compute_embd_img_handle
+struct sam_embd_entry {
+    sam_image_embd embd;
+
+    uint64_t key    = 0; // sam_embd_cache_key of the image
+    int32_t  nx     = 0; // size of the image
+    int32_t  ny     = 0;
+    uint64_t t_used = 0; // sam_ggml_state::embd_clock at the last use
 };
 
+// nodes of the image encoder graphs: the local attention layers attend to their windows in up to 4 blocks,
+// see sam_encode_image_attn_win, which is more than GGML_DEFAULT_GRAPH_SIZE for ViT-L and ViT-H
+#define SAM_ENC_GRAPH_SIZE 8192
+
 struct sam_ggml_state {
-    struct ggml_tensor * embd_img = {};
-    struct ggml_context * ctx_img = {};
+    // image embeddings resident in the session, least recently used first out when over `embd_max_size` bytes
+    std::map<sam_image_handle, sam_embd_entry> embds;
+
+    sam_image_handle embd_next     = 0;  // handle of the next embedding
+    sam_image_handle embd_cur      = -1; // embedding of the last sam_compute_embd_img, used by sam_compute_masks(img, ...)
+    uint64_t         embd_max_size = 0;
+    uint64_t         embd_clock    = 0;
+
+    // storage type of the image embeddings, decoded to F32 by the mask decoder graph
+    enum ggml_type   embd_type     = GGML_TYPE_F32;
+
+    // memory limit of the session in bytes (0 - unlimited), see sam_mem_fit
+    uint64_t mem_max_size  = 0;
+
+    // buffer sizes of the last encoder and decoder graphs
+    size_t   mem_graph_enc = 0;
+    size_t   mem_graph_dec = 0;
+
+    // embedding of the last region of interest, see sam_refine_mask_roi
+    sam_image_embd embd_roi;
+
+    // the decoder input that depends only on the image, token-major [n_enc_out_chans, n_img_embd*n_img_embd]:
+    // the embedding `dec_src_id` plus the no-mask dense prompt, computed once per embedding, see sam_dec_inputs_prepare
+    // (pos_src depends only on the model, see sam_encoder_prompt::pe_dense)
+    struct ggml_context * ctx_dec_inp = {};
+    struct ggml_tensor  * dec_src     = {};
+    uint64_t              dec_src_id  = 0;
+
+    // low-res logits [4*n_img_embd, 4*n_img_embd] of the best mask of the last decode of a refinement session,
+    // on the embedding `mask_logits_id`, see sam_compute_masks_refine
+    std::vector<float>    mask_logits;
+    uint64_t              mask_logits_id = 0;
 
     struct ggml_tensor * low_res_masks;
     struct ggml_tensor * iou_predictions;
@@ -249,14 +387,34 @@ struct sam_ggml_state {
 
     //struct ggml_tensor * tmp_save = {};
 
-    // buffer for `ggml_graph_plan.work_data`
-    std::vector<uint8_t> work_buffer;
+    sam_workers workers;
+
     // buffers to evaluate the model
     std::vector<uint8_t> buf_compute_img_enc;
 
     std::vector<uint8_t> buf_compute_fast;
 
     ggml_gallocr_t       allocr = {};
+
+    // mask decoder graph and its buffers, with the outputs in ctx_masks, kept for the next decodes of the same shape:
+    // n_prompts prompts of dec_n_pt tokens, with or without a mask prompt, see sam_dec_graph_prepare
+    ggml_gallocr_t       allocr_dec = {};
+    struct ggml_cgraph * gf_dec     = {};
+    int                  dec_n_pt      = 0;
+    int                  dec_n_prompts = 0;
+    bool                 dec_use_mask  = false;
+
+    // directory of the on-disk embedding cache (empty - off) and its size limit in bytes
+    std::string embd_cache_dir;
+    uint64_t    embd_cache_max_size = 0;
+
+#ifdef SAM_USE_BLAS
+    // the image encoder runs through a backend scheduler:
+    // the large matmuls go to the BLAS backend, everything else to the CPU backend on the session's thread pool
+    ggml_backend_t        backend_cpu  = {};
+    ggml_backend_t        backend_blas = {};
+    ggml_backend_sched_t  sched        = {};
+#endif
 };
 
 // RGB float32 image
@@ -309,8 +467,8 @@ static void ggml_disconnect_node_from_graph(ggml_tensor * t) {
     }
 }
 
-static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
-    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads, nullptr);
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads, struct ggml_threadpool * threadpool) {
+    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads, threadpool);
 
     if (plan.work_size > 0) {
         buf.resize(plan.work_size);
@@ -320,44 +478,409 @@ static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph *
     ggml_graph_compute(graph, &plan);
 }
 
-static void ggml_sam_sin(struct ggml_tensor * dst , const struct ggml_tensor * src, int ith, int nth, void * userdata) {
-    GGML_ASSERT(userdata == NULL);
-    GGML_ASSERT(ggml_are_same_shape(dst, src));
-    GGML_ASSERT(ggml_is_contiguous(dst));
-    GGML_ASSERT(ggml_is_contiguous(src));
+// create a thread pool whose workers stay alive between graph computes
+// the workers spin for a while after each compute (see `poll`) before going to sleep,
+// so that back-to-back computes (e.g. decoder runs on every click) don't pay the wake-up latency
+// if `cpus` is not empty, the workers are pinned to these cores
+static struct ggml_threadpool * sam_threadpool_new(int n_threads, int poll, bool strict, const std::vector<int> & cpus) {
+    struct ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+    tpp.poll       = std::max(0, std::min(poll, 100));
+    tpp.strict_cpu = strict && !cpus.empty();
+
+    for (const int cpu : cpus) {
+        if (cpu >= 0 && cpu < GGML_MAX_N_THREADS) {
+            tpp.cpumask[cpu] = true;
+        }
+    }
 
-    const float * src_data = ggml_get_data_f32(src);
-    float * dst_data = ggml_get_data_f32(dst);
+    struct ggml_threadpool * threadpool = ggml_threadpool_new(&tpp);
+    if (!threadpool) {
+        fprintf(stderr, "%s: failed to create thread pool with %d threads\n", __func__, n_threads);
+    }
+
+    return threadpool;
+}
+
+//
+// NUMA
+//
+// a session can be placed on one node: its workers are pinned to the node's cores, the weights are placed on the node
+// (or interleaved over all nodes) and all the other buffers of the session are allocated node-local, because they are
+// first touched by the workers under a node-preferred policy
+// the loading thread is bound to the node while the session is set up, and restored afterwards: the thread that calls
+// the computes also runs a share of them, so it should run on the node too
+// only Linux is supported, the node topology is read from sysfs
+//
+
+// parse a sysfs cpu/node list like "0-3,8,10-11"
+static std::vector<int> sam_parse_cpulist(const std::string & s) {
+    std::vector<int> res;
+
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos) {
+            end = s.size();
+        }
+
+        const std::string range = s.substr(pos, end - pos);
+        const size_t dash = range.find('-');
+
+        char * p_end = nullptr;
+        const long first = strtol(range.c_str(), &p_end, 10);
+        if (p_end != range.c_str()) {
+            const long last = dash == std::string::npos ? first : strtol(range.c_str() + dash + 1, nullptr, 10);
+            for (long i = first; i <= last; ++i) {
+                res.push_back((int) i);
+            }
+        }
+
+        pos = end + 1;
+    }
+
+    return res;
+}
+
+static std::vector<int> sam_read_cpulist(const std::string & fname) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        return {};
+    }
+
+    std::string line;
+    std::getline(fin, line);
+
+    return sam_parse_cpulist(line);
+}
+
+std::vector<int> sam_numa_nodes() {
+    return sam_read_cpulist("/sys/devices/system/node/online");
+}
+
+std::vector<int> sam_numa_node_cpus(int node) {
+    return sam_read_cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+}
+
+#if defined(__linux__)
+
+// from <linux/mempolicy.h>, to avoid the dependency on libnuma
+#define SAM_MPOL_DEFAULT    0
+#define SAM_MPOL_PREFERRED  1
+#define SAM_MPOL_INTERLEAVE 3
+#define SAM_MPOL_MF_MOVE    (1 << 1)
+
+#define SAM_NUMA_MAX_NODES  1024
+
+struct sam_numa_nodemask {
+    unsigned long bits[SAM_NUMA_MAX_NODES/(8*sizeof(unsigned long))] = {};
+
+    void set(int node) {
+        if (node >= 0 && node < SAM_NUMA_MAX_NODES) {
+            bits[node/(8*sizeof(unsigned long))] |= 1UL << (node % (8*sizeof(unsigned long)));
+        }
+    }
+};
+
+// allocate page-aligned memory and bind it to `node`, or interleave it over all the nodes
+// the pages are placed when first touched, so the caller should fill the buffer after this
+static void * sam_numa_alloc(size_t size, int node, bool interleave) {
+    void * ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "%s: failed to map %zu bytes\n", __func__, size);
+        return nullptr;
+    }
+
+    sam_numa_nodemask mask;
+    if (interleave) {
+        for (const int n : sam_numa_nodes()) {
+            mask.set(n);
+        }
+    } else {
+        mask.set(node);
+    }
+
+    const int mode = interleave ? SAM_MPOL_INTERLEAVE : SAM_MPOL_PREFERRED;
+    if (syscall(SYS_mbind, ptr, size, mode, mask.bits, SAM_NUMA_MAX_NODES, SAM_MPOL_MF_MOVE) != 0) {
+        // not fatal - the memory is still usable, just not placed
+        fprintf(stderr, "%s: mbind failed: %s\n", __func__, strerror(errno));
+    }
+
+    return ptr;
+}
+
+static void sam_numa_free(void * ptr, size_t size) {
+    if (ptr) {
+        munmap(ptr, size);
+    }
+}
+
+// pins the calling thread to the cores of a node and prefers the node's memory for its allocations, until destroyed:
+// the previous affinity and memory policy of the thread are then restored
+// threads created by the thread while it is bound (e.g. the thread pool workers) inherit the binding and keep it
+struct sam_numa_thread_binding {
+    bool bound = false;
+
+    cpu_set_t prev_cpus;
+    int       prev_mode = 0;
+
+    sam_numa_nodemask prev_mask;
+
+    bool bind(int node, const std::vector<int> & cpus) {
+        if (sched_getaffinity(0, sizeof(prev_cpus), &prev_cpus) != 0 ||
+            syscall(SYS_get_mempolicy, &prev_mode, prev_mask.bits, SAM_NUMA_MAX_NODES, nullptr, 0) != 0) {
+            fprintf(stderr, "%s: failed to read the thread binding: %s\n", __func__, strerror(errno));
+            return false;
+        }
+
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (const int cpu : cpus) {
+            CPU_SET(cpu, &cpuset);
+        }
+
+        if (sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0) {
+            fprintf(stderr, "%s: failed to pin thread to node %d: %s\n", __func__, node, strerror(errno));
+            return false;
+        }
+
+        sam_numa_nodemask mask;
+        mask.set(node);
+
+        if (syscall(SYS_set_mempolicy, SAM_MPOL_PREFERRED, mask.bits, SAM_NUMA_MAX_NODES) != 0) {
+            fprintf(stderr, "%s: failed to set memory policy for node %d: %s\n", __func__, node, strerror(errno));
+            sched_setaffinity(0, sizeof(prev_cpus), &prev_cpus);
+            return false;
+        }
+
+        bound = true;
+
+        return true;
+    }
+
+    ~sam_numa_thread_binding() {
+        if (!bound) {
+            return;
+        }
+
+        if (syscall(SYS_set_mempolicy, prev_mode, prev_mode == SAM_MPOL_DEFAULT ? nullptr : prev_mask.bits, SAM_NUMA_MAX_NODES) != 0) {
+            fprintf(stderr, "%s: failed to restore the memory policy: %s\n", __func__, strerror(errno));
+        }
+        if (sched_setaffinity(0, sizeof(prev_cpus), &prev_cpus) != 0) {
+            fprintf(stderr, "%s: failed to restore the thread affinity: %s\n", __func__, strerror(errno));
+        }
+    }
+};
+
+#else
+
+static void * sam_numa_alloc(size_t size, int node, bool interleave) {
+    (void) size;
+    (void) node;
+    (void) interleave;
+
+    return nullptr;
+}
+
+static void sam_numa_free(void * ptr, size_t size) {
+    (void) ptr;
+    (void) size;
+}
+
+struct sam_numa_thread_binding {
+    bool bind(int node, const std::vector<int> & cpus) {
+        (void) cpus;
+
+        fprintf(stderr, "%s: NUMA placement is not supported on this platform (node %d)\n", __func__, node);
+
+        return false;
+    }
+};
+
+#endif
+
+static int sam_n_threads(const sam_workers & workers, int n_threads) {
+    if (workers.threadpool) {
+        n_threads = std::min(n_threads, workers.n_threads);
+    }
+
+    return std::max(1, n_threads);
+}
+
+#ifdef SAM_USE_BLAS
+// wrap the memory of a ggml context into a CPU backend buffer, so that its tensors can be used by a backend scheduler
+static ggml_backend_buffer_t sam_ctx_to_backend_buffer(struct ggml_context * ctx, enum ggml_backend_buffer_usage usage) {
+    ggml_backend_buffer_t buf = ggml_backend_cpu_buffer_from_ptr(ggml_get_mem_buffer(ctx), ggml_get_mem_size(ctx));
+    if (!buf) {
+        return nullptr;
+    }
+
+    ggml_backend_buffer_set_usage(buf, usage);
+
+    for (struct ggml_tensor * t = ggml_get_first_tensor(ctx); t; t = ggml_get_next_tensor(ctx, t)) {
+        t->buffer = buf;
+    }
+
+    return buf;
+}
+
+static bool sam_backend_sched_init(sam_ggml_model & model, sam_ggml_state & state) {
+    state.backend_blas = ggml_backend_blas_init();
+    state.backend_cpu  = ggml_backend_cpu_init();
+    if (!state.backend_blas || !state.backend_cpu) {
+        fprintf(stderr, "%s: failed to initialize the BLAS and CPU backends\n", __func__);
+        return false;
+    }
+
+    ggml_backend_blas_set_n_threads(state.backend_blas, state.workers.n_threads);
+    ggml_backend_cpu_set_n_threads(state.backend_cpu, state.workers.n_threads);
+    ggml_backend_cpu_set_threadpool(state.backend_cpu, state.workers.threadpool);
+
+    model.buf_ctx     = sam_ctx_to_backend_buffer(model.ctx,     GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    model.buf_ctx_pre = sam_ctx_to_backend_buffer(model.ctx_pre, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    if (!model.buf_ctx || !model.buf_ctx_pre) {
+        fprintf(stderr, "%s: failed to wrap the weights into backend buffers\n", __func__);
+        return false;
+    }
+
+    // the CPU backend goes last, it is the fallback for the ops that BLAS doesn't support
+    ggml_backend_t backends[] = { state.backend_blas, state.backend_cpu };
+
+    state.sched = ggml_backend_sched_new(backends, NULL, 2, SAM_ENC_GRAPH_SIZE, false);
+    if (!state.sched) {
+        fprintf(stderr, "%s: failed to create the backend scheduler\n", __func__);
+        return false;
+    }
+
+    fprintf(stderr, "%s: encoder matmuls on %s\n", __func__, ggml_backend_name(state.backend_blas));
 
-    const int ne = (int)ggml_nelements(dst);
-    const int dr = (ne + nth - 1) / nth;
-    const int ie0 = dr * ith;
-    const int ie1 = std::min(ie0 + dr, ne);
+    return true;
+}
+
+static void sam_backend_sched_free(sam_ggml_model & model, sam_ggml_state & state) {
+    if (state.sched) {
+        ggml_backend_sched_free(state.sched);
+    }
+    if (state.backend_blas) {
+        ggml_backend_free(state.backend_blas);
+    }
+    if (state.backend_cpu) {
+        ggml_backend_free(state.backend_cpu);
+    }
+    if (model.buf_ctx) {
+        ggml_backend_buffer_free(model.buf_ctx);
+    }
+    if (model.buf_ctx_pre) {
+        ggml_backend_buffer_free(model.buf_ctx_pre);
+    }
+}
+#endif
+
+static void ggml_sam_parallel_task(struct ggml_tensor * dst , const struct ggml_tensor * src, int ith, int nth, void * userdata) {
+    (void) dst;
+    (void) src;
+
+    const auto & fn = *(const std::function<void(int, int)> *) userdata;
+    fn(ith, nth);
+}
+
+// run fn(ith, nth) for ith in [0, nth) on the threads of the session thread pool
+// this is a single custom op graph, so CPU-side loops share the same pinned workers as the model graphs
+static void sam_parallel_for(sam_workers & workers, int n_threads, const std::function<void(int, int)> & fn) {
+    n_threads = sam_n_threads(workers, n_threads);
+
+    if (n_threads == 1) {
+        fn(0, 1);
+        return;
+    }
 
-    for (int i = ie0; i < ie1; ++i) {
-        dst_data[i] = sinf(src_data[i]);
+    workers.buf_parallel.resize(2*ggml_tensor_overhead() + ggml_graph_overhead_custom(2, false) + 256);
+
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ workers.buf_parallel.size(),
+        /*.mem_buffer =*/ workers.buf_parallel.data(),
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(ggml_params);
+    struct ggml_cgraph  * gf   = ggml_new_graph_custom(ctx0, 2, false);
+
+    struct ggml_tensor * cur = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+    cur = ggml_map_custom1(ctx0, cur, ggml_sam_parallel_task, n_threads, (void *) &fn);
+
+    ggml_build_forward_expand(gf, cur);
+
+    ggml_graph_compute_helper(workers.work_buffer, gf, n_threads, workers.threadpool);
+
+    ggml_free(ctx0);
+}
+
+// sin and cos of n values, without branches so that the loop is vectorized at the baseline ISA:
+// reduction to [-pi/4, pi/4] by the nearest multiple of pi/2 in three parts (Cody-Waite), then the minimax
+// polynomials of cephes' sinf / cosf on the reduced value, swapped and negated by the quadrant
+// max abs error ~1.5e-7 for |x| < 2^21, the arguments of the positional encodings are within a few hundred
+// ref: https://github.com/jeremybarnes/cephes/blob/master/single/sinf.c
+static void sam_sincos_f32(const float * x, float * s, float * c, int n) {
+    const float two_opi = 0.636619772367581343f;
+    const float dp1 = 1.5703125f;
+    const float dp2 = 4.837512969970703125e-4f;
+    const float dp3 = 7.54978995489188216e-8f;
+
+    for (int i = 0; i < n; ++i) {
+        // round to the nearest integer with the 1.5*2^23 trick
+        const float fq = (x[i]*two_opi + 12582912.0f) - 12582912.0f;
+        const int   q  = (int) fq;
+
+        const float r  = ((x[i] - fq*dp1) - fq*dp2) - fq*dp3;
+        const float r2 = r*r;
+
+        const float ps = r + r*r2*(-1.6666654611e-1f + r2*(8.3321608736e-3f + r2*(-1.9515295891e-4f)));
+        const float pc = 1.0f - 0.5f*r2 + r2*r2*(4.166664568298827e-2f + r2*(-1.388731625493765e-3f + r2*2.443315711809948e-5f));
+
+        const float swap = (float) (q & 1);
+        const float sgn_s = (float) (1 - (q & 2));
+        const float sgn_c = (float) (1 - ((q + 1) & 2));
+
+        s[i] = (ps + swap*(pc - ps))*sgn_s;
+        c[i] = (pc + swap*(ps - pc))*sgn_c;
     }
 }
 
-static void ggml_sam_cos(struct ggml_tensor * dst , const struct ggml_tensor * src, int ith, int nth, void * userdata) {
+// the rows of dst are [sin(src), cos(src)]: the concatenation of the positional encodings, in a single pass
+// ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L192
+static void ggml_sam_sincos(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * src, int ith, int nth, void * userdata) {
     GGML_ASSERT(userdata == NULL);
-    GGML_ASSERT(ggml_are_same_shape(dst, src));
+    GGML_ASSERT(dst->ne[0] == 2*src->ne[0]);
+    GGML_ASSERT(ggml_nrows(dst) == ggml_nrows(src));
     GGML_ASSERT(ggml_is_contiguous(dst));
     GGML_ASSERT(ggml_is_contiguous(src));
+    (void) a;
 
     const float * src_data = ggml_get_data_f32(src);
     float * dst_data = ggml_get_data_f32(dst);
 
-    const int ne = (int)ggml_nelements(dst);
-    const int dr = (ne + nth - 1) / nth;
-    const int ie0 = dr * ith;
-    const int ie1 = std::min(ie0 + dr, ne);
+    const int n  = (int)src->ne[0];
+    const int nr = (int)ggml_nrows(src);
+    const int dr = (nr + nth - 1) / nth;
+    const int ir0 = dr * ith;
+    const int ir1 = std::min(ir0 + dr, nr);
 
-    for (int i = ie0; i < ie1; ++i) {
-        dst_data[i] = cosf(src_data[i]);
+    for (int ir = ir0; ir < ir1; ++ir) {
+        sam_sincos_f32(src_data + ir*n, dst_data + ir*2*n, dst_data + ir*2*n + n, n);
     }
 }
 
+// [sin(cur), cos(cur)] concatenated along the first dimension
+static struct ggml_tensor * sam_sincos(struct ggml_context * ctx0, struct ggml_tensor * cur) {
+    struct ggml_tensor * res = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, 2*cur->ne[0], cur->ne[1], cur->ne[2], cur->ne[3]);
+
+    return ggml_map_custom2_inplace(ctx0, res, cur, ggml_sam_sincos, GGML_N_TASKS_MAX, NULL);
+}
+
+
+// pixel statistics used to normalize the input image
+// ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/sam.py#L30-L31
+static const float sam_pixel_mean[3] = { 123.675f, 116.280f, 103.530f };
+static const float sam_pixel_std[3]  = {  58.395f,  57.120f,  57.375f };
 
 // ref: https://github.com/facebookresearch/segment-anything/blob/efeab7296ab579d4a261e554eca80faf6b33924a/segment_anything/modeling/sam.py#L164
 // resize largest dimension to 1024
@@ -367,7 +890,7 @@ static void ggml_sam_cos(struct ggml_tensor * dst , const struct ggml_tensor * s
 //     TODO: why are these hardcoded !?
 // pad to 1024x1024
 // TODO: for some reason, this is not numerically identical to pytorch's interpolation
-bool sam_image_preprocess(const sam_image_u8 & img, sam_image_f32 & res) {
+bool sam_image_preprocess(const sam_image_u8 & img, sam_image_f32 & res, sam_workers & workers, int n_threads) {
     const int nx = img.nx;
     const int ny = img.ny;
 
@@ -385,113 +908,309 @@ bool sam_image_preprocess(const sam_image_u8 & img, sam_image_f32 & res) {
     const int nx3 = int(nx/scale + 0.5f);
     const int ny3 = int(ny/scale + 0.5f);
 
-    const float m3[3] = { 123.675f, 116.280f, 103.530f };
-    const float s3[3] = {  58.395f,  57.120f,  57.375f };
+    const float * m3 = sam_pixel_mean;
+    const float * s3 = sam_pixel_std;
+
+    sam_parallel_for(workers, n_threads, [&](int ith, int nth) {
+        const int dr  = (ny3 + nth - 1)/nth;
+        const int ir0 = dr*ith;
+        const int ir1 = std::min(ir0 + dr, ny3);
 
-    for (int y = 0; y < ny3; y++) {
-        for (int x = 0; x < nx3; x++) {
-            for (int c = 0; c < 3; c++) {
-                // linear interpolation
-                const float sx = (x + 0.5f)*scale - 0.5f;
-                const float sy = (y + 0.5f)*scale - 0.5f;
+        for (int y = ir0; y < ir1; y++) {
+            for (int x = 0; x < nx3; x++) {
+                for (int c = 0; c < 3; c++) {
+                    // linear interpolation
+                    const float sx = (x + 0.5f)*scale - 0.5f;
+                    const float sy = (y + 0.5f)*scale - 0.5f;
 
-                const int x0 = std::max(0, (int) std::floor(sx));
-                const int y0 = std::max(0, (int) std::floor(sy));
+                    const int x0 = std::max(0, (int) std::floor(sx));
+                    const int y0 = std::max(0, (int) std::floor(sy));
 
-                const int x1 = std::min(x0 + 1, nx - 1);
-                const int y1 = std::min(y0 + 1, ny - 1);
+                    const int x1 = std::min(x0 + 1, nx - 1);
+                    const int y1 = std::min(y0 + 1, ny - 1);
 
-                const float dx = sx - x0;
-                const float dy = sy - y0;
+                    const float dx = sx - x0;
+                    const float dy = sy - y0;
 
-                const int j00 = 3*(y0*nx + x0) + c;
-                const int j01 = 3*(y0*nx + x1) + c;
-                const int j10 = 3*(y1*nx + x0) + c;
-                const int j11 = 3*(y1*nx + x1) + c;
+                    const int j00 = 3*(y0*nx + x0) + c;
+                    const int j01 = 3*(y0*nx + x1) + c;
+                    const int j10 = 3*(y1*nx + x0) + c;
+                    const int j11 = 3*(y1*nx + x1) + c;
 
-                const float v00 = img.data[j00];
-                const float v01 = img.data[j01];
-                const float v10 = img.data[j10];
-                const float v11 = img.data[j11];
+                    const float v00 = img.data[j00];
+                    const float v01 = img.data[j01];
+                    const float v10 = img.data[j10];
+                    const float v11 = img.data[j11];
 
-                const float v0 = v00*(1.0f - dx) + v01*dx;
-                const float v1 = v10*(1.0f - dx) + v11*dx;
+                    const float v0 = v00*(1.0f - dx) + v01*dx;
+                    const float v1 = v10*(1.0f - dx) + v11*dx;
 
-                const float v = v0*(1.0f - dy) + v1*dy;
+                    const float v = v0*(1.0f - dy) + v1*dy;
 
-                const uint8_t v2 = std::min(std::max(std::round(v), 0.0f), 255.0f);
+                    const uint8_t v2 = std::min(std::max(std::round(v), 0.0f), 255.0f);
 
-                const int i = 3*(y*nx3 + x) + c;
+                    const int i = 3*(y*nx3 + x) + c;
 
-                res.data[i] = (float(v2) - m3[c]) / s3[c];
+                    res.data[i] = (float(v2) - m3[c]) / s3[c];
+                }
             }
         }
-    }
+    });
 
     return true;
 }
 
-// load the model's weights from a file
-bool sam_ggml_model_load(const sam_params & params, sam_ggml_model & model) {
-    fprintf(stderr, "%s: loading model from '%s' - please wait ...\n", __func__, params.model.c_str());
+// 64-bit hash of a buffer (not cryptographic), 4 independent lanes of 8 bytes so it runs at memory speed
+static uint64_t sam_hash64(const void * data, size_t size, uint64_t seed) {
+    const uint64_t m = 0x9e3779b97f4a7c15ull;
 
-    auto fin = std::ifstream(params.model, std::ios::binary);
-    if (!fin) {
-        fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.model.c_str());
-        return false;
-    }
+    const uint8_t * p = (const uint8_t *) data;
 
-    // verify magic
-    {
-        uint32_t magic;
-        fin.read((char *) &magic, sizeof(magic));
-        if (magic != 0x67676d6c) {
-            fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, params.model.c_str());
-            return false;
+    uint64_t h[4] = { seed, seed + m, seed ^ (m >> 7), seed - m };
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int j = 0; j < 4; ++j) {
+            uint64_t w;
+            memcpy(&w, p + i + 8*j, sizeof(w));
+            h[j] = (h[j] ^ w)*m;
+            h[j] ^= h[j] >> 29;
         }
     }
 
-    // load hparams
-    {
-        // Override defaults with user choices
-        model.hparams.mask_threshold            = params.mask_threshold;
-        model.hparams.iou_threshold             = params.iou_threshold;
-        model.hparams.stability_score_threshold = params.stability_score_threshold;
-        model.hparams.stability_score_offset    = params.stability_score_offset;
-        model.hparams.eps                       = params.eps;
-        model.hparams.eps_decoder_transformer   = params.eps_decoder_transformer;
+    uint64_t r = size*m;
+    for (int j = 0; j < 4; ++j) {
+        r = (r ^ h[j])*m;
+        r ^= r >> 31;
+    }
 
-        auto & hparams = model.hparams;
+    for (; i < size; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, std::min<size_t>(8, size - i));
+        r = (r ^ w)*m;
+        r ^= r >> 29;
+    }
 
-        fin.read((char *) &hparams.n_enc_state,     sizeof(hparams.n_enc_state));
-        fin.read((char *) &hparams.n_enc_layer,     sizeof(hparams.n_enc_layer));
-        fin.read((char *) &hparams.n_enc_head,      sizeof(hparams.n_enc_head));
-        fin.read((char *) &hparams.n_enc_out_chans, sizeof(hparams.n_enc_out_chans));
-        fin.read((char *) &hparams.n_pt_embd,       sizeof(hparams.n_pt_embd));
-        fin.read((char *) &hparams.ftype,           sizeof(hparams.ftype));
+    // splitmix64 finalizer
+    r ^= r >> 30; r *= 0xbf58476d1ce4e5b9ull;
+    r ^= r >> 27; r *= 0x94d049bb133111ebull;
+    r ^= r >> 31;
 
-        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
+    return r;
+}
 
-        printf("%s: n_enc_state      = %d\n", __func__, hparams.n_enc_state);
-        printf("%s: n_enc_layer      = %d\n", __func__, hparams.n_enc_layer);
-        printf("%s: n_enc_head       = %d\n", __func__, hparams.n_enc_head);
-        printf("%s: n_enc_out_chans  = %d\n", __func__, hparams.n_enc_out_chans);
-        printf("%s: n_pt_embd        = %d\n", __func__, hparams.n_pt_embd);
-        printf("%s: ftype            = %d\n", __func__, hparams.ftype);
-        printf("%s: qntvr            = %d\n", __func__, qntvr);
+// the dense positional encoding of the image embedding, token-major [n_enc_out_chans, n_img_embd*n_img_embd]
+// the grid of the embedding pixel centers in [-1, 1] is returned in `xy`, to be filled by the caller
+static struct ggml_tensor * sam_fill_dense_pe(
+         const sam_ggml_model & model,
+          struct ggml_context * ctx0,
+           struct ggml_cgraph * gf,
+          struct ggml_tensor ** xy) {
 
-        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
+    const auto & hparams = model.hparams;
+    const auto & enc     = model.enc_prompt;
 
-    }
 
-    // for the big tensors, we have the option to store the data in 16-bit floats or quantized
-    // in order to save memory and also to speed up the computation
-    ggml_type wtype = ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
-    if (wtype == GGML_TYPE_COUNT) {
-        fprintf(stderr, "%s: invalid model file '%s' (bad ftype value %d)\n",
-                __func__, params.model.c_str(), model.hparams.ftype);
-        return false;
-    }
+    const int32_t n_img_embd = hparams.n_img_embd();
+    struct ggml_tensor * xy_embed_stacked = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2, n_img_embd, n_img_embd);
+    ggml_set_name(xy_embed_stacked, "xy_embed_stacked");
+    ggml_set_input(xy_embed_stacked);
+    *xy = xy_embed_stacked;
+
+    struct ggml_tensor * cur = ggml_mul_mat(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, enc.pe)), xy_embed_stacked);
+
+    cur = ggml_scale(ctx0, cur, float(2.0*M_PI));
+
+    // concat
+    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L192
+    cur = sam_sincos(ctx0, cur);
+
+    // the channels are innermost already, which is the token-major layout of the decoder
+    struct ggml_tensor * pe_img_dense = ggml_reshape_2d(ctx0, cur, cur->ne[0], cur->ne[1]*cur->ne[2]);
+    ggml_build_forward_expand(gf, pe_img_dense);
+
+    return pe_img_dense;
+}
+
+// compute the tensors that depend only on the weights and the fixed input size, once at load time:
+// - the relative position tables of the encoder attention, expanded for the window (local layers) or
+//   the full token grid (global layers), so the encoder graph doesn't have to expand them for every image
+// - the table of the prompt label embeddings, so the prompt encoder picks them with a single get_rows
+// - the dense positional encoding of the image embedding (pos_src of the mask decoder)
+static bool sam_ggml_model_precompute(sam_ggml_model & model) {
+    const auto & hparams = model.hparams;
+
+    const int32_t n_enc_layer    = hparams.n_enc_layer;
+    const int32_t n_enc_head_dim = hparams.n_enc_head_dim();
+
+    size_t ctx_pre_size = 0;
+    for (int il = 0; il < n_enc_layer; ++il) {
+        const auto & layer = model.enc_img.layers[il];
+
+        const int64_t n = hparams.is_global_attn(il) ? hparams.n_img_embd() : hparams.n_window_size();
+
+        ctx_pre_size += n_enc_head_dim*n*n*ggml_type_size(layer.rel_pos_w->type) + GGML_MEM_ALIGN;
+        ctx_pre_size += n_enc_head_dim*n*n*ggml_type_size(layer.rel_pos_h->type) + GGML_MEM_ALIGN;
+    }
+    ctx_pre_size += 2*n_enc_layer*ggml_tensor_overhead();
+
+    const int64_t n_lbl = model.enc_prompt.pt_embd.size() + 1;
+    ctx_pre_size += ggml_tensor_overhead() + hparams.n_enc_out_chans*n_lbl*sizeof(float) + GGML_MEM_ALIGN;
+
+    const int64_t n_tokens = hparams.n_img_embd()*hparams.n_img_embd();
+    const size_t  pe_size  = ggml_row_size(GGML_TYPE_F32, hparams.n_enc_out_chans)*n_tokens;
+    ctx_pre_size += ggml_tensor_overhead() + pe_size + GGML_MEM_ALIGN;
+
+    {
+        struct ggml_init_params ggml_params = {
+            /*.mem_size   =*/ ctx_pre_size,
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ false,
+        };
+
+        model.ctx_pre = ggml_init(ggml_params);
+        if (!model.ctx_pre) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            return false;
+        }
+    }
+
+    // the graph and the intermediate tensors live in a temporary context
+    // (the dense positional encoding goes through 4 intermediates of at most its size)
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ ctx_pre_size + 4*(pe_size + GGML_MEM_ALIGN) + ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(ggml_params);
+    if (!ctx0) {
+        fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+        return false;
+    }
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    for (int il = 0; il < n_enc_layer; ++il) {
+        auto & layer = model.enc_img.layers[il];
+
+        const int64_t n = hparams.is_global_attn(il) ? hparams.n_img_embd() : hparams.n_window_size();
+
+        layer.rel_pos_w_exp = ggml_new_tensor_3d(model.ctx_pre, layer.rel_pos_w->type, n_enc_head_dim, n, n);
+        layer.rel_pos_h_exp = ggml_new_tensor_3d(model.ctx_pre, layer.rel_pos_h->type, n_enc_head_dim, n, n);
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_get_rel_pos(ctx0, layer.rel_pos_w, n, n), layer.rel_pos_w_exp));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_get_rel_pos(ctx0, layer.rel_pos_h, n, n), layer.rel_pos_h_exp));
+    }
+
+    {
+        auto & enc = model.enc_prompt;
+
+        struct ggml_tensor * xy_embed_stacked = {};
+        struct ggml_tensor * pe_img_dense = sam_fill_dense_pe(model, ctx0, gf, &xy_embed_stacked);
+
+        enc.pe_dense = ggml_new_tensor_2d(model.ctx_pre, GGML_TYPE_F32, hparams.n_enc_out_chans, n_tokens);
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, pe_img_dense, enc.pe_dense));
+
+        const int32_t n_img_embd = hparams.n_img_embd();
+        const float n_img_embd_inv = 1.0f / n_img_embd;
+        float * data = (float *) ggml_get_data(xy_embed_stacked);
+        for (int i = 0; i < n_img_embd; ++i) {
+            const int row = 2*i*n_img_embd;
+            const float y_val = 2 * (i + 0.5f) * n_img_embd_inv - 1;
+            for (int j = 0; j < n_img_embd; ++j) {
+                const float x_val = 2 * (j + 0.5f) * n_img_embd_inv - 1;
+                data[row + 2*j + 0] = x_val;
+                data[row + 2*j + 1] = y_val;
+            }
+        }
+    }
+
+    std::vector<uint8_t> work_buffer;
+    ggml_graph_compute_helper(work_buffer, gf, 1, nullptr);
+
+    ggml_free(ctx0);
+
+    {
+        auto & enc = model.enc_prompt;
+
+        enc.lbl_embd = ggml_new_tensor_2d(model.ctx_pre, GGML_TYPE_F32, hparams.n_enc_out_chans, n_lbl);
+
+        for (int64_t i = 0; i < n_lbl; ++i) {
+            const struct ggml_tensor * src = i < n_lbl - 1 ? enc.pt_embd[i] : enc.not_a_pt_embd_w;
+            memcpy((char *) enc.lbl_embd->data + i*enc.lbl_embd->nb[1], src->data, ggml_nbytes(src));
+        }
+    }
+
+    return true;
+}
+
+// load the model's weights from a file
+bool sam_ggml_model_load(const sam_params & params, sam_ggml_model & model) {
+    fprintf(stderr, "%s: loading model from '%s' - please wait ...\n", __func__, params.model.c_str());
+
+    auto fin = std::ifstream(params.model, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.model.c_str());
+        return false;
+    }
+
+    // verify magic
+    {
+        uint32_t magic;
+        fin.read((char *) &magic, sizeof(magic));
+        if (magic != 0x67676d6c) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, params.model.c_str());
+            return false;
+        }
+    }
+
+    // load hparams
+    {
+        // Override defaults with user choices
+        model.hparams.mask_threshold            = params.mask_threshold;
+        model.hparams.iou_threshold             = params.iou_threshold;
+        model.hparams.stability_score_threshold = params.stability_score_threshold;
+        model.hparams.stability_score_offset    = params.stability_score_offset;
+        model.hparams.eps                       = params.eps;
+        model.hparams.eps_decoder_transformer   = params.eps_decoder_transformer;
+        model.hparams.gelu_fast                 = params.gelu_fast;
+        model.hparams.flat_window_threshold     = params.flat_window_threshold;
+        model.hparams.mask_output               = params.mask_output;
+        model.hparams.dec_attn_f16              = params.dec_attn_f16;
+
+        auto & hparams = model.hparams;
+
+        fin.read((char *) &hparams.n_enc_state,     sizeof(hparams.n_enc_state));
+        fin.read((char *) &hparams.n_enc_layer,     sizeof(hparams.n_enc_layer));
+        fin.read((char *) &hparams.n_enc_head,      sizeof(hparams.n_enc_head));
+        fin.read((char *) &hparams.n_enc_out_chans, sizeof(hparams.n_enc_out_chans));
+        fin.read((char *) &hparams.n_pt_embd,       sizeof(hparams.n_pt_embd));
+        fin.read((char *) &hparams.ftype,           sizeof(hparams.ftype));
+
+        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
+
+        printf("%s: n_enc_state      = %d\n", __func__, hparams.n_enc_state);
+        printf("%s: n_enc_layer      = %d\n", __func__, hparams.n_enc_layer);
+        printf("%s: n_enc_head       = %d\n", __func__, hparams.n_enc_head);
+        printf("%s: n_enc_out_chans  = %d\n", __func__, hparams.n_enc_out_chans);
+        printf("%s: n_pt_embd        = %d\n", __func__, hparams.n_pt_embd);
+        printf("%s: ftype            = %d\n", __func__, hparams.ftype);
+        printf("%s: qntvr            = %d\n", __func__, qntvr);
+
+        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
+
+    }
+
+    // for the big tensors, we have the option to store the data in 16-bit floats or quantized
+    // in order to save memory and also to speed up the computation
+    ggml_type wtype = ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
+    if (wtype == GGML_TYPE_COUNT) {
+        fprintf(stderr, "%s: invalid model file '%s' (bad ftype value %d)\n",
+                __func__, params.model.c_str(), model.hparams.ftype);
+        return false;
+    }
 
     auto & ctx = model.ctx;
 
@@ -565,9 +1284,14 @@ bool sam_ggml_model_load(const sam_params & params, sam_ggml_model & model) {
 
             ctx_size += n_enc_out_chans*ggml_type_size(GGML_TYPE_F32);
             ctx_size += n_pt_embd*n_enc_out_chans*ggml_type_size(GGML_TYPE_F32);
+
+            // mask downscaling
+            const int64_t n_mask_in_chans = hparams.n_mask_in_chans();
+            ctx_size += (2*2*1*(n_mask_in_chans/4) + 2*2*(n_mask_in_chans/4)*n_mask_in_chans + n_mask_in_chans*n_enc_out_chans)*ggml_type_size(GGML_TYPE_F32);
+            ctx_size += (3*(n_mask_in_chans/4) + 3*n_mask_in_chans + n_enc_out_chans)*ggml_type_size(GGML_TYPE_F32);
         }
 
-        ctx_size += (2 + n_pt_embd)*ggml_tensor_overhead();
+        ctx_size += (2 + n_pt_embd + 10)*ggml_tensor_overhead();
 
         // mask decoder
         {
@@ -644,13 +1368,22 @@ bool sam_ggml_model_load(const sam_params & params, sam_ggml_model & model) {
 
     // create the ggml context
     {
-        struct ggml_init_params params = {
+        // in NUMA mode the weights go to memory placed on the session's node (or interleaved over all nodes)
+        if (params.numa_node >= 0) {
+            model.buf_numa      = sam_numa_alloc(ctx_size, params.numa_node, params.numa_interleave);
+            model.buf_numa_size = ctx_size;
+            if (!model.buf_numa) {
+                return false;
+            }
+        }
+
+        struct ggml_init_params ggml_params = {
             /*.mem_size   =*/ ctx_size,
-            /*.mem_buffer =*/ NULL,
+            /*.mem_buffer =*/ model.buf_numa,
             /*.no_alloc   =*/ false,
         };
 
-        ctx = ggml_init(params);
+        ctx = ggml_init(ggml_params);
         if (!ctx) {
             fprintf(stderr, "%s: ggml_init() failed\n", __func__);
             return false;
@@ -776,6 +1509,30 @@ bool sam_ggml_model_load(const sam_params & params, sam_ggml_model & model) {
 
                 model.tensors["prompt_encoder.point_embeddings." + std::to_string(i) + ".weight"] = enc.pt_embd[i];
             }
+
+            const int n_mask_in_chans = hparams.n_mask_in_chans();
+
+            enc.mask_down_w.resize(5);
+            enc.mask_down_b.resize(5);
+
+            enc.mask_down_w[0] = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 2, 2, 1, n_mask_in_chans/4);
+            enc.mask_down_b[0] = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_mask_in_chans/4);
+            enc.mask_down_w[1] = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_mask_in_chans/4);
+            enc.mask_down_b[1] = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_mask_in_chans/4);
+            enc.mask_down_w[2] = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 2, 2, n_mask_in_chans/4, n_mask_in_chans);
+            enc.mask_down_b[2] = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_mask_in_chans);
+            enc.mask_down_w[3] = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_mask_in_chans);
+            enc.mask_down_b[3] = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_mask_in_chans);
+            enc.mask_down_w[4] = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 1, 1, n_mask_in_chans, n_enc_out_chans);
+            enc.mask_down_b[4] = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_enc_out_chans);
+
+            // the indices of nn.Sequential, the activations have no weights
+            const int mask_down_idx[5] = { 0, 1, 3, 4, 6 };
+            for (int i = 0; i < 5; i++) {
+                const auto prefix = "prompt_encoder.mask_downscaling." + std::to_string(mask_down_idx[i]) + ".";
+                model.tensors[prefix + "weight"] = enc.mask_down_w[i];
+                model.tensors[prefix + "bias"]   = enc.mask_down_b[i];
+            }
         }
 
         // mask decoder
@@ -960,6 +1717,7 @@ bool sam_ggml_model_load(const sam_params & params, sam_ggml_model & model) {
     // load weights
     {
         int n_tensors = 0;
+        int n_tensors_mask_down = 0;
         size_t total_size = 0;
 
         fprintf(stderr, "%s: ", __func__);
@@ -1033,6 +1791,12 @@ bool sam_ggml_model_load(const sam_params & params, sam_ggml_model & model) {
 
             fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
 
+            model.id = sam_hash64(tensor->data, ggml_nbytes(tensor), model.id);
+
+            if (name.rfind("prompt_encoder.mask_downscaling.", 0) == 0) {
+                n_tensors_mask_down++;
+            }
+
             total_size += ggml_nbytes(tensor);
             if (++n_tensors % 8 == 0) {
                 fprintf(stderr, ".");
@@ -1040,11 +1804,20 @@ bool sam_ggml_model_load(const sam_params & params, sam_ggml_model & model) {
             }
         }
 
-        if (n_tensors != int(model.tensors.size())) {
-            fprintf(stderr, "%s: model file has %d tensors, but %d tensors were expected\n", __func__, n_tensors, (int) model.tensors.size());
+        // the mask downscaling weights are optional: without them, the mask prompts are not available
+        const int n_mask_down = model.enc_prompt.mask_down_w.size() + model.enc_prompt.mask_down_b.size();
+        const int n_expected  = int(model.tensors.size()) - (n_tensors_mask_down == 0 ? n_mask_down : 0);
+
+        if (n_tensors != n_expected) {
+            fprintf(stderr, "%s: model file has %d tensors, but %d tensors were expected\n", __func__, n_tensors, n_expected);
             return false;
         }
 
+        model.enc_prompt.has_mask_down = n_tensors_mask_down == n_mask_down;
+        if (!model.enc_prompt.has_mask_down) {
+            fprintf(stderr, "%s: no mask downscaling weights in the model file, mask prompts are not available\n", __func__);
+        }
+
         fprintf(stderr, " done\n");
 
         fprintf(stderr, "%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size/1024.0/1024.0, n_tensors);
@@ -1052,99 +1825,274 @@ bool sam_ggml_model_load(const sam_params & params, sam_ggml_model & model) {
 
     fin.close();
 
-    return true;
-}
-
-struct ggml_tensor * sam_fill_dense_pe(
-         const sam_ggml_model & model,
-          struct ggml_context * ctx0,
-           struct ggml_cgraph * gf,
-               sam_ggml_state & state) {
-
-    const auto & hparams = model.hparams;
-    const auto & enc     = model.enc_prompt;
-
+    // the approximations of the encoder change the embedding, so they are part of the model identity
+    {
+        const float hp[] = { (float) model.hparams.gelu_fast, model.hparams.flat_window_threshold, model.hparams.eps };
 
-    const int32_t n_img_embd = hparams.n_img_embd();
-    struct ggml_tensor * xy_embed_stacked = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2, n_img_embd, n_img_embd);
-    ggml_set_name(xy_embed_stacked, "xy_embed_stacked");
-    ggml_set_input(xy_embed_stacked);
+        model.id = sam_hash64(hp, sizeof(hp), model.id);
+    }
 
-    struct ggml_tensor * cur = ggml_mul_mat(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, enc.pe)), xy_embed_stacked);
+    return sam_ggml_model_precompute(model);
+}
 
-    cur = ggml_scale(ctx0, cur, float(2.0*M_PI));
+// pixels of a row of LayerNorm2d processed at a time, with their statistics on the stack
+#define SAM_LN2D_BLOCK 256
+
+// LayerNorm2d kernel: normalize each pixel over the channels (ne2), then scale and shift per channel
+// a block of pixels of a row is processed at a time, so that the inner loops run over contiguous memory
+// the mean and variance are accumulated in double, as in ggml_norm
+static void ggml_sam_layer_norm_2d(
+                    struct ggml_tensor * dst,
+              const struct ggml_tensor * a,
+              const struct ggml_tensor * w,
+              const struct ggml_tensor * b,
+                                   int   ith,
+                                   int   nth,
+                                  void * userdata) {
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_are_same_shape(a, dst));
+    GGML_ASSERT(a->nb[0] == sizeof(float) && dst->nb[0] == sizeof(float));
+
+    const float eps = *(const float *) userdata;
+
+    const int64_t nx = a->ne[0];
+    const int64_t ny = a->ne[1];
+    const int64_t nc = a->ne[2];
+    const int64_t nr = ny*a->ne[3];
+
+    const float * wd = (const float *) w->data;
+    const float * bd = (const float *) b->data;
+
+    double mean[SAM_LN2D_BLOCK];
+    double var[SAM_LN2D_BLOCK];
+    float  rstd[SAM_LN2D_BLOCK];
+
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = std::min(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i1 = ir % ny;
+        const int64_t i3 = ir / ny;
+
+        const char * src_row = (const char *) a->data   + i1*a->nb[1]   + i3*a->nb[3];
+              char * dst_row = (char *)       dst->data + i1*dst->nb[1] + i3*dst->nb[3];
+
+        for (int64_t ix0 = 0; ix0 < nx; ix0 += SAM_LN2D_BLOCK) {
+            const int64_t n = std::min<int64_t>(SAM_LN2D_BLOCK, nx - ix0);
+
+            std::fill(mean, mean + n, 0.0);
+            std::fill(var,  var  + n, 0.0);
+
+            for (int64_t ic = 0; ic < nc; ++ic) {
+                const float * x = (const float *) (src_row + ic*a->nb[2]) + ix0;
+                for (int64_t ix = 0; ix < n; ++ix) {
+                    mean[ix] += x[ix];
+                }
+            }
+            for (int64_t ix = 0; ix < n; ++ix) {
+                mean[ix] /= nc;
+            }
 
-    // concat
-    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L192
-    {
-        struct ggml_tensor * t_sin = ggml_map_custom1(ctx0, cur, ggml_sam_sin, GGML_N_TASKS_MAX, NULL);
-        struct ggml_tensor * t_cos = ggml_map_custom1(ctx0, cur, ggml_sam_cos, GGML_N_TASKS_MAX, NULL);
+            for (int64_t ic = 0; ic < nc; ++ic) {
+                const float * x = (const float *) (src_row + ic*a->nb[2]) + ix0;
+                for (int64_t ix = 0; ix < n; ++ix) {
+                    const double d = x[ix] - mean[ix];
+                    var[ix] += d*d;
+                }
+            }
+            for (int64_t ix = 0; ix < n; ++ix) {
+                rstd[ix] = 1.0f/sqrtf(float(var[ix]/nc) + eps);
+            }
 
-        cur = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, t_sin->ne[0] + t_cos->ne[0], cur->ne[1], cur->ne[2]);
+            // in place is fine: each value is read for the last time right before it is written
+            for (int64_t ic = 0; ic < nc; ++ic) {
+                const float * x = (const float *) (src_row + ic*a->nb[2]) + ix0;
+                      float * y = (float *)       (dst_row + ic*dst->nb[2]) + ix0;
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, t_sin, ggml_view_3d(ctx0, cur, t_sin->ne[0], t_sin->ne[1], t_sin->ne[2], cur->nb[1], cur->nb[2], 0)));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, t_cos, ggml_view_3d(ctx0, cur, t_sin->ne[0], t_sin->ne[1], t_sin->ne[2], cur->nb[1], cur->nb[2], t_sin->nb[1])));
+                const float wc = wd[ic];
+                const float bc = bd[ic];
+                for (int64_t ix = 0; ix < n; ++ix) {
+                    y[ix] = (x[ix] - float(mean[ix]))*rstd[ix]*wc + bc;
+                }
+            }
+        }
     }
-
-    struct ggml_tensor * pe_img_dense = ggml_cont(ctx0, ggml_permute(ctx0, cur, 2, 0, 1, 3));
-    ggml_build_forward_expand(gf, pe_img_dense);
-
-    return pe_img_dense;
 }
 
+// LayerNorm2d: normalize along the channel dimension, in place
+// `eps` is read when the graph is computed, so it has to outlive the graph (e.g. point to the hparams)
+// ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/common.py#L31
 struct ggml_tensor* sam_layer_norm_2d(
                     struct ggml_context * ctx0,
                     struct ggml_tensor  * layer,
                     int                   n_channels,
                     struct ggml_tensor  * w,
                     struct ggml_tensor  * b,
-                    float                 eps) {
-    // LayerNorm2d
-    // normalize along channel dimmension
-    // TODO: better implementation
-    layer = ggml_permute(ctx0,
-                ggml_norm(ctx0, ggml_cont(ctx0, ggml_permute(ctx0, layer, 1, 2, 0, 3)), eps),
-                2, 0, 1, 3);
+                    const float         * eps) {
+    GGML_ASSERT(layer->ne[2] == n_channels && ggml_nelements(w) == n_channels && ggml_nelements(b) == n_channels);
+
+    return ggml_map_custom3_inplace(ctx0, layer, w, b, ggml_sam_layer_norm_2d, GGML_N_TASKS_MAX, (void *) eps);
+}
+
+// LayerNorm over ne0 with the affine transform fused: dst = (a - mean)/sqrt(var + eps)*w + b
+static void ggml_sam_norm_affine(
+                    struct ggml_tensor * dst,
+              const struct ggml_tensor * a,
+              const struct ggml_tensor * w,
+              const struct ggml_tensor * b,
+                                   int   ith,
+                                   int   nth,
+                                  void * userdata) {
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_are_same_shape(a, dst));
+    GGML_ASSERT(a->nb[0] == sizeof(float) && dst->nb[0] == sizeof(float));
+    GGML_ASSERT(ggml_nelements(w) == a->ne[0] && ggml_nelements(b) == a->ne[0]);
+
+    const float eps = *(const float *) userdata;
+
+    const int64_t n  = a->ne[0];
+    const int64_t nr = ggml_nrows(a);
+
+    const float * wd = (const float *) w->data;
+    const float * bd = (const float *) b->data;
+
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = std::min(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i1 = ir % a->ne[1];
+        const int64_t i2 = (ir / a->ne[1]) % a->ne[2];
+        const int64_t i3 = ir / (a->ne[1]*a->ne[2]);
+
+        const float * x = (const float *) ((const char *) a->data   + i1*a->nb[1]   + i2*a->nb[2]   + i3*a->nb[3]);
+              float * y = (float *)       ((char *)       dst->data + i1*dst->nb[1] + i2*dst->nb[2] + i3*dst->nb[3]);
+
+        // accumulated in double, as in ggml_norm
+        double sum = 0.0;
+        for (int64_t i = 0; i < n; ++i) {
+            sum += x[i];
+        }
+        const float mean = float(sum/n);
 
-    layer = ggml_add(ctx0,
-              ggml_mul(ctx0,
-                  ggml_repeat(ctx0, ggml_reshape_3d(ctx0, w, 1, 1, n_channels), layer),
-                  layer),
-              ggml_repeat(ctx0, ggml_reshape_3d(ctx0, b, 1, 1, n_channels), layer));
+        double sum2 = 0.0;
+        for (int64_t i = 0; i < n; ++i) {
+            const float d = x[i] - mean;
+            sum2 += (double) (d*d);
+        }
+        const float rstd = 1.0f/sqrtf(float(sum2/n) + eps);
 
-    return layer;
+        for (int64_t i = 0; i < n; ++i) {
+            y[i] = (x[i] - mean)*rstd*wd[i] + bd[i];
+        }
+    }
 }
 
-struct ggml_cgraph  * sam_encode_image(
-            const sam_ggml_model & model,
-                  sam_ggml_state & state,
-        const sam_image_f32 & img) {
+// expf without branches, so that the loops calling it are vectorized at the baseline ISA: reduction by the nearest
+// multiple of ln(2) in two parts (Cody-Waite), cephes' expf polynomial on the reduced value, then scaling by 2^n
+// through the exponent bits
+// x is clamped to [-87, 88] with arithmetic selects (gcc does not if-convert a float min/max under -ftrapping-math),
+// so a finite x gives a normal float; max rel error ~1.2e-7
+// ref: https://github.com/jeremybarnes/cephes/blob/master/single/expf.c
+static inline float sam_expf(float x) {
+    const float lo = (float) (x < -87.0f);
+    const float hi = (float) (x >  88.0f);
+    x = x*(1.0f - lo - hi) - 87.0f*lo + 88.0f*hi;
 
-    const auto & hparams = model.hparams;
-    const auto & enc     = model.enc_img;
+    // round to the nearest integer with the 1.5*2^23 trick
+    const float fn = (x*1.44269504088896341f + 12582912.0f) - 12582912.0f;
 
-    const int32_t n_enc_state     = hparams.n_enc_state;
-    const int32_t n_enc_layer     = hparams.n_enc_layer;
-    const int32_t n_enc_head      = hparams.n_enc_head;
-    const int32_t n_enc_head_dim  = hparams.n_enc_head_dim();
-    const int32_t n_enc_out_chans = hparams.n_enc_out_chans;
-    const int32_t n_img_size    = hparams.n_img_size();
-    const int32_t n_window_size = hparams.n_window_size();
+    const float r  = (x - fn*0.693359375f) + fn*2.12194440e-4f;
+    const float r2 = r*r;
 
-    struct ggml_init_params ggml_params = {
-        /*.mem_size   =*/ state.buf_compute_img_enc.size(),
-        /*.mem_buffer =*/ state.buf_compute_img_enc.data(),
-        /*.no_alloc   =*/ true, // skip allocating as we use ggml_alloc to allocate exact memory requirements
-    };
+    const float p = 1.0f + r + r2*(5.0000001201e-1f + r*(1.6666665459e-1f + r*(4.1665795894e-2f +
+                    r*(8.3334519073e-3f + r*(1.3981999507e-3f + r*1.9875691500e-4f)))));
 
-    struct ggml_context * ctx0   = ggml_init(ggml_params);
-    struct ggml_cgraph  * gf     = ggml_new_graph(ctx0);
+    const int32_t bits = ((int32_t) fn + 127) << 23;
 
-    struct ggml_tensor * inp = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_img_size, n_img_size, 3, 1);
-    ggml_set_name(inp, "inp");
-    ggml_set_input(inp);
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+
+    return p*scale;
+}
+
+// dst = gelu(a + b), with b broadcast over the rows of a
+// both approximations are x*sigmoid(z): the tanh one of ggml_gelu, 0.5*x*(1 + tanh(z/2)), with
+// z = 2*sqrt(2/pi)*(x + 0.044715*x^3), or with `fast` z = 1.702*x; sam_expf keeps the loop vectorized
+template <bool fast>
+static void ggml_sam_add_gelu(
+                    struct ggml_tensor * dst,
+              const struct ggml_tensor * a,
+              const struct ggml_tensor * b,
+                                   int   ith,
+                                   int   nth,
+                                  void * userdata) {
+    (void) userdata;
+
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_are_same_shape(a, dst));
+    GGML_ASSERT(a->nb[0] == sizeof(float) && dst->nb[0] == sizeof(float));
+    GGML_ASSERT(ggml_nelements(b) == a->ne[0]);
+
+    const float GELU_COEF_A    = 0.044715f;
+    const float SQRT_2_OVER_PI = 0.79788456080286535587989211986876f;
+
+    const int64_t n  = a->ne[0];
+    const int64_t nr = ggml_nrows(a);
+
+    const float * bd = (const float *) b->data;
+
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = std::min(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i1 = ir % a->ne[1];
+        const int64_t i2 = (ir / a->ne[1]) % a->ne[2];
+        const int64_t i3 = ir / (a->ne[1]*a->ne[2]);
+
+        const float * x = (const float *) ((const char *) a->data   + i1*a->nb[1]   + i2*a->nb[2]   + i3*a->nb[3]);
+              float * y = (float *)       ((char *)       dst->data + i1*dst->nb[1] + i2*dst->nb[2] + i3*dst->nb[3]);
+
+        for (int64_t i = 0; i < n; ++i) {
+            const float v = x[i] + bd[i];
+            const float z = fast ? 1.702f*v : 2.0f*SQRT_2_OVER_PI*v*(1.0f + GELU_COEF_A*v*v);
+
+            y[i] = v/(1.0f + sam_expf(-z));
+        }
+    }
+}
+
+// LayerNorm with weight and bias in a single pass over the input
+// `eps` is read when the graph is computed, so it has to outlive the graph (e.g. point to the hparams)
+static struct ggml_tensor * sam_norm_affine(
+                    struct ggml_context * ctx0,
+                    struct ggml_tensor  * cur,
+                    struct ggml_tensor  * w,
+                    struct ggml_tensor  * b,
+                    const float         * eps) {
+    return ggml_map_custom3(ctx0, cur, w, b, ggml_sam_norm_affine, GGML_N_TASKS_MAX, (void *) eps);
+}
+
+// bias + GELU activation in a single pass, in place
+static struct ggml_tensor * sam_add_gelu_inplace(
+                    struct ggml_context * ctx0,
+                    struct ggml_tensor  * cur,
+                    struct ggml_tensor  * b,
+                    bool                  fast) {
+    return ggml_map_custom2_inplace(ctx0, cur, b, fast ? ggml_sam_add_gelu<true> : ggml_sam_add_gelu<false>, GGML_N_TASKS_MAX, NULL);
+}
+
+// patch embedding + absolute positional embedding
+// ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L392
+struct ggml_tensor * sam_encode_image_patch_embd(
+      const sam_ggml_model & model,
+       struct ggml_context * ctx0,
+        struct ggml_tensor * inp) {
+
+    const auto & enc = model.enc_img;
 
-    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L392
     struct ggml_tensor * cur = ggml_conv_2d_sk_p0(ctx0, enc.proj_w, inp);
     cur = ggml_add_inplace(ctx0,
             cur,
@@ -1163,173 +2111,497 @@ struct ggml_cgraph  * sam_encode_image(
     // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L108-L109
     cur = ggml_add_inplace(ctx0, cur, enc.pe);
 
-    struct ggml_tensor * inpL = cur;
+    return cur;
+}
 
-    for (int il = 0; il < n_enc_layer; ++il) {
-        const auto & layer = enc.layers[il];
+// transformer block `il` of the image encoder
+// multi-head attention with relative positions over the tokens of each batch (window)
+// the queries are the top-left n_q_w x n_q_h tokens of each window, the others are only keys: they are the padding
+// of the windows cut by the edges of the token grid, whose outputs would be dropped by the reverse partition
+// qkv: [3*n_enc_state, W, H, B] -> [n_enc_state, n_q_w, n_q_h, B], before the output projection
+static struct ggml_tensor * sam_encode_image_attn(
+      const sam_ggml_model & model,
+       struct ggml_context * ctx0,
+                       int   il,
+        struct ggml_tensor * qkv,
+                   int64_t   n_q_w,
+                   int64_t   n_q_h) {
 
-        // norm
-        // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L168
-        {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
+    const auto & hparams = model.hparams;
+    const auto & layer   = model.enc_img.layers[il];
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_mul(ctx0, cur, layer.norm1_w);
-            cur = ggml_add_inplace(ctx0, cur, layer.norm1_b);
-        }
+    const int32_t n_enc_state     = hparams.n_enc_state;
+    const int32_t n_enc_head      = hparams.n_enc_head;
+    const int32_t n_enc_head_dim  = hparams.n_enc_head_dim();
 
-        const int64_t w0 = cur->ne[1];
-        const int64_t h0 = cur->ne[2];
+    struct ggml_tensor * cur = qkv;
+
+    // split qkv into separate tensors
+    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L225-L229
+    // Q, K and V are strided views of the qkv output in head-major order [n_enc_head_dim, W*H, B, n_enc_head],
+    // so only Q (needed contiguous by the rel-pos terms) and the transposed V are copied
+    const int64_t W = cur->ne[1];
+    const int64_t H = cur->ne[2];
+    const int64_t B = cur->ne[3];
+
+    GGML_ASSERT(n_q_w <= W && n_q_h <= H);
+
+    const size_t nb_head  = n_enc_head_dim*ggml_element_size(cur);
+    const size_t nb_token = cur->nb[1];
+    const size_t nb_batch = cur->nb[3];
+
+    struct ggml_tensor * Q;
+    struct ggml_tensor * K;
+    struct ggml_tensor * V;
+
+    // the query tokens are contiguous in full-width windows, otherwise their rows are,
+    // and the rows of all the windows have the same stride in full-height windows or a single window
+    if (n_q_w == W) {
+        Q = ggml_view_4d(ctx0, cur, n_enc_head_dim, n_enc_head, n_q_w*n_q_h, B, nb_head, nb_token, nb_batch, 0);
+    } else {
+        GGML_ASSERT(n_q_h == H || B == 1);
+        Q = ggml_view_4d(ctx0, cur, n_enc_head_dim, n_enc_head, n_q_w, n_q_h*B, nb_head, nb_token, cur->nb[2], 0);
+    }
+    Q = ggml_cont     (ctx0, ggml_permute(ctx0, Q, 0, 3, 1, 2));
+    Q = ggml_reshape_4d(ctx0, Q, n_enc_head_dim, n_q_w*n_q_h, B, n_enc_head);
 
-        if (hparams.is_global_attn(il) == false) {
-            // local attention layer - apply window partition
-            // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L169-L172
-            cur = ggml_win_part(ctx0, cur, n_window_size);
-        }
+    K = ggml_view_4d(ctx0, cur, n_enc_head_dim, n_enc_head, W*H, B, nb_head, nb_token, nb_batch, 1*n_enc_state*ggml_element_size(cur));
+    K = ggml_permute(ctx0, K, 0, 3, 1, 2);
 
-        const int64_t W = cur->ne[1];
-        const int64_t H = cur->ne[2];
+    V = ggml_view_4d(ctx0, cur, n_enc_head_dim, n_enc_head, W*H, B, nb_head, nb_token, nb_batch, 2*n_enc_state*ggml_element_size(cur));
+    V = ggml_cont   (ctx0, ggml_permute(ctx0, V, 1, 3, 0, 2)); // transposed
+    V = ggml_reshape_3d(ctx0, V, W*H, n_enc_head_dim, B*n_enc_head);
 
-        // self-attention
-        {
-            cur = ggml_mul_mat(ctx0, layer.qkv_w, cur);
-            cur = ggml_add_inplace(ctx0, cur, layer.qkv_b);
+    struct ggml_tensor * KQ = ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, K, Q), W*H, n_q_w*n_q_h, B*n_enc_head);
 
-            // split qkv into separate tensors
-            // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L225-L229
-            const int B = cur->ne[3];
+    struct ggml_tensor * KQ_scaled =
+        ggml_scale_inplace(ctx0,
+                KQ,
+                1.0f/sqrtf(n_enc_head_dim));
 
-            cur = ggml_reshape_4d(ctx0, cur, n_enc_state, 3, W*H, B);
-            cur = ggml_cont(ctx0, ggml_permute(ctx0, cur, 0, 3, 1, 2));
+    // the relative positions of the query rows and columns
+    struct ggml_tensor * rw = layer.rel_pos_w_exp;
+    struct ggml_tensor * rh = layer.rel_pos_h_exp;
+    GGML_ASSERT(rw->ne[1] == W && rh->ne[1] == H);
 
-            struct ggml_tensor * Q;
-            struct ggml_tensor * K;
-            struct ggml_tensor * V;
+    if (n_q_w < W) {
+        rw = ggml_view_3d(ctx0, rw, n_enc_head_dim, W, n_q_w, rw->nb[1], rw->nb[2], 0);
+    }
+    if (n_q_h < H) {
+        rh = ggml_view_3d(ctx0, rh, n_enc_head_dim, H, n_q_h, rh->nb[1], rh->nb[2], 0);
+    }
 
-            Q = ggml_view_3d   (ctx0, cur, n_enc_state, W*H, B, cur->nb[1], cur->nb[2], 0*cur->nb[3]);
-            Q = ggml_reshape_4d(ctx0, Q,   n_enc_head_dim, n_enc_head, W*H, B);
-            Q = ggml_cont      (ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
-            Q = ggml_reshape_3d(ctx0, Q,   n_enc_head_dim, W*H, B*n_enc_head);
+    struct ggml_tensor * q_r = ggml_reshape_4d(ctx0, Q, n_enc_head_dim, n_q_w, n_q_h, B*n_enc_head);
 
-            K = ggml_view_3d   (ctx0, cur, n_enc_state, W*H, B, cur->nb[1], cur->nb[2], 1*cur->nb[3]);
-            K = ggml_reshape_4d(ctx0, K,   n_enc_head_dim, n_enc_head, W*H, B);
-            K = ggml_cont      (ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
-            K = ggml_reshape_3d(ctx0, K,   n_enc_head_dim, W*H, B*n_enc_head);
+    struct ggml_tensor * rel_w = ggml_cont(ctx0, ggml_permute(ctx0,
+                ggml_mul_mat(ctx0,
+                    rw,
+                    ggml_cont(ctx0, ggml_permute(ctx0, q_r, 0, 2, 1, 3))),
+                0, 2, 1, 3));
+    struct ggml_tensor * rel_h = ggml_mul_mat(ctx0, rh, q_r);
 
-            V = ggml_view_3d   (ctx0, cur, n_enc_state, W*H, B, cur->nb[1], cur->nb[2], 2*cur->nb[3]);
-            V = ggml_reshape_4d(ctx0, V,   n_enc_head_dim, n_enc_head, W*H, B);
-            V = ggml_cont      (ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3)); // transposed
-            V = ggml_reshape_3d(ctx0, V,   W*H, n_enc_head_dim, B*n_enc_head);
+    struct ggml_tensor * attn = ggml_add_rel_pos_inplace(ctx0, KQ_scaled, rel_w, rel_h);
 
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+    struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, attn);
 
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale_inplace(ctx0,
-                        KQ,
-                        1.0f/sqrtf(n_enc_head_dim));
+    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-            struct ggml_tensor * rw = ggml_get_rel_pos(ctx0, layer.rel_pos_w, W, W);
-            struct ggml_tensor * rh = ggml_get_rel_pos(ctx0, layer.rel_pos_h, H, H);
+    cur =
+        ggml_reshape_4d(ctx0,
+                ggml_cont(ctx0,
+                    ggml_permute(ctx0,
+                        ggml_reshape_4d(ctx0, KQV, n_enc_head_dim, n_q_w*n_q_h, B, n_enc_head),
+                        0, 2, 3, 1)),
+                n_enc_state, n_q_w, n_q_h, B);
 
-            struct ggml_tensor * q_r = ggml_reshape_4d(ctx0, Q, n_enc_head_dim, W, H, B*n_enc_head);
+    return cur;
+}
+
+// local attention of the unpadded token grid qkv [3*n_enc_state, w0, h0] (without the bias)
+// ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L169-L172
+// the windows are attended to in blocks of windows of the same size: the ones inside the grid, and the ones cut by
+// its right edge, bottom edge and corner (ViT: 64 = 4*14 + 8 tokens), so that only the tokens of the grid are queries
+// each block is copied out of the grid (and padded) as in the window partition, and its output is written back
+// into the grid as in the reverse partition
+static struct ggml_tensor * sam_encode_image_attn_win(
+      const sam_ggml_model & model,
+       struct ggml_context * ctx0,
+                       int   il,
+        struct ggml_tensor * qkv) {
+
+    const auto & hparams = model.hparams;
+    const auto & layer   = model.enc_img.layers[il];
+
+    const int32_t n_enc_state   = hparams.n_enc_state;
+    const int64_t n_window_size = hparams.n_window_size();
+
+    const int64_t w0 = qkv->ne[1];
+    const int64_t h0 = qkv->ne[2];
+
+    GGML_ASSERT(qkv->ne[3] == 1 && ggml_is_contiguous(qkv));
 
-            struct ggml_tensor * rel_w = ggml_cont(ctx0, ggml_permute(ctx0,
-                        ggml_mul_mat(ctx0,
-                            rw,
-                            ggml_cont(ctx0, ggml_permute(ctx0, q_r, 0, 2, 1, 3))),
-                        0, 2, 1, 3));
-            struct ggml_tensor * rel_h = ggml_mul_mat(ctx0, rh, q_r);
+    struct ggml_tensor * res = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_enc_state, w0, h0);
 
-            struct ggml_tensor * attn = ggml_add_rel_pos_inplace(ctx0, KQ_scaled, rel_w, rel_h);
+    for (int iby = 0; iby < 2; ++iby) {
+        for (int ibx = 0; ibx < 2; ++ibx) {
+            // the windows of the block and their tokens inside the grid
+            const int64_t n_wx = ibx == 0 ? w0/n_window_size : (w0 % n_window_size != 0);
+            const int64_t n_wy = iby == 0 ? h0/n_window_size : (h0 % n_window_size != 0);
+            if (n_wx == 0 || n_wy == 0) {
+                continue;
+            }
+
+            const int64_t w  = ibx == 0 ? n_window_size : w0 % n_window_size;
+            const int64_t h  = iby == 0 ? n_window_size : h0 % n_window_size;
+            const int64_t x0 = ibx == 0 ? 0 : w0 - w;
+            const int64_t y0 = iby == 0 ? 0 : h0 - h;
+
+            struct ggml_tensor * cur = {};
+
+            if (w == n_window_size && h == n_window_size) {
+                cur = ggml_view_4d(ctx0, qkv, 3*n_enc_state*w, h, n_wx, n_wy,
+                        qkv->nb[2], n_window_size*qkv->nb[1], n_window_size*qkv->nb[2], 0);
+                cur = ggml_cont(ctx0, cur);
+            } else {
+                // a cut block is a single row or column of windows, padded with zero tokens as in window_partition
+                cur = ggml_view_3d(ctx0, qkv, 3*n_enc_state*w, h, n_wx*n_wy,
+                        qkv->nb[2], n_wx > 1 ? n_window_size*qkv->nb[1] : n_window_size*qkv->nb[2], x0*qkv->nb[1] + y0*qkv->nb[2]);
+                cur = ggml_pad(ctx0, cur, 3*n_enc_state*(n_window_size - w), n_window_size - h, 0, 0);
+            }
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, attn);
+            cur = ggml_reshape_4d(ctx0, cur, 3*n_enc_state, n_window_size, n_window_size, n_wx*n_wy);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+            // the padding tokens are zero, so their projection is just the bias
+            cur = ggml_add_inplace(ctx0, cur, layer.qkv_b);
 
-            cur =
-                ggml_reshape_4d(ctx0,
-                        ggml_cont(ctx0,
-                            ggml_permute(ctx0,
-                                ggml_reshape_4d(ctx0, KQV, n_enc_head_dim, W*H, n_enc_head, B),
-                                0, 2, 1, 3)),
-                        n_enc_state, W, H, B);
+            cur = sam_encode_image_attn(model, ctx0, il, cur, w, h);
 
-            cur = ggml_mul_mat(ctx0, layer.proj_w, cur);
-            cur = ggml_add_inplace(ctx0, cur, layer.proj_b);
+            res = ggml_set_inplace(ctx0, res, ggml_reshape_4d(ctx0, cur, n_enc_state*w, h, n_wx, n_wy),
+                    res->nb[2], n_window_size*res->nb[1], n_window_size*res->nb[2], x0*res->nb[1] + y0*res->nb[2]);
         }
+    }
+
+    return res;
+}
+
+// windows of the local attention layers that are computed in the approximate mode, see sam_flat_windows
+struct sam_window_skip {
+    int32_t n_keep = 0;
+
+    struct ggml_tensor * keep = {}; // I32 [n_keep]: the computed windows
+    struct ggml_tensor * src  = {}; // I32 [n_win]:  row of each window in concat(computed windows, V of all windows)
+};
+
+// windowed attention that is computed only for the windows in `skip.keep`
+// the other windows cover a near-constant image region, so their tokens are about equal,
+// the attention averages about equal values and its output is approximated by the token's own V
+static struct ggml_tensor * sam_encode_image_attn_skip(
+      const sam_ggml_model & model,
+       struct ggml_context * ctx0,
+                       int   il,
+        struct ggml_tensor * qkv,
+     const sam_window_skip & skip) {
+
+    const int32_t n_enc_state = model.hparams.n_enc_state;
+
+    const int64_t W     = qkv->ne[1];
+    const int64_t H     = qkv->ne[2];
+    const int64_t n_win = qkv->ne[3];
+
+    // V of all the windows, in the layout of the attention output
+    struct ggml_tensor * V = ggml_view_3d(ctx0, qkv, n_enc_state, W*H, n_win, qkv->nb[1], qkv->nb[3], 2*n_enc_state*ggml_element_size(qkv));
+    V = ggml_reshape_2d(ctx0, ggml_cont(ctx0, V), n_enc_state*W*H, n_win);
+
+    struct ggml_tensor * cur = V;
+
+    if (skip.n_keep > 0) {
+        struct ggml_tensor * kept = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, qkv, 3*n_enc_state*W*H, n_win), skip.keep);
+
+        kept = ggml_reshape_4d(ctx0, kept, 3*n_enc_state, W, H, skip.n_keep);
+        kept = sam_encode_image_attn(model, ctx0, il, kept, W, H);
+
+        cur = ggml_concat(ctx0, ggml_reshape_2d(ctx0, kept, n_enc_state*W*H, skip.n_keep), V, 1);
+        cur = ggml_get_rows(ctx0, cur, skip.src);
+    }
+
+    return ggml_reshape_4d(ctx0, cur, n_enc_state, W, H, n_win);
+}
+
+struct ggml_tensor * sam_encode_image_block(
+      const sam_ggml_model & model,
+       struct ggml_context * ctx0,
+                       int   il,
+        struct ggml_tensor * inpL,
+     const sam_window_skip * skip = nullptr) {
+
+    const auto & hparams = model.hparams;
+    const auto & layer   = model.enc_img.layers[il];
+
+    const int32_t n_window_size = hparams.n_window_size();
+
+    struct ggml_tensor * cur = {};
+
+    // norm
+    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L168
+    {
+        // cur = ln_0_w*norm(inpL) + ln_0_b
+        cur = sam_norm_affine(ctx0, inpL, layer.norm1_w, layer.norm1_b, &hparams.eps);
+    }
+
+    const int64_t w0 = cur->ne[1];
+    const int64_t h0 = cur->ne[2];
+
+    // self-attention
+    {
+        // the qkv projection runs on the unpadded token grid and the window partition is applied to its output
+        // the padding tokens are zero, so their projection is just the bias, which is added after the partition
+        // this gives the same result as partitioning first, without projecting the padding tokens of the edge windows
+        cur = ggml_mul_mat(ctx0, layer.qkv_w, cur);
+
+        const int64_t n_win = ((w0 + n_window_size - 1)/n_window_size)*((h0 + n_window_size - 1)/n_window_size);
+
+        if (hparams.is_global_attn(il)) {
+            cur = ggml_add_inplace(ctx0, cur, layer.qkv_b);
+            cur = sam_encode_image_attn(model, ctx0, il, cur, w0, h0);
+        } else if (skip && skip->n_keep < n_win) {
+            // local attention layer - apply window partition
+            // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L169-L172
+            cur = ggml_win_part(ctx0, cur, n_window_size);
+            cur = ggml_add_inplace(ctx0, cur, layer.qkv_b);
+
+            cur = sam_encode_image_attn_skip(model, ctx0, il, cur, *skip);
 
-        if (hparams.is_global_attn(il) == false) {
             // local attention layer - reverse window partition
+            // done before the output projection, which is per token, so the padding tokens are dropped first
             cur = ggml_win_unpart(ctx0, cur, w0, h0, n_window_size);
+        } else {
+            // local attention layer - the partition, attention and reverse partition of the windows, by blocks,
+            // without the padding tokens as queries
+            cur = sam_encode_image_attn_win(model, ctx0, il, cur);
         }
 
-        cur = ggml_add_inplace(ctx0, cur, inpL);
+        cur = ggml_mul_mat(ctx0, layer.proj_w, cur);
+        cur = ggml_add_inplace(ctx0, cur, layer.proj_b);
+    }
+
+    cur = ggml_add_inplace(ctx0, cur, inpL);
 
-        struct ggml_tensor * inpFF = cur;
+    struct ggml_tensor * inpFF = cur;
 
-        // feed-forward network
+    // feed-forward network
+    {
+        // norm
         {
-            // norm
-            {
-                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+            // cur = mlp_ln_w*norm(inpFF) + mlp_ln_b
+            cur = sam_norm_affine(ctx0, inpFF, layer.norm2_w, layer.norm2_b, &hparams.eps);
+        }
 
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_mul(ctx0, cur, layer.norm2_w);
-                cur = ggml_add_inplace(ctx0, cur, layer.norm2_b);
-            }
+        // fully connected + GELU activation
+        cur = ggml_mul_mat(ctx0, layer.mlp_lin1_w, cur);
+        cur = sam_add_gelu_inplace(ctx0, cur, layer.mlp_lin1_b, hparams.gelu_fast);
 
-            // fully connected
-            cur = ggml_mul_mat(ctx0, layer.mlp_lin1_w, cur);
-            cur = ggml_add_inplace(ctx0, cur, layer.mlp_lin1_b);
+        // projection
+        cur = ggml_mul_mat(ctx0, layer.mlp_lin2_w, cur);
+        cur = ggml_add_inplace(ctx0, cur, layer.mlp_lin2_b);
+    }
 
-            // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+    return ggml_add(ctx0, cur, inpFF);
+}
 
-            // projection
-            cur = ggml_mul_mat(ctx0, layer.mlp_lin2_w, cur);
-            cur = ggml_add_inplace(ctx0, cur, layer.mlp_lin2_b);
-        }
+// neck: project the encoder output to the embedding channels
+struct ggml_tensor * sam_encode_image_neck(
+      const sam_ggml_model & model,
+       struct ggml_context * ctx0,
+        struct ggml_tensor * inpL) {
 
-        inpL = ggml_add(ctx0, cur, inpFF);
-    }
+    const auto & hparams = model.hparams;
+    const auto & enc     = model.enc_img;
 
-    cur = ggml_cont(ctx0, ggml_permute(ctx0, inpL, 2, 0, 1, 3));
+    const int32_t n_enc_out_chans = hparams.n_enc_out_chans;
+
+    struct ggml_tensor * cur = ggml_cont(ctx0, ggml_permute(ctx0, inpL, 2, 0, 1, 3));
 
     cur = ggml_conv_2d_sk_p0(ctx0, enc.neck_conv_0, cur);
 
-    cur = sam_layer_norm_2d(ctx0, cur, n_enc_out_chans, enc.neck_norm_0_w, enc.neck_norm_0_b, hparams.eps);
+    cur = sam_layer_norm_2d(ctx0, cur, n_enc_out_chans, enc.neck_norm_0_w, enc.neck_norm_0_b, &hparams.eps);
 
     cur = ggml_conv_2d_s1_ph(ctx0, enc.neck_conv_1, cur);
 
-    cur = sam_layer_norm_2d(ctx0, cur, n_enc_out_chans, enc.neck_norm_1_w, enc.neck_norm_1_b, hparams.eps);
+    cur = sam_layer_norm_2d(ctx0, cur, n_enc_out_chans, enc.neck_norm_1_w, enc.neck_norm_1_b, &hparams.eps);
+
+    return cur;
+}
+
+// find the windows of the local attention layers that cover a near-constant region of the preprocessed image:
+// the range of every channel within the window is at most `threshold` pixel levels (0-255)
+// the windows are numbered as in ggml_win_part, row-major over the padded token grid
+static std::vector<bool> sam_flat_windows(
+         const sam_hparams & hparams,
+       const sam_image_f32 & img,
+                     float   threshold,
+               sam_workers & workers,
+                       int   n_threads) {
+
+    const int n_img_embd    = hparams.n_img_embd();
+    const int n_window_size = hparams.n_window_size();
+    const int n_window_px   = n_window_size*hparams.n_patch_size();
+
+    const int n_win_x = (n_img_embd + n_window_size - 1)/n_window_size;
+    const int n_win   = n_win_x*n_win_x;
+
+    std::vector<uint8_t> flat(n_win, 0);
+
+    sam_parallel_for(workers, n_threads, [&](int ith, int nth) {
+        for (int iw = ith; iw < n_win; iw += nth) {
+            const int x0 = (iw % n_win_x)*n_window_px;
+            const int y0 = (iw / n_win_x)*n_window_px;
+            const int x1 = std::min(x0 + n_window_px, img.nx);
+            const int y1 = std::min(y0 + n_window_px, img.ny);
+
+            float vmin[3] = {  INFINITY,  INFINITY,  INFINITY };
+            float vmax[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+            for (int y = y0; y < y1; ++y) {
+                const float * row = img.data.data() + 3*(y*img.nx + x0);
+                for (int x = 0; x < x1 - x0; ++x) {
+                    for (int c = 0; c < 3; ++c) {
+                        vmin[c] = std::min(vmin[c], row[3*x + c]);
+                        vmax[c] = std::max(vmax[c], row[3*x + c]);
+                    }
+                }
+            }
+
+            bool is_flat = true;
+            for (int c = 0; c < 3; ++c) {
+                is_flat = is_flat && (vmax[c] - vmin[c])*sam_pixel_std[c] <= threshold;
+            }
+
+            flat[iw] = is_flat;
+        }
+    });
+
+    return std::vector<bool>(flat.begin(), flat.end());
+}
+
+// copy the preprocessed RGBRGB... image into the planar layout of the encoder input
+static void sam_image_to_planar(const sam_image_f32 & img, float * data, sam_workers & workers, int n_threads) {
+    const int nx = img.nx;
+    const int ny = img.ny;
+    const int n  = nx*ny;
+
+    sam_parallel_for(workers, n_threads, [&](int ith, int nth) {
+        const int dr  = (ny + nth - 1)/nth;
+        const int ir0 = dr*ith;
+        const int ir1 = std::min(ir0 + dr, ny);
+
+        for (int k = 0; k < 3; k++) {
+            for (int y = ir0; y < ir1; y++) {
+                for (int x = 0; x < nx; x++) {
+                    data[k*n + y*nx + x] = img.data[3*(y*nx + x) + k];
+                }
+            }
+        }
+    });
+}
+
+struct ggml_cgraph  * sam_encode_image(
+            const sam_ggml_model & model,
+                  sam_ggml_state & state,
+        const sam_image_f32 & img,
+              struct ggml_tensor * embd_dst,
+                             int   n_threads) {
+
+    const auto & hparams = model.hparams;
+
+    const int32_t n_enc_layer = hparams.n_enc_layer;
+    const int32_t n_img_size  = hparams.n_img_size();
+
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ state.buf_compute_img_enc.size(),
+        /*.mem_buffer =*/ state.buf_compute_img_enc.data(),
+        /*.no_alloc   =*/ true, // skip allocating as we use ggml_alloc to allocate exact memory requirements
+    };
+
+    struct ggml_context * ctx0   = ggml_init(ggml_params);
+    struct ggml_cgraph  * gf     = ggml_new_graph_custom(ctx0, SAM_ENC_GRAPH_SIZE, false);
+
+    struct ggml_tensor * inp = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_img_size, n_img_size, 3, 1);
+    ggml_set_name(inp, "inp");
+    ggml_set_input(inp);
+
+    struct ggml_tensor * inpL = sam_encode_image_patch_embd(model, ctx0, inp);
+
+    // approximate mode: skip the local attention in the near-constant windows
+    sam_window_skip skip;
+
+    std::vector<int32_t> skip_keep;
+    std::vector<int32_t> skip_src;
+
+    if (hparams.flat_window_threshold > 0.0f) {
+        const std::vector<bool> flat = sam_flat_windows(hparams, img, hparams.flat_window_threshold, state.workers, n_threads);
+
+        const int n_win = flat.size();
+        for (int iw = 0; iw < n_win; ++iw) {
+            if (!flat[iw]) {
+                skip_keep.push_back(iw);
+            }
+        }
+
+        skip.n_keep = skip_keep.size();
+
+        skip_src.resize(n_win);
+        for (int iw = 0, ik = 0; iw < n_win; ++iw) {
+            skip_src[iw] = flat[iw] ? skip.n_keep + iw : ik++;
+        }
+
+        if (skip.n_keep > 0) {
+            skip.keep = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, skip.n_keep);
+            ggml_set_input(skip.keep);
+        }
+
+        skip.src = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_win);
+        ggml_set_input(skip.src);
+
+        fprintf(stderr, "%s: skipping the local attention in %d of %d flat windows\n", __func__, n_win - skip.n_keep, n_win);
+    }
+
+    for (int il = 0; il < n_enc_layer; ++il) {
+        inpL = sam_encode_image_block(model, ctx0, il, inpL, hparams.flat_window_threshold > 0.0f ? &skip : nullptr);
+    }
+
+    struct ggml_tensor * cur = sam_encode_image_neck(model, ctx0, inpL);
 
-    cur = ggml_cpy(ctx0, cur, state.embd_img);
+    cur = ggml_cpy(ctx0, cur, embd_dst);
 
     ggml_build_forward_expand(gf, cur);
-    ggml_disconnect_node_from_graph(state.embd_img);
+    ggml_disconnect_node_from_graph(embd_dst);
 
     //ggml_graph_print(&gf);
 
     ggml_free(ctx0);
 
+#ifdef SAM_USE_BLAS
+    if (!ggml_backend_sched_alloc_graph(state.sched, gf)) {
+        fprintf(stderr, "%s: failed to allocate the encoder graph\n", __func__);
+        return nullptr;
+    }
+#else
     ggml_gallocr_alloc_graph(state.allocr, gf);
+#endif
 
     {
         struct ggml_tensor * inp = ggml_graph_get_tensor(gf, "inp");
-        float * data = (float *) ggml_get_data(inp);
 
-        const int nx = img.nx;
-        const int ny = img.ny;
-        const int n  = nx*ny;
+        GGML_ASSERT(img.nx == n_img_size && img.ny == n_img_size);
 
-        GGML_ASSERT(nx == n_img_size && ny == n_img_size);
+        sam_image_to_planar(img, (float *) ggml_get_data(inp), state.workers, n_threads);
 
-        for (int k = 0; k < 3; k++) {
-            for (int y = 0; y < ny; y++) {
-                for (int x = 0; x < nx; x++) {
-                    data[k*n + y*nx + x] = img.data[3*(y*nx + x) + k];
-                }
-            }
+        // unused when no window (or every window) is skipped
+        if (skip.keep && skip.keep->data) {
+            memcpy(skip.keep->data, skip_keep.data(), ggml_nbytes(skip.keep));
+        }
+        if (skip.src && skip.src->data) {
+            memcpy(skip.src->data, skip_src.data(), ggml_nbytes(skip.src));
         }
     }
 
@@ -1339,73 +2611,145 @@ struct ggml_cgraph  * sam_encode_image(
 
 struct prompt_encoder_result {
     struct ggml_tensor * embd_prompt_sparse = {};
-    struct ggml_tensor * embd_prompt_dense = {};
+    struct ggml_tensor * embd_prompt_dense = {}; // token-major, relative to the no-mask embedding (null - no mask prompt)
 };
 
-// encode a prompt
+// row of sam_encoder_prompt::lbl_embd for a point label, or for a padding point (label < 0)
+// negative: pt_embd[0], positive: pt_embd[1], box corners: pt_embd[2] (top-left) and pt_embd[3] (bottom-right)
+// ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L76-L102
+static int32_t sam_prompt_label(const sam_ggml_model & model, int label) {
+    if (label < 0) {
+        return model.enc_prompt.pt_embd.size();
+    }
+
+    return std::min(label, (int) SAM_POINT_LABEL_BOX_BR);
+}
+
+static bool sam_prompt_has_box(const std::vector<sam_point> & points) {
+    for (const auto & pt : points) {
+        if (pt.label == SAM_POINT_LABEL_BOX_TL || pt.label == SAM_POINT_LABEL_BOX_BR) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the number of prompt tokens: the points and the box corners, plus a padding point when there is no box
+// ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L160-L163
+static size_t sam_prompt_n_tokens(const std::vector<sam_point> & points) {
+    return points.size() + (sam_prompt_has_box(points) ? 0 : 1);
+}
+
+// a box is given by its two corners, once: check the labels of a prompt
+static bool sam_prompt_check(const std::vector<sam_point> & points) {
+    int n_tl = 0;
+    int n_br = 0;
+    for (const auto & pt : points) {
+        if (pt.label < SAM_POINT_LABEL_NEG || pt.label > SAM_POINT_LABEL_BOX_BR) {
+            fprintf(stderr, "%s: invalid point label %d\n", __func__, pt.label);
+            return false;
+        }
+        n_tl += pt.label == SAM_POINT_LABEL_BOX_TL;
+        n_br += pt.label == SAM_POINT_LABEL_BOX_BR;
+    }
+
+    if (n_tl != n_br || n_tl > 1) {
+        fprintf(stderr, "%s: a box needs one top-left and one bottom-right corner\n", __func__);
+        return false;
+    }
+
+    return true;
+}
+
+// encode a batch of n_prompts prompts of n_pt tokens, padded with not-a-point entries
 //
 // - points
-// - boxes
+// - boxes, as their two corners, like points with their own label embeddings
 // - masks
 //
-// TODO: currently just encode a single point for simplicity
+// inputs, filled by sam_fast_graph_set_inputs:
+// - prompt_input  [2, n_pt, n_prompts]: the point coordinates in [-1, 1]
+// - prompt_labels [n_pt*n_prompts]: the rows of lbl_embd, see sam_prompt_label
+// - prompt_keep   [1, n_pt, n_prompts]: 1 for the points, 0 for the padding, whose positional encoding is dropped
+//
+// with `use_mask`, the low-res logits of a previous mask, the same for the whole batch:
+// - prompt_mask   [4*n_img_embd, 4*n_img_embd]: downscaled to the dense prompt embedding
 //
 prompt_encoder_result sam_encode_prompt(
-            const sam_ggml_model & model,
-             struct ggml_context * ctx0,
-              struct ggml_cgraph * gf,
-                  sam_ggml_state & state,
-    const std::vector<sam_point> & points) {
+                         const sam_ggml_model & model,
+                          struct ggml_context * ctx0,
+                           struct ggml_cgraph * gf,
+                               sam_ggml_state & state,
+                                          int   n_pt,
+                                          int   n_prompts,
+                                         bool   use_mask) {
     
     const auto & hparams = model.hparams;
     const auto & enc = model.enc_prompt;
 
-    // Create input tensor with size for all points
-    struct ggml_tensor * inp = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2, points.size() + 1); // +1 for padding
+    struct ggml_tensor * inp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2, n_pt, n_prompts);
     ggml_set_name(inp, "prompt_input");
     ggml_set_input(inp);
 
+    struct ggml_tensor * labels = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_pt*n_prompts);
+    ggml_set_name(labels, "prompt_labels");
+    ggml_set_input(labels);
+
+    struct ggml_tensor * keep = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 1, n_pt, n_prompts);
+    ggml_set_name(keep, "prompt_keep");
+    ggml_set_input(keep);
+
     struct ggml_tensor * cur = ggml_mul_mat(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, enc.pe)), inp);
 
     cur = ggml_scale(ctx0, cur, float(2.0*M_PI));
 
     // concat
     // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L192
-    {
-        struct ggml_tensor * t_sin = ggml_map_custom1(ctx0, cur, ggml_sam_sin, GGML_N_TASKS_MAX, NULL);
-        struct ggml_tensor * t_cos = ggml_map_custom1(ctx0, cur, ggml_sam_cos, GGML_N_TASKS_MAX, NULL);
-
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, t_sin->ne[0] + t_cos->ne[0], cur->ne[1]);
+    cur = sam_sincos(ctx0, cur);
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, t_sin, ggml_view_2d(ctx0, cur, t_sin->ne[0], t_sin->ne[1], cur->nb[1], 0)));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, t_cos, ggml_view_2d(ctx0, cur, t_sin->ne[0], t_sin->ne[1], cur->nb[1], t_sin->nb[1])));
-
-        // overwrite label == -1 with not_a_point_embed.weight
-        // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L86
-        // Handle not_a_point_embed for padding
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, enc.not_a_pt_embd_w, 
-            ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], points.size() * cur->nb[1])));
-    }
+    // zero the padding points and add the label embeddings: pt_embd[label], or not_a_point_embed for the padding
+    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L81-L91
+    {
+        struct ggml_tensor * embd_lbl = ggml_get_rows(ctx0, enc.lbl_embd, labels);
+        embd_lbl = ggml_reshape_3d(ctx0, embd_lbl, cur->ne[0], n_pt, n_prompts);
 
-    // add point embeddings based on label (positive: pt_embd[1], negative: pt_embd[0])
-    // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L90
-    for (size_t i = 0; i < points.size(); i++) {
-        struct ggml_tensor * v = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], i * cur->nb[1]);
-        // Use pt_embd[1] for positive points (label=1) and pt_embd[0] for negative points (label=0)
-        struct ggml_tensor * embd = points[i].label > 0 ? enc.pt_embd[1] : enc.pt_embd[0];
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_add_inplace(ctx0, v, embd), v));
+        cur = ggml_add(ctx0, ggml_mul(ctx0, cur, keep), embd_lbl);
     }
 
     struct ggml_tensor * embd_prompt_sparse = cur;
     ggml_build_forward_expand(gf, embd_prompt_sparse);
 
-    struct ggml_tensor * embd_prompt_dense = ggml_repeat(ctx0,
-            ggml_cont(ctx0,
-                ggml_view_3d(ctx0, enc.no_mask_embd_w,
-                    1, 1, enc.no_mask_embd_w->ne[0], enc.no_mask_embd_w->nb[0], enc.no_mask_embd_w->nb[0], 0)),
-            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hparams.n_img_embd(), hparams.n_img_embd(), hparams.n_enc_out_chans));
+    // without a mask prompt, the no-mask dense embedding is part of the cached decoder input, see sam_dec_inputs_prepare
+    struct ggml_tensor * embd_prompt_dense = {};
+    if (use_mask) {
+        const int n_img_embd = hparams.n_img_embd();
+
+        struct ggml_tensor * mask = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, 4*n_img_embd, 4*n_img_embd, 1, 1);
+        ggml_set_name(mask, "prompt_mask");
+        ggml_set_input(mask);
+
+        // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L53-L61
+        cur = ggml_conv_2d_sk_p0(ctx0, enc.mask_down_w[0], mask);
+        cur = ggml_add_inplace(ctx0, cur, ggml_reshape_3d(ctx0, enc.mask_down_b[0], 1, 1, enc.mask_down_b[0]->ne[0]));
+        cur = sam_layer_norm_2d(ctx0, cur, enc.mask_down_w[1]->ne[0], enc.mask_down_w[1], enc.mask_down_b[1], &hparams.eps);
+        cur = ggml_gelu_inplace(ctx0, cur);
 
-    ggml_build_forward_expand(gf, embd_prompt_dense);
+        cur = ggml_conv_2d_sk_p0(ctx0, enc.mask_down_w[2], cur);
+        cur = ggml_add_inplace(ctx0, cur, ggml_reshape_3d(ctx0, enc.mask_down_b[2], 1, 1, enc.mask_down_b[2]->ne[0]));
+        cur = sam_layer_norm_2d(ctx0, cur, enc.mask_down_w[3]->ne[0], enc.mask_down_w[3], enc.mask_down_b[3], &hparams.eps);
+        cur = ggml_gelu_inplace(ctx0, cur);
+
+        cur = ggml_conv_2d_sk_p0(ctx0, enc.mask_down_w[4], cur);
+        cur = ggml_add_inplace(ctx0, cur, ggml_reshape_3d(ctx0, enc.mask_down_b[4], 1, 1, enc.mask_down_b[4]->ne[0]));
+
+        // token-major, as the decoder input, and relative to the no-mask embedding that the cached src holds already
+        cur = ggml_cont(ctx0, ggml_transpose(ctx0, ggml_reshape_2d(ctx0, cur, cur->ne[0]*cur->ne[1], cur->ne[2])));
+        cur = ggml_sub(ctx0, cur, enc.no_mask_embd_w);
+
+        embd_prompt_dense = cur;
+        ggml_build_forward_expand(gf, embd_prompt_dense);
+    }
 
     //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 
@@ -1415,15 +2759,178 @@ prompt_encoder_result sam_encode_prompt(
     return res;
 }
 
+// head size limit of sam_attn, the mask decoder has 16 (cross attention) and 32 (self attention)
+#define SAM_ATTN_MAX_HEAD_DIM 128
+
+static inline const float * sam_attn_row(const float * x, float * buf, int64_t n) {
+    (void) buf;
+    (void) n;
+    return x;
+}
+
+static inline const float * sam_attn_row(const ggml_fp16_t * x, float * buf, int64_t n) {
+    ggml_fp16_to_fp32_row(x, buf, n);
+    return buf;
+}
+
+// softmax(q*k^T/sqrt(d))*v of each head, one query at a time with the online softmax of flash attention,
+// so the scores are never stored; the heads are the channel slices of the projections, so neither the inputs
+// nor the output are permuted or copied
+// q, dst [n_embd, n_q, n_batch] F32, k, v [n_embd, n_kv, n_batch] of type T
+// with `n_kv_valid` [n_batch], only the first n_kv_valid[ib] keys of batch entry ib are attended to, the others are
+// padding: skipping them is the same as masking their scores to -INF
+template <typename T>
+static void sam_attn_heads(
+        struct ggml_tensor * dst,
+  const struct ggml_tensor * q,
+  const struct ggml_tensor * k,
+  const struct ggml_tensor * v,
+             const int32_t * n_kv_valid,
+                       int   n_head,
+                       int   ith,
+                       int   nth) {
+    const int64_t n_embd = q->ne[0];
+    const int64_t n_q    = q->ne[1];
+    const int64_t n_kv   = k->ne[1];
+    const int64_t d      = n_embd/n_head;
+
+    const float scale = 1.0f/sqrtf(float(d));
+
+    float buf_k[SAM_ATTN_MAX_HEAD_DIM];
+    float buf_v[SAM_ATTN_MAX_HEAD_DIM];
+    float acc[SAM_ATTN_MAX_HEAD_DIM];
+
+    const int64_t nr  = n_head*n_q*q->ne[2];
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = std::min(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t h  = ir % n_head;
+        const int64_t iq = (ir / n_head) % n_q;
+        const int64_t ib = ir / (n_head*n_q);
+
+        const int64_t n_kv_ib = n_kv_valid ? n_kv_valid[ib] : n_kv;
+
+        const float * qd = (const float *) ((const char *) q->data + iq*q->nb[1] + ib*q->nb[2]) + h*d;
+
+        float m = -INFINITY;
+        float l = 0.0f;
+        std::fill(acc, acc + d, 0.0f);
+
+        for (int64_t j = 0; j < n_kv_ib; ++j) {
+            const float * kd = sam_attn_row((const T *) ((const char *) k->data + j*k->nb[1] + ib*k->nb[2]) + h*d, buf_k, d);
+
+            // 8 partial sums, so that the dot product is vectorized
+            float sv[8] = { 0.0f };
+            for (int64_t i = 0; i < d; i += 8) {
+                for (int64_t i8 = 0; i8 < 8; ++i8) {
+                    sv[i8] += qd[i + i8]*kd[i + i8];
+                }
+            }
+            const float s = scale*(((sv[0] + sv[1]) + (sv[2] + sv[3])) + ((sv[4] + sv[5]) + (sv[6] + sv[7])));
+
+            // a new maximum rescales what is accumulated so far
+            if (s > m) {
+                const float c = expf(m - s);
+                l *= c;
+                for (int64_t i = 0; i < d; ++i) {
+                    acc[i] *= c;
+                }
+                m = s;
+            }
+
+            const float p = expf(s - m);
+            l += p;
+
+            const float * vd = sam_attn_row((const T *) ((const char *) v->data + j*v->nb[1] + ib*v->nb[2]) + h*d, buf_v, d);
+            for (int64_t i = 0; i < d; ++i) {
+                acc[i] += p*vd[i];
+            }
+        }
+
+        float * y = (float *) ((char *) dst->data + iq*dst->nb[1] + ib*dst->nb[2]) + h*d;
+        for (int64_t i = 0; i < d; ++i) {
+            y[i] = acc[i]/l;
+        }
+    }
+}
+
+static void ggml_sam_attn(struct ggml_tensor * dst, const struct ggml_tensor * q, const struct ggml_tensor * k, const struct ggml_tensor * v, int ith, int nth, void * userdata) {
+    const int n_head = *(const int32_t *) userdata;
+
+    GGML_ASSERT(q->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(k->type == v->type && (k->type == GGML_TYPE_F32 || k->type == GGML_TYPE_F16));
+    GGML_ASSERT(ggml_are_same_shape(q, dst));
+    GGML_ASSERT(ggml_are_same_shape(k, v));
+    GGML_ASSERT(k->ne[0] == q->ne[0] && k->ne[2] == q->ne[2]);
+    GGML_ASSERT(q->ne[0] % n_head == 0 && (q->ne[0]/n_head) % 8 == 0 && q->ne[0]/n_head <= SAM_ATTN_MAX_HEAD_DIM);
+    GGML_ASSERT(q->nb[0] == sizeof(float) && dst->nb[0] == sizeof(float));
+    GGML_ASSERT(k->nb[0] == ggml_type_size(k->type) && v->nb[0] == ggml_type_size(v->type));
+
+    if (k->type == GGML_TYPE_F16) {
+        sam_attn_heads<ggml_fp16_t>(dst, q, k, v, nullptr, n_head, ith, nth);
+    } else {
+        sam_attn_heads<float>(dst, q, k, v, nullptr, n_head, ith, nth);
+    }
+}
+
+// ggml_sam_attn with padded keys: k and v are the two halves of the rows of kv [2*n_embd, n_kv, n_batch] F32,
+// and n_kv_valid [n_batch] I32 is the number of keys of each batch entry that are not padding
+static void ggml_sam_attn_masked(struct ggml_tensor * dst, const struct ggml_tensor * q, const struct ggml_tensor * kv, const struct ggml_tensor * n_kv_valid, int ith, int nth, void * userdata) {
+    const int n_head = *(const int32_t *) userdata;
+
+    GGML_ASSERT(q->type == GGML_TYPE_F32 && kv->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(n_kv_valid->type == GGML_TYPE_I32 && ggml_is_contiguous(n_kv_valid));
+    GGML_ASSERT(ggml_are_same_shape(q, dst));
+    GGML_ASSERT(kv->ne[0] == 2*q->ne[0] && kv->ne[2] == q->ne[2] && ggml_nelements(n_kv_valid) == q->ne[2]);
+    GGML_ASSERT(q->ne[0] % n_head == 0 && (q->ne[0]/n_head) % 8 == 0 && q->ne[0]/n_head <= SAM_ATTN_MAX_HEAD_DIM);
+    GGML_ASSERT(q->nb[0] == sizeof(float) && kv->nb[0] == sizeof(float) && dst->nb[0] == sizeof(float));
+
+    const int32_t * n_valid = (const int32_t *) n_kv_valid->data;
+    for (int64_t ib = 0; ib < q->ne[2]; ++ib) {
+        GGML_ASSERT(n_valid[ib] > 0 && n_valid[ib] <= kv->ne[1]);
+    }
+
+    // views of the two halves, the strides are those of kv
+    struct ggml_tensor k = *kv;
+    struct ggml_tensor v = *kv;
+    k.ne[0] = q->ne[0];
+    v.ne[0] = q->ne[0];
+    v.data  = (char *) kv->data + q->ne[0]*sizeof(float);
+
+    sam_attn_heads<float>(dst, q, &k, &v, n_valid, n_head, ith, nth);
+}
+
+// multi-head attention of the projected q [n_embd, n_q, n_batch] over k, v [n_embd, n_kv, n_batch] (F32 or F16),
+// with the heads merged in the result [n_embd, n_q, n_batch], in a single op
+// with `n_kv_valid` [n_batch] I32, the keys after the first n_kv_valid[ib] of each batch entry are padding and are masked
+// out, k and v have to be F32 then
+// `n_head` is read when the graph is computed, so it has to outlive the graph (e.g. point to the hparams)
+static struct ggml_tensor * sam_attn(
+                    struct ggml_context * ctx0,
+                    struct ggml_tensor  * q,
+                    struct ggml_tensor  * k,
+                    struct ggml_tensor  * v,
+                    struct ggml_tensor  * n_kv_valid,
+                    const int32_t       * n_head) {
+    if (n_kv_valid) {
+        return ggml_map_custom3(ctx0, q, ggml_concat(ctx0, k, v, 0), n_kv_valid, ggml_sam_attn_masked, GGML_N_TASKS_MAX, (void *) n_head);
+    }
+
+    return ggml_map_custom3(ctx0, q, k, v, ggml_sam_attn, GGML_N_TASKS_MAX, (void *) n_head);
+}
+
+// with `n_kv_valid`, the keys are the prompt tokens, padded: see sam_attn
 struct ggml_tensor* sam_decode_mask_transformer_attn(
     const sam_layer_dec_transformer_attn & attn,
                       struct ggml_tensor * queries,
                       struct ggml_tensor * keys,
                       struct ggml_tensor * values,
+                      struct ggml_tensor * n_kv_valid,
                      struct ggml_context * ctx0,
                     const sam_ggml_model & model) {
     const auto & hparams = model.hparams;
-    const int n_head = hparams.n_dec_heads;
 
     struct ggml_tensor * Qcur = {};
     struct ggml_tensor * Kcur = {};
@@ -1438,31 +2945,16 @@ struct ggml_tensor* sam_decode_mask_transformer_attn(
     Vcur = ggml_mul_mat(ctx0, attn.v_w, values);
     Vcur = ggml_add_inplace(ctx0, Vcur, attn.v_b);
 
-    struct ggml_tensor * Q = {};
-    struct ggml_tensor * K = {};
-    struct ggml_tensor * V = {};
-
-    Q = ggml_reshape_4d(ctx0, Qcur, Qcur->ne[0]/n_head, n_head, Qcur->ne[1], Qcur->ne[2]);
-    Q = ggml_cont(ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
-
-    K = ggml_reshape_4d(ctx0, Kcur, Kcur->ne[0]/n_head, n_head, Kcur->ne[1], Kcur->ne[2]);
-    K = ggml_cont(ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
-
-    V = ggml_reshape_4d(ctx0, Vcur, Vcur->ne[0]/n_head, n_head, Vcur->ne[1], Vcur->ne[2]);
-    V = ggml_cont(ctx0, ggml_permute(ctx0, V, 0, 2, 1, 3));
-
-    // Q * K
-    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-    struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, 1.0f/sqrt(float(Q->ne[0])));
-
-    struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_scaled);
+    // half the memory traffic of the keys and values, the 4096 image tokens on one side of the cross attention
+    // (the masked keys are the few prompt tokens, and stay F32)
+    if (hparams.dec_attn_f16 && !n_kv_valid) {
+        Kcur = ggml_cast(ctx0, Kcur, GGML_TYPE_F16);
+        Vcur = ggml_cast(ctx0, Vcur, GGML_TYPE_F16);
+    }
 
-    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, KQ_soft_max, ggml_cont(ctx0, ggml_transpose(ctx0, V)));
+    // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/transformer.py#L231-L236
+    struct ggml_tensor * KQV_merged = sam_attn(ctx0, Qcur, Kcur, Vcur, n_kv_valid, &hparams.n_dec_heads);
 
-    struct ggml_tensor * KQV_merged = ggml_cont(ctx0, ggml_transpose(ctx0, KQV));
-    KQV_merged = ggml_cont(ctx0, ggml_permute(ctx0, KQV_merged, 0, 2, 1, 3));
-    KQV_merged = ggml_reshape_3d(ctx0, KQV_merged, KQV_merged->ne[0]*KQV_merged->ne[1], KQV_merged->ne[2], KQV_merged->ne[3]);
     KQV_merged = ggml_mul_mat(ctx0, attn.out_w, KQV_merged);
     KQV_merged = ggml_add_inplace(ctx0, KQV_merged, attn.out_b);
 
@@ -1496,10 +2988,26 @@ struct ggml_tensor * sam_decode_mask_mlp_relu_3(
     return cur;
 }
 
+// an image embedding stored as F16 or Q8_0, decoded to F32 with a get_rows over all its rows
+// the row indices are filled by sam_dec_inputs_prepare ("embd_rows")
+static struct ggml_tensor * sam_embd_dequantize(struct ggml_context * ctx0, struct ggml_tensor * embd) {
+    const int64_t n_rows = ggml_nrows(embd);
+
+    struct ggml_tensor * rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_rows);
+    ggml_set_name(rows, "embd_rows");
+    ggml_set_input(rows);
+
+    struct ggml_tensor * cur = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, embd, embd->ne[0], n_rows), rows);
+
+    return ggml_reshape_3d(ctx0, cur, embd->ne[0], embd->ne[1], embd->ne[2]);
+}
+
+// src and pos_src are the token-major decoder inputs of the image, see sam_dec_inputs_prepare
 bool sam_decode_mask(
                const sam_ggml_model & model,
         const prompt_encoder_result & prompt,
-                 struct ggml_tensor * pe_img,
+                 struct ggml_tensor * pos_src,
+                 struct ggml_tensor * src,
                 struct ggml_context * ctx0,
                 struct ggml_cgraph  * gf,
                      sam_ggml_state & state) {
@@ -1508,74 +3016,39 @@ bool sam_decode_mask(
     const auto & dec = model.dec;
     const int n_img_embd = hparams.n_img_embd();
 
-    // Get the actual number of points plus 1 for padding
-    const int n_points = prompt.embd_prompt_sparse->ne[1];
-
     struct ggml_tensor * tokens = {};
     {
         // Concatenate output tokens
         // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L120
         const auto& sparse = prompt.embd_prompt_sparse;
 
-        tokens = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, dec.iou_token_w->ne[0], dec.iou_token_w->ne[1] + dec.mask_tokens_w->ne[1] + sparse->ne[1], sparse->ne[2]);
+        // the output tokens are the same for every prompt of the batch
+        struct ggml_tensor * output_tokens = ggml_concat(ctx0, dec.iou_token_w, dec.mask_tokens_w, 1);
+        output_tokens = ggml_repeat(ctx0, output_tokens,
+                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, output_tokens->ne[0], output_tokens->ne[1], sparse->ne[2]));
 
-        const size_t offsets[3] = { 0, dec.iou_token_w->ne[1]*tokens->nb[1], dec.iou_token_w->ne[1]*tokens->nb[1] + dec.mask_tokens_w->ne[1]*tokens->nb[1] };
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, dec.iou_token_w,   ggml_view_2d(ctx0, tokens, tokens->ne[0], dec.iou_token_w->ne[1],   tokens->nb[1], offsets[0])));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, dec.mask_tokens_w, ggml_view_2d(ctx0, tokens, tokens->ne[0], dec.mask_tokens_w->ne[1], tokens->nb[1], offsets[1])));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, sparse,            ggml_view_2d(ctx0, tokens, tokens->ne[0], sparse->ne[1],            tokens->nb[1], offsets[2])));
-        // TODO: Sparse prompt embeddings can have more than one point
+        tokens = ggml_concat(ctx0, output_tokens, sparse, 1);
     }
 
+    // the number of tokens of each prompt, the output tokens included: the others are padding, masked out of the
+    // attention over the tokens, filled by sam_fast_graph_set_inputs
+    struct ggml_tensor * n_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, tokens->ne[2]);
+    ggml_set_name(n_tokens, "dec_n_tokens");
+    ggml_set_input(n_tokens);
 
-    struct ggml_tensor * src = {};
-    struct ggml_tensor * pos_src = {};
-    int srcNE[4] = { 0, 0, 0, 0 };
+
+    const int srcNE[4] = { n_img_embd, n_img_embd, hparams.n_enc_out_chans, int(tokens->ne[2]) };
     {
         // Expand per-image data in the batch direction to be per-mask
         // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L125
-        src = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, state.embd_img->ne[0], state.embd_img->ne[1], state.embd_img->ne[2], tokens->ne[2]);
-
-        src = ggml_add(ctx0,
-            ggml_repeat(ctx0,
-                state.embd_img,
-                src),
-            prompt.embd_prompt_dense);
-
-        srcNE[0] = src->ne[0];
-        srcNE[1] = src->ne[1];
-        srcNE[2] = src->ne[2];
-        srcNE[3] = src->ne[3];
-
-        // flatten & permute
+        // src is flattened & permuted already, and pos_src is broadcast by the adds, so only the batch needs a copy
         // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/transformer.py#L83
-        src = ggml_cont(ctx0, ggml_permute(ctx0,
-            ggml_view_3d(ctx0,
-                src,
-                src->ne[0]*src->ne[1],
-                src->ne[2],
-                src->ne[3],
-                src->nb[2],
-                src->nb[3],
-                0),
-            1, 0, 2, 3));
-
-        pos_src = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, pe_img->ne[0], pe_img->ne[1], pe_img->ne[2], tokens->ne[2]);
-        pos_src = ggml_repeat(ctx0,
-            pe_img,
-            pos_src);
-
-        // flatten & permute
-        // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/transformer.py#L83
-        pos_src = ggml_cont(ctx0, ggml_permute(ctx0,
-            ggml_view_3d(ctx0,
-                pos_src,
-                pos_src->ne[0]*pos_src->ne[1],
-                pos_src->ne[2],
-                pos_src->ne[3],
-                pos_src->nb[2],
-                pos_src->nb[3],
-                0),
-            1, 0, 2, 3));
+        if (prompt.embd_prompt_dense) {
+            src = ggml_add(ctx0, prompt.embd_prompt_dense, src);
+        }
+        if (tokens->ne[2] > 1) {
+            src = ggml_repeat(ctx0, src, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, src->ne[0], src->ne[1], tokens->ne[2]));
+        }
     }
 
     struct ggml_tensor * queries = tokens;
@@ -1590,12 +3063,12 @@ bool sam_decode_mask(
             // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/transformer.py#L154
             const bool skip_first_layer_pe = i == 0;
             if (skip_first_layer_pe) {
-                queries = sam_decode_mask_transformer_attn(tfm_layer.self_attn, queries, queries, queries, ctx0, model);
+                queries = sam_decode_mask_transformer_attn(tfm_layer.self_attn, queries, queries, queries, n_tokens, ctx0, model);
             }
             else {
                 struct ggml_tensor * q_0 = ggml_add(ctx0, queries, tokens);
 
-                struct ggml_tensor * self_attn = sam_decode_mask_transformer_attn(tfm_layer.self_attn, q_0, q_0, queries, ctx0, model);
+                struct ggml_tensor * self_attn = sam_decode_mask_transformer_attn(tfm_layer.self_attn, q_0, q_0, queries, n_tokens, ctx0, model);
                 queries = ggml_add(ctx0, queries, self_attn);
             }
 
@@ -1609,7 +3082,7 @@ bool sam_decode_mask(
             struct ggml_tensor * q_1 = ggml_add(ctx0, queries, tokens);
             struct ggml_tensor * k_1 = ggml_add(ctx0, keys, pos_src);
 
-            struct ggml_tensor * cross_attn_token_to_img = sam_decode_mask_transformer_attn(tfm_layer.cross_attn_token_to_img, q_1, k_1, keys, ctx0, model);
+            struct ggml_tensor * cross_attn_token_to_img = sam_decode_mask_transformer_attn(tfm_layer.cross_attn_token_to_img, q_1, k_1, keys, nullptr, ctx0, model);
 
             queries = ggml_add_inplace(ctx0, queries, cross_attn_token_to_img);
             queries = ggml_norm_inplace(ctx0, queries, hparams.eps_decoder_transformer);
@@ -1642,8 +3115,9 @@ bool sam_decode_mask(
             struct ggml_tensor * q_2 = ggml_add(ctx0, queries, tokens);
             struct ggml_tensor * k_2 = ggml_add(ctx0, keys, pos_src);
 
-            struct ggml_tensor * cross_attn_img_to_token = sam_decode_mask_transformer_attn(tfm_layer.cross_attn_img_to_token, k_2, q_2, queries, ctx0, model);
-            keys = ggml_add_inplace(ctx0, keys, cross_attn_img_to_token);
+            struct ggml_tensor * cross_attn_img_to_token = sam_decode_mask_transformer_attn(tfm_layer.cross_attn_img_to_token, k_2, q_2, queries, n_tokens, ctx0, model);
+            // not in place: in the first layer, keys is the cached src
+            keys = ggml_add(ctx0, cross_attn_img_to_token, keys);
             keys = ggml_norm_inplace(ctx0, keys, hparams.eps_decoder_transformer);
             keys = ggml_add_inplace(ctx0,
                     ggml_mul(ctx0, keys, tfm_layer.norm4_w),
@@ -1655,7 +3129,7 @@ bool sam_decode_mask(
         struct ggml_tensor * q = ggml_add(ctx0, queries, tokens);
         struct ggml_tensor * k = ggml_add(ctx0, keys, pos_src);
 
-        struct ggml_tensor * final_attn_token_to_img = sam_decode_mask_transformer_attn(dec.transformer_final_attn_token_to_img, q, k, keys, ctx0, model);
+        struct ggml_tensor * final_attn_token_to_img = sam_decode_mask_transformer_attn(dec.transformer_final_attn_token_to_img, q, k, keys, nullptr, ctx0, model);
 
         queries = ggml_add_inplace(ctx0, queries, final_attn_token_to_img);
         queries = ggml_norm_inplace(ctx0, queries, hparams.eps_decoder_transformer);
@@ -1667,7 +3141,7 @@ bool sam_decode_mask(
 
     struct ggml_tensor * iou_pred = ggml_view_2d(ctx0, queries, queries->ne[0], queries->ne[2], queries->nb[2], 0);
     const int num_mask_tokens = 4; // num_multimask_outputs + 1
-    struct ggml_tensor * mask_tokens_out = ggml_view_3d(ctx0, queries, queries->ne[0], num_mask_tokens, queries->ne[2], queries->nb[1], num_mask_tokens*queries->nb[1], queries->nb[1]);
+    struct ggml_tensor * mask_tokens_out = ggml_view_3d(ctx0, queries, queries->ne[0], num_mask_tokens, queries->ne[2], queries->nb[1], queries->nb[2], queries->nb[1]);
 
     // Upscale mask embeddings and predict masks using the mask tokens
     // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L136
@@ -1682,7 +3156,7 @@ bool sam_decode_mask(
                                      ggml_reshape_3d(ctx0, dec.output_upscaling_0_b, 1, 1, dec.output_upscaling_0_b->ne[0]),
                                      keys));
 
-        keys = sam_layer_norm_2d(ctx0, keys, n_img_embd, dec.output_upscaling_1_w, dec.output_upscaling_1_b, hparams.eps);
+        keys = sam_layer_norm_2d(ctx0, keys, dec.output_upscaling_1_w->ne[0], dec.output_upscaling_1_w, dec.output_upscaling_1_b, &hparams.eps);
 
         // GELU activation
         keys = ggml_gelu_inplace(ctx0, keys);
@@ -1698,13 +3172,18 @@ bool sam_decode_mask(
         upscaled_embedding = ggml_cont(ctx0, ggml_transpose(ctx0, upscaled_embedding)); // TODO: Shouldn't be needed
     }
 
-    struct ggml_tensor * hyper_in = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_img_embd/2, num_mask_tokens, mask_tokens_out->ne[2]);
+    // only the hypernetworks and mask products of the masks that are output
+    // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L101
+    const int n_dec_masks = hparams.n_dec_masks();
+    const int i_dec_mask0 = hparams.i_dec_mask0();
+
+    struct ggml_tensor * hyper_in = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_img_embd/2, n_dec_masks, mask_tokens_out->ne[2]);
 
-    for (int i = 0; i < num_mask_tokens; ++i) {
-        const auto& mlp = dec.output_hypernet_mlps[i];
-        struct ggml_tensor * in = ggml_view_2d(ctx0, mask_tokens_out, mask_tokens_out->ne[0], mask_tokens_out->ne[2], mask_tokens_out->nb[1], i*mask_tokens_out->nb[1]);
+    for (int i = 0; i < n_dec_masks; ++i) {
+        const auto& mlp = dec.output_hypernet_mlps[i_dec_mask0 + i];
+        struct ggml_tensor * in = ggml_view_2d(ctx0, mask_tokens_out, mask_tokens_out->ne[0], mask_tokens_out->ne[2], mask_tokens_out->nb[2], (i_dec_mask0 + i)*mask_tokens_out->nb[1]);
         struct ggml_tensor * out = sam_decode_mask_mlp_relu_3(in, mlp.w_0, mlp.b_0, mlp.w_1, mlp.b_1, mlp.w_2, mlp.b_2, ctx0);
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, out, ggml_view_2d(ctx0, hyper_in, hyper_in->ne[0], hyper_in->ne[2], hyper_in->nb[1], i*hyper_in->nb[1])));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, out, ggml_view_2d(ctx0, hyper_in, hyper_in->ne[0], hyper_in->ne[2], hyper_in->nb[2], i*hyper_in->nb[1])));
     }
 
     struct ggml_tensor * masks = ggml_mul_mat(ctx0, hyper_in, upscaled_embedding);
@@ -1715,11 +3194,8 @@ bool sam_decode_mask(
     // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L146
     iou_pred = sam_decode_mask_mlp_relu_3(iou_pred, dec.iou_prediction_head_0_w, dec.iou_prediction_head_0_b, dec.iou_prediction_head_1_w, dec.iou_prediction_head_1_b, dec.iou_prediction_head_2_w, dec.iou_prediction_head_2_b, ctx0);
 
-    // Select the correct mask or masks for output
-    // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L101
-    iou_pred = ggml_cpy(state.ctx_masks, ggml_view_1d(ctx0, iou_pred, iou_pred->ne[0] - 1, iou_pred->nb[0]), state.iou_predictions);
-    masks = ggml_view_4d(ctx0, masks, masks->ne[0], masks->ne[1], masks->ne[2] - 1, masks->ne[3],
-                                      masks->nb[1], masks->nb[2], masks->nb[3], masks->nb[2] /* offset*/);
+    // Select the correct mask or masks for output, the masks are selected already
+    iou_pred = ggml_cpy(state.ctx_masks, ggml_view_2d(ctx0, iou_pred, n_dec_masks, iou_pred->ne[1], iou_pred->nb[1], i_dec_mask0*iou_pred->nb[0]), state.iou_predictions);
     masks = ggml_cpy(state.ctx_masks, masks, state.low_res_masks);
 
     ggml_build_forward_expand(gf, masks);
@@ -1731,13 +3207,38 @@ bool sam_decode_mask(
     return true;
 }
 
+// stability score of a low-res mask, over its nx x ny part that covers the image
+// an estimate of the score of the upscaled mask, to rank the masks before upscaling them
+static float sam_mask_stability_low_res(
+             const float * data,
+                     int   ne0,
+                     int   nx,
+                     int   ny,
+                   float   intersection_threshold,
+                   float   union_threshold) {
+    int intersections = 0;
+    int unions = 0;
+    for (int iy = 0; iy < ny; ++iy) {
+        for (int ix = 0; ix < nx; ++ix) {
+            const float v = data[iy*ne0 + ix];
+            intersections += v > intersection_threshold;
+            unions        += v > union_threshold;
+        }
+    }
+
+    return unions > 0 ? float(intersections) / float(unions) : 0.0f;
+}
+
 std::vector<sam_image_u8> sam_postprocess_masks(
        const sam_hparams & hparams,
                      int   nx,
                      int   ny,
-    const sam_ggml_state & state,
+          sam_ggml_state & state,
+                     int   i_prompt,
+                     int   n_threads,
                      int   mask_on_val,
-                     int   mask_off_val) {
+                     int   mask_off_val,
+                     int * i_best) {
 
     if (state.low_res_masks->ne[2] == 0) return {};
     if (state.low_res_masks->ne[2] != state.iou_predictions->ne[0]) {
@@ -1769,10 +3270,33 @@ std::vector<sam_image_u8> sam_postprocess_masks(
     const float scale_x_2 = float(cropped_nx) / float(nx);
     const float scale_y_2 = float(cropped_ny) / float(ny);
 
-    const auto iou_data = (float*)state.iou_predictions->data;
+    // the masks of the prompt `i_prompt` of the batch
+    const auto iou_data = (float*)state.iou_predictions->data + i_prompt*ne2;
 
-    std::map<float, sam_image_u8, std::greater<float>> res_map;
+    // the order in which the masks are upscaled: in SAM_MASK_OUTPUT_BEST, by the score of the low-res masks,
+    // and only until one passes the thresholds
+    std::vector<int> order(ne2);
     for (int i = 0; i < ne2; ++i) {
+        order[i] = i;
+    }
+
+    const bool best_only = hparams.mask_output == SAM_MASK_OUTPUT_BEST;
+    if (best_only) {
+        const int low_res_nx = std::min(ne0, int(ceilf(cropped_nx*scale_x_1)));
+        const int low_res_ny = std::min(ne1, int(ceilf(cropped_ny*scale_y_1)));
+
+        std::vector<float> score(ne2);
+        for (int i = 0; i < ne2; ++i) {
+            const float * data = (float *) state.low_res_masks->data + (i_prompt*ne2 + i)*ne0*ne1;
+            score[i] = iou_data[i] + sam_mask_stability_low_res(data, ne0, low_res_nx, low_res_ny, intersection_threshold, union_threshold);
+        }
+
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return score[a] > score[b]; });
+    }
+
+    std::map<float, sam_image_u8, std::greater<float>> res_map;
+    std::map<float, int, std::greater<float>> idx_map;
+    for (int i : order) {
         if (iou_threshold > 0.f && iou_data[i] < iou_threshold) {
             printf("Skipping mask %d with iou %f below threshold %f\n", i, iou_data[i], iou_threshold);
             continue; // Filtering masks with iou below the threshold
@@ -1780,49 +3304,61 @@ std::vector<sam_image_u8> sam_postprocess_masks(
 
         std::vector<float> mask_data(n_img_size*n_img_size);
         {
-            const float* data = (float *) state.low_res_masks->data + i*ne0*ne1;
+            const float* data = (float *) state.low_res_masks->data + (i_prompt*ne2 + i)*ne0*ne1;
 
-            for (int iy = 0; iy < n_img_size; ++iy) {
-                for (int ix = 0; ix < n_img_size; ++ix) {
-                    const float sx = std::max(scale_x_1*(ix + 0.5f) - 0.5f, 0.0f);
-                    const float sy = std::max(scale_y_1*(iy + 0.5f) - 0.5f, 0.0f);
+            sam_parallel_for(state.workers, n_threads, [&](int ith, int nth) {
+                const int dr  = (n_img_size + nth - 1)/nth;
+                const int ir0 = dr*ith;
+                const int ir1 = std::min(ir0 + dr, n_img_size);
 
-                    const int x0 = std::max(0, (int)sx);
-                    const int y0 = std::max(0, (int)sy);
+                for (int iy = ir0; iy < ir1; ++iy) {
+                    for (int ix = 0; ix < n_img_size; ++ix) {
+                        const float sx = std::max(scale_x_1*(ix + 0.5f) - 0.5f, 0.0f);
+                        const float sy = std::max(scale_y_1*(iy + 0.5f) - 0.5f, 0.0f);
 
-                    const int x1 = std::min(x0 + 1, ne0 - 1);
-                    const int y1 = std::min(y0 + 1, ne1 - 1);
+                        const int x0 = std::max(0, (int)sx);
+                        const int y0 = std::max(0, (int)sy);
 
-                    const float dx = sx - x0;
-                    const float dy = sy - y0;
+                        const int x1 = std::min(x0 + 1, ne0 - 1);
+                        const int y1 = std::min(y0 + 1, ne1 - 1);
 
-                    const int j00 = y0*ne0 + x0;
-                    const int j01 = y0*ne0 + x1;
-                    const int j10 = y1*ne0 + x0;
-                    const int j11 = y1*ne0 + x1;
+                        const float dx = sx - x0;
+                        const float dy = sy - y0;
 
-                    const float v00 = data[j00];
-                    const float v01 = data[j01];
-                    const float v10 = data[j10];
-                    const float v11 = data[j11];
+                        const int j00 = y0*ne0 + x0;
+                        const int j01 = y0*ne0 + x1;
+                        const int j10 = y1*ne0 + x0;
+                        const int j11 = y1*ne0 + x1;
 
-                    const float v0 = (1-dx)*v00 + dx*v01;
-                    const float v1 = (1-dx)*v10 + dx*v11;
+                        const float v00 = data[j00];
+                        const float v01 = data[j01];
+                        const float v10 = data[j10];
+                        const float v11 = data[j11];
 
-                    const float v = (1-dy)*v0 + dy*v1;
+                        const float v0 = (1-dx)*v00 + dx*v01;
+                        const float v1 = (1-dx)*v10 + dx*v11;
 
-                    mask_data[iy*n_img_size + ix] = v;
+                        const float v = (1-dy)*v0 + dy*v1;
+
+                        mask_data[iy*n_img_size + ix] = v;
+                    }
                 }
-            }
+            });
         }
 
-        int intersections = 0;
-        int unions = 0;
+        // per-thread partial results, reduced below
+        struct mask_stats {
+            int intersections = 0;
+            int unions = 0;
+            int min_iy = INT32_MAX;
+            int max_iy = 0;
+            int min_ix = INT32_MAX;
+            int max_ix = 0;
+        };
+
+        std::vector<mask_stats> stats(sam_n_threads(state.workers, n_threads));
+
         sam_image_u8 res;
-        int min_iy = ny;
-        int max_iy = 0;
-        int min_ix = nx;
-        int max_ix = 0;
         {
             const float* data = mask_data.data();
 
@@ -1830,51 +3366,74 @@ std::vector<sam_image_u8> sam_postprocess_masks(
             res.ny = ny;
             res.data.resize(nx*ny, mask_off_val);
 
-            for (int iy = 0; iy < ny; ++iy) {
-                for (int ix = 0; ix < nx; ++ix) {
-                    const float sx = std::max(scale_x_2*(ix + 0.5f) - 0.5f, 0.0f);
-                    const float sy = std::max(scale_y_2*(iy + 0.5f) - 0.5f, 0.0f);
+            sam_parallel_for(state.workers, n_threads, [&](int ith, int nth) {
+                auto & st = stats[ith];
 
-                    const int x0 = std::max(0, (int)sx);
-                    const int y0 = std::max(0, (int)sy);
+                const int dr  = (ny + nth - 1)/nth;
+                const int ir0 = dr*ith;
+                const int ir1 = std::min(ir0 + dr, ny);
 
-                    const int x1 = std::min(x0 + 1, cropped_nx - 1);
-                    const int y1 = std::min(y0 + 1, cropped_ny - 1);
+                for (int iy = ir0; iy < ir1; ++iy) {
+                    for (int ix = 0; ix < nx; ++ix) {
+                        const float sx = std::max(scale_x_2*(ix + 0.5f) - 0.5f, 0.0f);
+                        const float sy = std::max(scale_y_2*(iy + 0.5f) - 0.5f, 0.0f);
 
-                    const float dx = sx - x0;
-                    const float dy = sy - y0;
+                        const int x0 = std::max(0, (int)sx);
+                        const int y0 = std::max(0, (int)sy);
 
-                    const int j00 = y0*n_img_size + x0;
-                    const int j01 = y0*n_img_size + x1;
-                    const int j10 = y1*n_img_size + x0;
-                    const int j11 = y1*n_img_size + x1;
+                        const int x1 = std::min(x0 + 1, cropped_nx - 1);
+                        const int y1 = std::min(y0 + 1, cropped_ny - 1);
 
-                    const float v00 = data[j00];
-                    const float v01 = data[j01];
-                    const float v10 = data[j10];
-                    const float v11 = data[j11];
+                        const float dx = sx - x0;
+                        const float dy = sy - y0;
 
-                    const float v0 = (1-dx)*v00 + dx*v01;
-                    const float v1 = (1-dx)*v10 + dx*v11;
+                        const int j00 = y0*n_img_size + x0;
+                        const int j01 = y0*n_img_size + x1;
+                        const int j10 = y1*n_img_size + x0;
+                        const int j11 = y1*n_img_size + x1;
 
-                    const float v = (1-dy)*v0 + dy*v1;
+                        const float v00 = data[j00];
+                        const float v01 = data[j01];
+                        const float v10 = data[j10];
+                        const float v11 = data[j11];
 
-                    if (v > intersection_threshold) {
-                        intersections++;
-                    }
-                    if (v > union_threshold) {
-                        unions++;
-                    }
-                    if (v > mask_threshold) {
-                        min_iy = std::min(min_iy, iy);
-                        max_iy = std::max(max_iy, iy);
-                        min_ix = std::min(min_ix, ix);
-                        max_ix = std::max(max_ix, ix);
+                        const float v0 = (1-dx)*v00 + dx*v01;
+                        const float v1 = (1-dx)*v10 + dx*v11;
 
-                        res.data[iy*nx + ix] = mask_on_val;
+                        const float v = (1-dy)*v0 + dy*v1;
+
+                        if (v > intersection_threshold) {
+                            st.intersections++;
+                        }
+                        if (v > union_threshold) {
+                            st.unions++;
+                        }
+                        if (v > mask_threshold) {
+                            st.min_iy = std::min(st.min_iy, iy);
+                            st.max_iy = std::max(st.max_iy, iy);
+                            st.min_ix = std::min(st.min_ix, ix);
+                            st.max_ix = std::max(st.max_ix, ix);
+
+                            res.data[iy*nx + ix] = mask_on_val;
+                        }
                     }
                 }
-            }
+            });
+        }
+
+        int intersections = 0;
+        int unions = 0;
+        int min_iy = ny;
+        int max_iy = 0;
+        int min_ix = nx;
+        int max_ix = 0;
+        for (const auto & st : stats) {
+            intersections += st.intersections;
+            unions        += st.unions;
+            min_iy = std::min(min_iy, st.min_iy);
+            max_iy = std::max(max_iy, st.max_iy);
+            min_ix = std::min(min_ix, st.min_ix);
+            max_ix = std::max(max_ix, st.max_ix);
         }
 
         const float stability_score = float(intersections) / float(unions);
@@ -1887,6 +3446,16 @@ std::vector<sam_image_u8> sam_postprocess_masks(
                 i, iou_data[i], stability_score, min_ix, max_ix, min_iy, max_iy);
 
         res_map[iou_data[i] + stability_score] = std::move(res);
+        idx_map[iou_data[i] + stability_score] = i;
+
+        if (best_only) {
+            break;
+        }
+    }
+
+    // the low-res mask of the best one
+    if (i_best) {
+        *i_best = idx_map.empty() ? -1 : idx_map.begin()->second;
     }
 
     std::vector<sam_image_u8> res;
@@ -1897,12 +3466,15 @@ std::vector<sam_image_u8> sam_postprocess_masks(
     return res;
 }
 
+// decode the masks of a batch of n_prompts prompts of n_pt tokens on the same image, one prompt per entry of the decoder batch
+// the decoder inputs of the image are read from the state, see sam_dec_inputs_prepare
+// the graph only depends on the shape of the prompts: their values are set by sam_fast_graph_set_inputs
 struct ggml_cgraph  * sam_build_fast_graph(
-       const sam_ggml_model & model,
-             sam_ggml_state & state,
-                        int   nx,
-                        int   ny,
-     std::vector<sam_point>   points) {
+                         const sam_ggml_model & model,
+                               sam_ggml_state & state,
+                                          int   n_pt,
+                                          int   n_prompts,
+                                         bool   use_mask) {
 
     struct ggml_init_params ggml_params = {
         /*.mem_size   =*/ state.buf_compute_fast.size(),
@@ -1913,28 +3485,38 @@ struct ggml_cgraph  * sam_build_fast_graph(
     struct ggml_context * ctx0   = ggml_init(ggml_params);
     struct ggml_cgraph  * gf     = ggml_new_graph(ctx0);
 
-    prompt_encoder_result enc_res = sam_encode_prompt(model, ctx0, gf, state, points);
-    if (!enc_res.embd_prompt_sparse || !enc_res.embd_prompt_dense) {
-        fprintf(stderr, "%s: failed to encode prompt with %zu points\n", __func__, points.size());
-        return {};
-    }
-
-    struct ggml_tensor * pe_img_dense = sam_fill_dense_pe(model, ctx0, gf, state);
-    if (!pe_img_dense) {
-        fprintf(stderr, "%s: failed to get dense positional encoding\n", __func__);
+    prompt_encoder_result enc_res = sam_encode_prompt(model, ctx0, gf, state, n_pt, n_prompts, use_mask);
+    if (!enc_res.embd_prompt_sparse) {
+        fprintf(stderr, "%s: failed to encode %d prompts\n", __func__, n_prompts);
         return {};
     }
 
-    if (!sam_decode_mask(model, enc_res, pe_img_dense, ctx0, gf, state)) {
+    if (!sam_decode_mask(model, enc_res, model.enc_prompt.pe_dense, state.dec_src, ctx0, gf, state)) {
          fprintf(stderr, "%s: failed to decode mask\n", __func__);
          return {};
     }
 
     ggml_free(ctx0);
 
-    ggml_gallocr_alloc_graph(state.allocr, gf);
-    
+    ggml_gallocr_alloc_graph(state.allocr_dec, gf);
+
+    return gf;
+}
+
+// the inputs of the graph of sam_build_fast_graph: the prompts of an nx x ny image, and the mask prompt if it has one
+static void sam_fast_graph_set_inputs(
+                         const sam_ggml_model & model,
+                           struct ggml_cgraph * gf,
+                                          int   nx,
+                                          int   ny,
+  const std::vector<std::vector<sam_point>> & prompts,
+                                  const float * mask_in) {
+
     // from sam_encode_prompt
+    if (mask_in) {
+        struct ggml_tensor * mask = ggml_graph_get_tensor(gf, "prompt_mask");
+        memcpy(mask->data, mask_in, ggml_nbytes(mask));
+    }
     {
         // transform points
         // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/automatic_mask_generator.py#L276
@@ -1943,43 +3525,139 @@ struct ggml_cgraph  * sam_build_fast_graph(
         const int nx_new = int(nx*scale + 0.5f);
         const int ny_new = int(ny*scale + 0.5f);
 
-        struct ggml_tensor * inp = ggml_graph_get_tensor(gf, "prompt_input");
-        float * data = (float *) inp->data;
+        struct ggml_tensor * inp    = ggml_graph_get_tensor(gf, "prompt_input");
+        struct ggml_tensor * labels = ggml_graph_get_tensor(gf, "prompt_labels");
+        struct ggml_tensor * keep   = ggml_graph_get_tensor(gf, "prompt_keep");
+        struct ggml_tensor * n_tok  = ggml_graph_get_tensor(gf, "dec_n_tokens");
 
-        // transform each point
-        for (size_t i = 0; i < points.size(); i++) {
-            sam_point transformed = points[i];
-            transformed.x = transformed.x*(float(nx_new)/nx) + 0.5f;
-            transformed.y = transformed.y*(float(ny_new)/ny) + 0.5f;
+        // the iou token and the mask tokens, before the prompt tokens
+        const int n_out_tokens = int(model.dec.iou_token_w->ne[1] + model.dec.mask_tokens_w->ne[1]);
 
-            data[i*2 + 0] = 2.0f*(transformed.x / model.hparams.n_img_size()) - 1.0f;
-            data[i*2 + 1] = 2.0f*(transformed.y / model.hparams.n_img_size()) - 1.0f;
-        }
+        const int64_t n_pt = inp->ne[1];
 
-        // padding
-        // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L81-L85
-        data[points.size()*2 + 0] = 2.0f*(0.0f) - 1.0f;
-        data[points.size()*2 + 1] = 2.0f*(0.0f) - 1.0f;
-    }
+        for (size_t ip = 0; ip < prompts.size(); ++ip) {
+            const auto & points = prompts[ip];
 
-    // from sam_fill_dense_pe
-    {
-        struct ggml_tensor * xy_embed_stacked = ggml_graph_get_tensor(gf, "xy_embed_stacked");
-        const int32_t n_img_embd = model.hparams.n_img_embd();
-        const float n_img_embd_inv = 1.0f / n_img_embd;
-        float * data = (float *) ggml_get_data(xy_embed_stacked);
-        for (int i = 0; i < n_img_embd; ++i) {
-            const int row = 2*i*n_img_embd;
-            const float y_val = 2 * (i + 0.5f) * n_img_embd_inv - 1;
-            for (int j = 0; j < n_img_embd; ++j) {
-                const float x_val = 2 * (j + 0.5f) * n_img_embd_inv - 1;
-                data[row + 2*j + 0] = x_val;
-                data[row + 2*j + 1] = y_val;
+            float   * data      = (float   *) inp->data + ip*n_pt*2;
+            int32_t * data_lbl  = (int32_t *) labels->data + ip*n_pt;
+            float   * data_keep = (float   *) keep->data + ip*n_pt;
+
+            // the padding point of a prompt without a box is a token, the rest of the padding is masked out
+            ((int32_t *) n_tok->data)[ip] = n_out_tokens + int(sam_prompt_n_tokens(points));
+
+            // transform each point
+            for (size_t i = 0; i < points.size(); i++) {
+                sam_point transformed = points[i];
+                transformed.x = transformed.x*(float(nx_new)/nx) + 0.5f;
+                transformed.y = transformed.y*(float(ny_new)/ny) + 0.5f;
+
+                data[i*2 + 0] = 2.0f*(transformed.x / model.hparams.n_img_size()) - 1.0f;
+                data[i*2 + 1] = 2.0f*(transformed.y / model.hparams.n_img_size()) - 1.0f;
+
+                data_lbl[i]  = sam_prompt_label(model, points[i].label);
+                data_keep[i] = 1.0f;
+            }
+
+            // padding, up to the token capacity of the graph, see sam_dec_n_pt: the first entry is the not-a-point
+            // token of SAM when there is no box
+            // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/prompt_encoder.py#L81-L85
+            for (int64_t i = points.size(); i < n_pt; i++) {
+                data[i*2 + 0] = 2.0f*(0.0f) - 1.0f;
+                data[i*2 + 1] = 2.0f*(0.0f) - 1.0f;
+
+                data_lbl[i]  = sam_prompt_label(model, -1);
+                data_keep[i] = 0.0f;
             }
         }
     }
+}
 
-    return gf;
+// the token capacity of the decoder graph for prompts of up to n_tokens tokens: at least SAM_DEC_N_PT_MIN, then doubled,
+// so that the clicks of an interactive session reuse the same graph; the padding tokens are masked out of the attention,
+// so the masks are those of an unpadded graph
+#define SAM_DEC_N_PT_MIN 8
+
+static int sam_dec_n_pt(size_t n_tokens) {
+    int n_pt = SAM_DEC_N_PT_MIN;
+    while ((size_t) n_pt < n_tokens) {
+        n_pt *= 2;
+    }
+
+    return n_pt;
+}
+
+static void sam_dec_graph_free(sam_ggml_state & st) {
+    if (st.allocr_dec) {
+        ggml_gallocr_free(st.allocr_dec);
+    }
+    if (st.ctx_masks) {
+        ggml_free(st.ctx_masks);
+    }
+
+    st.allocr_dec = NULL;
+    st.gf_dec = NULL;
+    st.ctx_masks = NULL;
+    st.low_res_masks = NULL;
+    st.iou_predictions = NULL;
+    st.mem_graph_dec = 0;
+
+    st.dec_n_pt = 0;
+    st.dec_n_prompts = 0;
+    st.dec_use_mask = false;
+}
+
+// the decoder graph of n_prompts prompts of n_pt tokens: built and allocated once, then kept while the shape is the same
+static bool sam_dec_graph_prepare(
+  const sam_ggml_model & model,
+        sam_ggml_state & st,
+                   int   n_pt,
+                   int   n_prompts,
+                  bool   use_mask) {
+
+    if (st.gf_dec && st.dec_n_pt == n_pt && st.dec_n_prompts == n_prompts && st.dec_use_mask == use_mask) {
+        return true;
+    }
+
+    sam_dec_graph_free(st);
+
+    const int n_enc_out_chans = model.hparams.n_enc_out_chans;
+    const int n_dec_masks     = model.hparams.n_dec_masks();
+
+    // low_res_masks and iou_predictions, for each prompt
+    const size_t buf_size =
+        ggml_tensor_overhead() + GGML_PAD(ggml_row_size(GGML_TYPE_F32, n_enc_out_chans)*n_enc_out_chans*n_dec_masks*n_prompts, GGML_MEM_ALIGN) +
+        ggml_tensor_overhead() + GGML_PAD(ggml_row_size(GGML_TYPE_F32, n_dec_masks)*n_prompts, GGML_MEM_ALIGN);
+
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ buf_size,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+
+    st.ctx_masks = ggml_init(ggml_params);
+
+    st.low_res_masks = ggml_new_tensor_4d(st.ctx_masks, GGML_TYPE_F32,
+            n_enc_out_chans, n_enc_out_chans, n_dec_masks, n_prompts);
+
+    st.iou_predictions = ggml_new_tensor_2d(st.ctx_masks, GGML_TYPE_F32, n_dec_masks, n_prompts);
+
+    st.buf_compute_fast.resize(ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
+    st.allocr_dec = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+
+    st.gf_dec = sam_build_fast_graph(model, st, n_pt, n_prompts, use_mask);
+    if (!st.gf_dec) {
+        fprintf(stderr, "%s: failed to build fast graph\n", __func__);
+        sam_dec_graph_free(st);
+        return false;
+    }
+
+    st.mem_graph_dec = ggml_gallocr_get_buffer_size(st.allocr_dec, 0);
+
+    st.dec_n_pt = n_pt;
+    st.dec_n_prompts = n_prompts;
+    st.dec_use_mask = use_mask;
+
+    return true;
 }
 
 std::shared_ptr<sam_state> sam_load_model(
@@ -1988,164 +3666,1695 @@ std::shared_ptr<sam_state> sam_load_model(
     ggml_time_init();
     const int64_t t_start_ms = ggml_time_ms();
 
+    // in NUMA mode the calling thread is bound to the node before anything is allocated, so that the weights,
+    // the pool workers and the compute buffers of the session all end up on the node; the binding is undone on return
+    // in strict mode the workers are pinned to the first n_threads cores (of the node)
+    std::vector<int> cpus;
+    sam_numa_thread_binding numa_binding;
+    if (params.numa_node >= 0) {
+        cpus = sam_numa_node_cpus(params.numa_node);
+        if (cpus.empty() || !numa_binding.bind(params.numa_node, cpus)) {
+            fprintf(stderr, "%s: NUMA node %d is not available\n", __func__, params.numa_node);
+            return {};
+        }
+        if ((int) cpus.size() < params.n_threads) {
+            fprintf(stderr, "%s: warning: %d threads on %zu cores of NUMA node %d\n", __func__,
+                    params.n_threads, cpus.size(), params.numa_node);
+        }
+    } else if (params.cpu_strict) {
+        for (int i = 0; i < params.n_threads; ++i) {
+            cpus.push_back(i);
+        }
+    }
+
     sam_state state;
     state.model = std::make_unique<sam_ggml_model>();
     state.state = std::make_unique<sam_ggml_state>();
     if (!sam_ggml_model_load(params, *state.model)) {
         fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        sam_deinit(state);
         return {};
     }
 
-    state.t_load_ms = ggml_time_ms() - t_start_ms;
+    {
+        auto & workers = state.state->workers;
+
+        workers.threadpool = sam_threadpool_new(params.n_threads, params.poll, params.cpu_strict, cpus);
+        workers.n_threads  = params.n_threads;
+        workers.poll       = params.poll;
+        workers.cpus       = cpus;
+        if (!workers.threadpool) {
+            sam_deinit(state);
+            return {};
+        }
+    }
 
-    return std::make_unique<sam_state>(std::move(state));
-}
+#ifdef SAM_USE_BLAS
+    if (!sam_backend_sched_init(*state.model, *state.state)) {
+        sam_deinit(state);
+        return {};
+    }
+#endif
 
-bool sam_compute_embd_img(
-        sam_image_u8 & img,
-                 int   n_threads ,
-           sam_state & state) {
+    state.state->embd_max_size = (uint64_t) std::max(0, params.embd_mem_max_mb)*1024*1024;
+    state.state->mem_max_size  = (uint64_t) std::max(0, params.mem_max_mb)*1024*1024;
+
+    if (state.state->mem_max_size > 0) {
+        const size_t size_weights = ggml_get_mem_size(state.model->ctx) +
+            (state.model->ctx_pre ? ggml_get_mem_size(state.model->ctx_pre) : 0);
+        if (size_weights > state.state->mem_max_size) {
+            fprintf(stderr, "%s: the model (%.1f MB) does not fit in the memory limit of %d MB\n", __func__,
+                    size_weights/1024.0/1024.0, params.mem_max_mb);
+            sam_deinit(state);
+            return {};
+        }
+    }
 
-    if (!state.model || !state.state) {
-        return false;
+    switch (params.embd_type) {
+        case SAM_EMBD_TYPE_F32:  state.state->embd_type = GGML_TYPE_F32;  break;
+        case SAM_EMBD_TYPE_F16:  state.state->embd_type = GGML_TYPE_F16;  break;
+        case SAM_EMBD_TYPE_Q8_0: state.state->embd_type = GGML_TYPE_Q8_0; break;
+        default:
+            {
+                fprintf(stderr, "%s: unknown embedding type %d\n", __func__, (int) params.embd_type);
+                sam_deinit(state);
+                return {};
+            }
     }
 
-    const int64_t t_start_ms = ggml_time_ms();
+    switch (params.mask_output) {
+        case SAM_MASK_OUTPUT_MULTI:
+        case SAM_MASK_OUTPUT_SINGLE:
+        case SAM_MASK_OUTPUT_BEST:
+            break;
+        default:
+            {
+                fprintf(stderr, "%s: unknown mask output mode %d\n", __func__, (int) params.mask_output);
+                sam_deinit(state);
+                return {};
+            }
+    }
 
-    // preprocess to f32
-    sam_image_f32 img1;
-    if (!sam_image_preprocess(img, img1)) {
-        fprintf(stderr, "%s: failed to preprocess image\n", __func__);
-        return 1;
+    if (!params.embd_cache_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::create_directories(params.embd_cache_dir, ec);
+        if (ec || !std::filesystem::is_directory(params.embd_cache_dir, ec)) {
+            fprintf(stderr, "%s: warning: cannot use '%s' as the embedding cache directory\n", __func__, params.embd_cache_dir.c_str());
+        } else {
+            state.state->embd_cache_dir      = params.embd_cache_dir;
+            state.state->embd_cache_max_size = (uint64_t) std::max(0, params.embd_cache_max_mb)*1024*1024;
+        }
     }
-    fprintf(stderr, "%s: preprocessed image (%d x %d)\n", __func__, img1.nx, img1.ny);
- 
-    //
-    static size_t buf_size = 256u*1024*1024;
 
-    auto& st = *state.state;
-    auto& model = *state.model;
+    state.t_load_ms = ggml_time_ms() - t_start_ms;
+
+    return std::make_unique<sam_state>(std::move(state));
+}
 
-    if (st.ctx_img) {
-        ggml_free(st.ctx_img);
-        st.ctx_img = {};
+static void sam_image_embd_free(sam_image_embd & embd) {
+#ifdef SAM_USE_BLAS
+    if (embd.buf) {
+        ggml_backend_buffer_free(embd.buf);
+    }
+#endif
+    if (embd.ctx) {
+        ggml_free(embd.ctx);
     }
 
+    embd = {};
+}
+
+static void sam_image_embd_alloc(const sam_hparams & hparams, enum ggml_type type, sam_image_embd & dst) {
+    static std::atomic<uint64_t> next_id { 1 };
+
+    const size_t buf_size = ggml_tensor_overhead() +
+        ggml_row_size(type, hparams.n_img_embd())*hparams.n_img_embd()*hparams.n_enc_out_chans;
+
+    sam_image_embd_free(dst);
+
     struct ggml_init_params ggml_params = {
         /*.mem_size   =*/ buf_size,
         /*.mem_buffer =*/ NULL,
         /*.no_alloc   =*/ false,
     };
 
-    st.ctx_img = ggml_init(ggml_params);
+    dst.ctx = ggml_init(ggml_params);
 
-    st.embd_img = ggml_new_tensor_3d(st.ctx_img, GGML_TYPE_F32,
-            model.hparams.n_img_embd(), model.hparams.n_img_embd(), model.hparams.n_enc_out_chans);
+    dst.embd = ggml_new_tensor_3d(dst.ctx, type,
+            hparams.n_img_embd(), hparams.n_img_embd(), hparams.n_enc_out_chans);
 
-    // Encode the image
-    st.buf_compute_img_enc.resize(ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
-    st.allocr = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    dst.id = next_id++;
 
-    struct ggml_cgraph  * gf = sam_encode_image(model, st, img1);
-    if (!gf) {
-        fprintf(stderr, "%s: failed to encode image\n", __func__);
+#ifdef SAM_USE_BLAS
+    dst.buf = sam_ctx_to_backend_buffer(dst.ctx, GGML_BACKEND_BUFFER_USAGE_ANY);
+#endif
+}
+
+//
+// serialized image embeddings, used by the on-disk cache and by the export/import API
+//
+// a 64-byte header followed by the raw embedding data, so the data is aligned and a file can be mapped as is
+//
+
+static const uint32_t SAM_EMBD_FILE_MAGIC   = 0x454d4153; // "SAME"
+static const uint32_t SAM_EMBD_FILE_VERSION = 1;
+
+struct sam_embd_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t model_id;  // sam_ggml_model::id
+    uint64_t img_hash;  // sam_embd_cache_key
+    int32_t  nx;        // size of the input image
+    int32_t  ny;
+    int32_t  type;      // ggml_type of the data
+    int32_t  ne[3];
+    uint8_t  pad[16];
+};
+
+static_assert(sizeof(sam_embd_file_header) == 64, "sam_embd_file_header must be 64 bytes");
+
+static sam_embd_file_header sam_embd_header(const sam_ggml_model & model, const sam_embd_entry & entry) {
+    sam_embd_file_header header = {};
+    header.magic    = SAM_EMBD_FILE_MAGIC;
+    header.version  = SAM_EMBD_FILE_VERSION;
+    header.model_id = model.id;
+    header.img_hash = entry.key;
+    header.nx       = entry.nx;
+    header.ny       = entry.ny;
+    header.type     = entry.embd.embd->type;
+    for (int i = 0; i < 3; ++i) {
+        header.ne[i] = entry.embd.embd->ne[i];
+    }
+
+    return header;
+}
+
+// check that an embedding with this header can be decoded by `model`
+static bool sam_embd_header_check(const sam_ggml_model & model, const sam_embd_file_header & header) {
+    const auto & hparams = model.hparams;
+
+    if (header.magic != SAM_EMBD_FILE_MAGIC) {
+        fprintf(stderr, "%s: not an image embedding\n", __func__);
+        return false;
+    }
+    if (header.version != SAM_EMBD_FILE_VERSION) {
+        fprintf(stderr, "%s: unsupported version %u (expected %u)\n", __func__, header.version, SAM_EMBD_FILE_VERSION);
+        return false;
+    }
+    if (header.model_id != model.id) {
+        fprintf(stderr, "%s: the embedding was computed by a different model or encoder settings\n", __func__);
+        return false;
+    }
+    if ((header.type != GGML_TYPE_F32 && header.type != GGML_TYPE_F16 && header.type != GGML_TYPE_Q8_0) ||
+        header.ne[0] != hparams.n_img_embd() ||
+        header.ne[1] != hparams.n_img_embd() ||
+        header.ne[2] != hparams.n_enc_out_chans) {
+        fprintf(stderr, "%s: unexpected type or shape of the embedding\n", __func__);
+        return false;
+    }
+    if (header.nx <= 0 || header.ny <= 0) {
+        fprintf(stderr, "%s: invalid image size %d x %d\n", __func__, header.nx, header.ny);
         return false;
     }
 
-    ggml_graph_compute_helper(st.work_buffer, gf, n_threads);
+    return true;
+}
 
-    print_t_f32("embd_img", st.embd_img);
+// the entry described by a checked header, with the embedding allocated but not filled
+static void sam_embd_entry_init(const sam_ggml_model & model, const sam_embd_file_header & header, sam_embd_entry & entry) {
+    entry.key = header.img_hash;
+    entry.nx  = header.nx;
+    entry.ny  = header.ny;
 
-    ggml_gallocr_free(st.allocr);
-    st.allocr = NULL;
-    st.work_buffer.clear();
-    
-    state.t_compute_img_ms = ggml_time_ms() - t_start_ms;
-    fprintf(stderr, "%s: image encoding time %i ms\n", __func__, state.t_compute_img_ms);
+    sam_image_embd_alloc(model.hparams, (enum ggml_type) header.type, entry.embd);
+}
+
+static bool sam_embd_write_file(const std::string & fname, const sam_ggml_model & model, const sam_embd_entry & entry) {
+    FILE * f = fopen(fname.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const sam_embd_file_header header = sam_embd_header(model, entry);
+
+    const bool ok =
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(entry.embd.embd->data, ggml_nbytes(entry.embd.embd), 1, f) == 1;
+
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname.c_str());
+        return false;
+    }
 
     return true;
 }
 
-std::vector<sam_image_u8> sam_compute_masks(
-              sam_image_u8 & img,
-                       int   n_threads,
-    std::vector<sam_point>   points,
-                 sam_state & state,
-                       int   mask_on_val,
-                       int   mask_off_val) {
+// read a serialized embedding into `entry`; if `entry.key` is set, it must be the embedding of that image (key and size)
+static bool sam_embd_read_file(const std::string & fname, const sam_ggml_model & model, sam_embd_entry & entry) {
+    FILE * f = fopen(fname.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
 
-    if (!state.model || !state.state) {
-        fprintf(stderr, "%s: model or state is not initialized\n", __func__);
-        return {};
+    sam_embd_file_header header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && sam_embd_header_check(model, header) &&
+        (entry.key == 0 || (header.img_hash == entry.key && header.nx == entry.nx && header.ny == entry.ny));
+
+    if (ok) {
+        sam_embd_entry_init(model, header, entry);
+
+        ok = fread(entry.embd.embd->data, ggml_nbytes(entry.embd.embd), 1, f) == 1;
+        if (!ok) {
+            sam_image_embd_free(entry.embd);
+        }
     }
 
-    if (points.empty()) {
-        fprintf(stderr, "%s: no points provided\n", __func__);
-        return {};
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "%s: failed to read an image embedding from '%s'\n", __func__, fname.c_str());
     }
 
-    const int64_t t_start_ms = ggml_time_ms();
+    return ok;
+}
 
-    static size_t buf_size = 256u*1024*1024;
+//
+// on-disk embedding cache
+//
+// one serialized embedding per image, named after its key
+// the files are evicted least-recently-used first (the modification time is updated on every hit)
+//
 
-    struct ggml_init_params ggml_params = {
-        /*.mem_size   =*/ buf_size,
-        /*.mem_buffer =*/ NULL,
-        /*.no_alloc   =*/ false,
-    };
+// the key of an image: its RGB content, its size, the model that encodes it and the storage type of the session,
+// so that sessions of different types sharing a cache directory do not load each other's embeddings
+static uint64_t sam_embd_cache_key(const sam_ggml_model & model, const sam_ggml_state & st, const sam_image_u8 & img) {
+    const int32_t size[3] = { img.nx, img.ny, (int32_t) st.embd_type };
 
-    auto& st = *state.state;
-    auto& model = *state.model;
+    return sam_hash64(img.data.data(), img.data.size(), sam_hash64(size, sizeof(size), model.id));
+}
 
-    st.ctx_masks = ggml_init(ggml_params);
+static std::filesystem::path sam_embd_cache_path(const sam_ggml_state & st, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.embd", (unsigned long long) key);
 
-    st.low_res_masks = ggml_new_tensor_3d(st.ctx_masks, GGML_TYPE_F32,
-            model.hparams.n_enc_out_chans, model.hparams.n_enc_out_chans, 3);
+    return std::filesystem::path(st.embd_cache_dir) / name;
+}
 
-    st.iou_predictions = ggml_new_tensor_1d(st.ctx_masks, GGML_TYPE_F32, 3);
+// load the embedding of the image of `entry` (key, nx, ny) if it is in the cache
+static bool sam_embd_cache_load(const sam_ggml_model & model, const sam_ggml_state & st, sam_embd_entry & entry) {
+    const auto path = sam_embd_cache_path(st, entry.key);
 
-    st.buf_compute_fast.resize(ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
-    st.allocr = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    std::error_code ec;
+    if (!std::filesystem::exists(path, ec)) {
+        return false;
+    }
 
-    // TODO: more varied prompts
-    fprintf(stderr, "prompt:\n");
-    for (const auto& pt: points) {
-        fprintf(stderr, "        (%f, %f, %d)\n", pt.x, pt.y, pt.label);
+    if (!sam_embd_read_file(path.string(), model, entry)) {
+        fprintf(stderr, "%s: ignoring invalid cache file '%s'\n", __func__, path.string().c_str());
+        return false;
     }
-    struct ggml_cgraph  * gf = sam_build_fast_graph(model, st, img.nx, img.ny, points);
-    if (!gf) {
-        fprintf(stderr, "%s: failed to build fast graph\n", __func__);
-        return {};
+
+    // the key includes the type, this only guards against files written by hand
+    if (entry.embd.embd->type != st.embd_type) {
+        fprintf(stderr, "%s: ignoring cache file '%s' of another embedding type\n", __func__, path.string().c_str());
+        sam_image_embd_free(entry.embd);
+        return false;
     }
 
-    ggml_graph_compute_helper(st.work_buffer, gf, n_threads);
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
 
-    //print_t_f32("iou_predictions", state.iou_predictions);
-    //print_t_f32("low_res_masks", state.low_res_masks);
+    return true;
+}
 
-    std::vector<sam_image_u8> masks = sam_postprocess_masks(model.hparams,
-            img.nx, img.ny, st, mask_on_val, mask_off_val);
+// remove the least recently used files until the cache fits in its size limit
+static void sam_embd_cache_evict(const sam_ggml_state & st) {
+    struct entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type time;
+        uint64_t size;
+    };
 
-    ggml_gallocr_free(st.allocr);
-    ggml_free(st.ctx_masks);
+    std::vector<entry> entries;
+    uint64_t total = 0;
 
-    st.allocr = NULL;
-    st.ctx_masks = NULL;
-    st.low_res_masks = NULL;
-    st.iou_predictions = NULL;
+    std::error_code ec;
+    for (const auto & it : std::filesystem::directory_iterator(st.embd_cache_dir, ec)) {
+        if (!it.is_regular_file(ec) || it.path().extension() != ".embd") {
+            continue;
+        }
 
-    state.t_compute_masks_ms = ggml_time_ms() - t_start_ms;
-    fprintf(stderr, "%s: mask compute time %i ms\n", __func__, state.t_compute_masks_ms);
+        entry e = { it.path(), it.last_write_time(ec), it.file_size(ec) };
+        if (ec) {
+            continue;
+        }
 
-    return masks;
+        total += e.size;
+        entries.push_back(std::move(e));
+    }
+
+    if (total <= st.embd_cache_max_size) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) {
+        return a.time < b.time;
+    });
+
+    for (const auto & e : entries) {
+        if (total <= st.embd_cache_max_size) {
+            break;
+        }
+        if (std::filesystem::remove(e.path, ec)) {
+            total -= e.size;
+        }
+    }
 }
 
-void sam_deinit(
-        sam_state & state) {
+static bool sam_embd_cache_store(const sam_ggml_model & model, const sam_ggml_state & st, const sam_embd_entry & entry) {
+    const auto path = sam_embd_cache_path(st, entry.key);
 
-   if (state.state) {
-        if (state.state->ctx_img) {
-            ggml_free(state.state->ctx_img);
+    // write to a temporary file and rename it, so that a concurrent reader never sees a partial file
+    auto path_tmp = path;
+    path_tmp += ".tmp";
+
+    std::error_code ec;
+    if (!sam_embd_write_file(path_tmp.string(), model, entry)) {
+        std::filesystem::remove(path_tmp, ec);
+        return false;
+    }
+
+    std::filesystem::rename(path_tmp, path, ec);
+    if (ec) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, path.string().c_str());
+        std::filesystem::remove(path_tmp, ec);
+        return false;
+    }
+
+    sam_embd_cache_evict(st);
+
+    return true;
+}
+
+static size_t sam_embd_entry_size(const sam_embd_entry & entry) {
+    return ggml_get_mem_size(entry.embd.ctx);
+}
+
+static void sam_embd_release(sam_ggml_state & st, sam_image_handle handle) {
+    auto it = st.embds.find(handle);
+    if (it == st.embds.end()) {
+        return;
+    }
+
+    sam_image_embd_free(it->second.embd);
+    st.embds.erase(it);
+
+    if (st.embd_cur == handle) {
+        st.embd_cur = -1;
+    }
+}
+
+// the resident embedding used least recently, other than `keep`
+static std::map<sam_image_handle, sam_embd_entry>::iterator sam_embd_lru(sam_ggml_state & st, const struct ggml_tensor * keep) {
+    auto lru = st.embds.end();
+    for (auto it = st.embds.begin(); it != st.embds.end(); ++it) {
+        if (it->second.embd.embd != keep && (lru == st.embds.end() || it->second.t_used < lru->second.t_used)) {
+            lru = it;
+        }
+    }
+
+    return lru;
+}
+
+//
+// memory governor
+//
+// the memory of a session is accounted as weights + resident embeddings + graph buffers + work buffers
+// the graph buffers count as the largest of the encoder and decoder ones, which do not live at the same time:
+// the decoder graph is kept between the decodes, but freed before an encode
+// with a limit, each graph is checked once its buffers are allocated and before it runs, and each new embedding before
+// it is made resident; the least recently used embeddings are evicted to make room, otherwise the call fails
+//
+
+static sam_memory_usage sam_memory_usage_get(const sam_ggml_model & model, const sam_ggml_state & st) {
+    sam_memory_usage usage;
+
+    usage.weights = ggml_get_mem_size(model.ctx);
+    if (model.ctx_pre) {
+        usage.weights += ggml_get_mem_size(model.ctx_pre);
+    }
+
+    for (const auto & it : st.embds) {
+        usage.embeddings += sam_embd_entry_size(it.second);
+    }
+    if (st.embd_roi.ctx) {
+        usage.embeddings += ggml_get_mem_size(st.embd_roi.ctx);
+    }
+    if (st.ctx_dec_inp) {
+        usage.embeddings += ggml_get_mem_size(st.ctx_dec_inp);
+    }
+
+    usage.compute = std::max(st.mem_graph_enc, st.mem_graph_dec) +
+        st.buf_compute_img_enc.capacity() + st.buf_compute_fast.capacity();
+    if (st.ctx_masks) {
+        usage.compute += ggml_get_mem_size(st.ctx_masks);
+    }
+
+    usage.work = st.workers.work_buffer.capacity() + st.workers.buf_parallel.capacity();
+
+    return usage;
+}
+
+// evict the least recently used embeddings, other than `keep`, until the session fits in its memory limit
+// with `extra` more bytes
+static bool sam_mem_fit(const sam_ggml_model & model, sam_ggml_state & st, size_t extra, const struct ggml_tensor * keep) {
+    if (st.mem_max_size == 0) {
+        return true;
+    }
+
+    while (true) {
+        const size_t total = sam_memory_usage_get(model, st).total() + extra;
+        if (total <= st.mem_max_size) {
+            return true;
+        }
+
+        auto lru = sam_embd_lru(st, keep);
+        if (lru == st.embds.end()) {
+            fprintf(stderr, "%s: %.1f MB needed, over the memory limit of %.1f MB\n", __func__,
+                    total/1024.0/1024.0, st.mem_max_size/1024.0/1024.0);
+            return false;
+        }
+
+        fprintf(stderr, "%s: evicting image embedding %d\n", __func__, lru->first);
+
+        sam_embd_release(st, lru->first);
+    }
+}
+
+// the bytes the work buffer has to grow by to run `gf`
+static size_t sam_mem_work_extra(const sam_workers & workers, struct ggml_cgraph * gf, int n_threads) {
+    const size_t work_size = ggml_graph_plan(gf, n_threads, workers.threadpool).work_size;
+
+    return work_size > workers.work_buffer.capacity() ? work_size - workers.work_buffer.capacity() : 0;
+}
+
+// encode `img` into `dst`, which is (re)allocated
+static bool sam_encode_image_embd(
+    const sam_image_u8 & img,
+                   int   n_threads,
+  const sam_ggml_model & model,
+        sam_ggml_state & st,
+        sam_image_embd & dst) {
+
+    // preprocess to f32
+    sam_image_f32 img1;
+    if (!sam_image_preprocess(img, img1, st.workers, n_threads)) {
+        fprintf(stderr, "%s: failed to preprocess image\n", __func__);
+        return false;
+    }
+    fprintf(stderr, "%s: preprocessed image (%d x %d)\n", __func__, img1.nx, img1.ny);
+ 
+    sam_image_embd_alloc(model.hparams, st.embd_type, dst);
+
+    // the memory of an embedding that is not resident yet (the ROI one is accounted already)
+    const size_t size_dst = &dst == &st.embd_roi ? 0 : ggml_get_mem_size(dst.ctx);
+
+    // the decoder graph is built again by the next decode, so that the graph buffers do not live at the same time
+    sam_dec_graph_free(st);
+
+    // Encode the image
+    st.buf_compute_img_enc.resize(ggml_tensor_overhead()*SAM_ENC_GRAPH_SIZE + ggml_graph_overhead_custom(SAM_ENC_GRAPH_SIZE, false));
+
+#ifdef SAM_USE_BLAS
+    ggml_backend_cpu_set_n_threads(st.backend_cpu, sam_n_threads(st.workers, n_threads));
+
+    struct ggml_cgraph  * gf = sam_encode_image(model, st, img1, dst.embd, n_threads);
+    if (!gf) {
+        fprintf(stderr, "%s: failed to encode image\n", __func__);
+        return false;
+    }
+
+    st.mem_graph_enc = ggml_backend_sched_get_buffer_size(st.sched, st.backend_cpu) +
+                       ggml_backend_sched_get_buffer_size(st.sched, st.backend_blas);
+
+    if (!sam_mem_fit(model, st, size_dst, dst.embd)) {
+        ggml_backend_sched_reset(st.sched);
+        return false;
+    }
+
+    ggml_backend_sched_graph_compute(st.sched, gf);
+    ggml_backend_sched_reset(st.sched);
+#else
+    st.allocr = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+
+    struct ggml_cgraph  * gf = sam_encode_image(model, st, img1, dst.embd, n_threads);
+    if (!gf) {
+        fprintf(stderr, "%s: failed to encode image\n", __func__);
+        return false;
+    }
+
+    st.mem_graph_enc = ggml_gallocr_get_buffer_size(st.allocr, 0);
+
+    if (!sam_mem_fit(model, st, size_dst + sam_mem_work_extra(st.workers, gf, sam_n_threads(st.workers, n_threads)), dst.embd)) {
+        ggml_gallocr_free(st.allocr);
+        st.allocr = NULL;
+        return false;
+    }
+
+    ggml_graph_compute_helper(st.workers.work_buffer, gf, sam_n_threads(st.workers, n_threads), st.workers.threadpool);
+#endif
+
+    if (dst.embd->type == GGML_TYPE_F32) {
+        print_t_f32("embd_img", dst.embd);
+    }
+
+    ggml_gallocr_free(st.allocr);
+    st.allocr = NULL;
+    st.workers.work_buffer.clear();
+
+    return true;
+}
+
+// evict the least recently used embeddings until `size` more bytes fit in the budget
+static void sam_embd_evict(sam_ggml_state & st, size_t size) {
+    uint64_t used = 0;
+    for (const auto & it : st.embds) {
+        used += sam_embd_entry_size(it.second);
+    }
+
+    while (!st.embds.empty() && used + size > st.embd_max_size) {
+        auto lru = sam_embd_lru(st, nullptr);
+
+        fprintf(stderr, "%s: evicting image embedding %d\n", __func__, lru->first);
+
+        used -= sam_embd_entry_size(lru->second);
+        sam_embd_release(st, lru->first);
+    }
+}
+
+// make `entry` resident and return its handle, -1 if it does not fit in the memory limit
+// (the entry is freed then)
+static sam_image_handle sam_embd_insert(const sam_ggml_model & model, sam_ggml_state & st, sam_embd_entry & entry) {
+    // the new embedding is always kept, even if it does not fit in the budget on its own
+    sam_embd_evict(st, sam_embd_entry_size(entry));
+
+    if (!sam_mem_fit(model, st, sam_embd_entry_size(entry), nullptr)) {
+        sam_image_embd_free(entry.embd);
+        return -1;
+    }
+
+    const sam_image_handle handle = st.embd_next++;
+
+    st.embds[handle] = entry;
+    st.embds[handle].t_used = ++st.embd_clock;
+
+    return handle;
+}
+
+// the resident embedding of the image with this key, if any
+static sam_image_handle sam_embd_find(sam_ggml_state & st, uint64_t key, int nx, int ny) {
+    for (auto & it : st.embds) {
+        if (it.second.key == key && it.second.nx == nx && it.second.ny == ny) {
+            it.second.t_used = ++st.embd_clock;
+            return it.first;
+        }
+    }
+
+    return -1;
+}
+
+// the embedding of `img`: resident, from the on-disk cache or encoded
+static sam_image_handle sam_embd_acquire(
+        sam_image_u8 & img,
+                 int   n_threads,
+           sam_state & state) {
+
+    const auto & model = *state.model;
+    auto & st = *state.state;
+
+    const int64_t t_start_ms = ggml_time_ms();
+
+    const uint64_t key = sam_embd_cache_key(model, st, img);
+
+    {
+        const sam_image_handle handle = sam_embd_find(st, key, img.nx, img.ny);
+        if (handle >= 0) {
+            state.t_compute_img_ms = 0;
+            fprintf(stderr, "%s: the image embedding is resident\n", __func__);
+
+            return handle;
+        }
+    }
+
+    sam_embd_entry entry;
+    entry.key = key;
+    entry.nx  = img.nx;
+    entry.ny  = img.ny;
+
+    bool cached = false;
+    if (!st.embd_cache_dir.empty()) {
+        cached = sam_embd_cache_load(model, st, entry);
+        if (cached) {
+            state.t_compute_img_ms = ggml_time_ms() - t_start_ms;
+            fprintf(stderr, "%s: loaded the image embedding from the cache in %i ms\n", __func__, state.t_compute_img_ms);
+        }
+    }
+
+    if (!cached) {
+        if (!sam_encode_image_embd(img, n_threads, model, st, entry.embd)) {
+            sam_image_embd_free(entry.embd);
+            return -1;
+        }
+
+        state.t_compute_img_ms = ggml_time_ms() - t_start_ms;
+        fprintf(stderr, "%s: image encoding time %i ms\n", __func__, state.t_compute_img_ms);
+
+        if (!st.embd_cache_dir.empty()) {
+            sam_embd_cache_store(model, st, entry);
+        }
+    }
+
+    return sam_embd_insert(model, st, entry);
+}
+
+bool sam_compute_embd_img(
+        sam_image_u8 & img,
+                 int   n_threads ,
+           sam_state & state) {
+
+    if (!state.model || !state.state) {
+        return false;
+    }
+
+    state.state->embd_cur = sam_embd_acquire(img, n_threads, state);
+
+    return state.state->embd_cur >= 0;
+}
+
+sam_image_handle sam_compute_embd_img_handle(
+        sam_image_u8 & img,
+                 int   n_threads,
+           sam_state & state) {
+
+    if (!state.model || !state.state) {
+        return -1;
+    }
+
+    return sam_embd_acquire(img, n_threads, state);
+}
+
+void sam_release_embd_img(
+    sam_image_handle   handle,
+           sam_state & state) {
+
+    if (!state.state) {
+        return;
+    }
+
+    sam_embd_release(*state.state, handle);
+}
+
+sam_memory_usage sam_get_memory_usage(
+     const sam_state & state) {
+
+    if (!state.model || !state.state) {
+        return {};
+    }
+
+    return sam_memory_usage_get(*state.model, *state.state);
+}
+
+bool sam_export_embd_img(
+    sam_image_handle   handle,
+     const sam_state & state,
+std::vector<uint8_t> & buf) {
+
+    if (!state.model || !state.state) {
+        return false;
+    }
+
+    const auto it = state.state->embds.find(handle);
+    if (it == state.state->embds.end()) {
+        fprintf(stderr, "%s: no resident image embedding %d\n", __func__, handle);
+        return false;
+    }
+
+    const sam_embd_file_header header = sam_embd_header(*state.model, it->second);
+    const struct ggml_tensor * embd = it->second.embd.embd;
+
+    buf.resize(sizeof(header) + ggml_nbytes(embd));
+    memcpy(buf.data(), &header, sizeof(header));
+    memcpy(buf.data() + sizeof(header), embd->data, ggml_nbytes(embd));
+
+    return true;
+}
+
+bool sam_export_embd_img_file(
+    sam_image_handle   handle,
+     const sam_state & state,
+   const std::string & fname) {
+
+    if (!state.model || !state.state) {
+        return false;
+    }
+
+    const auto it = state.state->embds.find(handle);
+    if (it == state.state->embds.end()) {
+        fprintf(stderr, "%s: no resident image embedding %d\n", __func__, handle);
+        return false;
+    }
+
+    return sam_embd_write_file(fname, *state.model, it->second);
+}
+
+// make an imported entry resident, unless the embedding of the same image already is
+static sam_image_handle sam_embd_import(const sam_ggml_model & model, sam_ggml_state & st, sam_embd_entry & entry) {
+    sam_image_handle handle = sam_embd_find(st, entry.key, entry.nx, entry.ny);
+    if (handle >= 0) {
+        sam_image_embd_free(entry.embd);
+    } else {
+        handle = sam_embd_insert(model, st, entry);
+    }
+
+    if (handle >= 0) {
+        st.embd_cur = handle;
+    }
+
+    return handle;
+}
+
+sam_image_handle sam_import_embd_img(
+       const uint8_t * data,
+                size_t   size,
+           sam_state & state) {
+
+    if (!state.model || !state.state || !data) {
+        return -1;
+    }
+
+    const auto & model = *state.model;
+
+    sam_embd_file_header header;
+    if (size < sizeof(header)) {
+        fprintf(stderr, "%s: buffer too small\n", __func__);
+        return -1;
+    }
+
+    memcpy(&header, data, sizeof(header));
+    if (!sam_embd_header_check(model, header)) {
+        return -1;
+    }
+
+    sam_embd_entry entry;
+    sam_embd_entry_init(model, header, entry);
+
+    if (size < sizeof(header) + ggml_nbytes(entry.embd.embd)) {
+        fprintf(stderr, "%s: buffer too small\n", __func__);
+        sam_image_embd_free(entry.embd);
+        return -1;
+    }
+
+    memcpy(entry.embd.embd->data, data + sizeof(header), ggml_nbytes(entry.embd.embd));
+
+    return sam_embd_import(*state.model, *state.state, entry);
+}
+
+sam_image_handle sam_import_embd_img_file(
+   const std::string & fname,
+           sam_state & state) {
+
+    if (!state.model || !state.state) {
+        return -1;
+    }
+
+    sam_embd_entry entry;
+    if (!sam_embd_read_file(fname, *state.model, entry)) {
+        return -1;
+    }
+
+    return sam_embd_import(*state.model, *state.state, entry);
+}
+
+// bounded blocking queue of activation buffers handed from one encoder stage to the next
+// at most `capacity` buffers are in flight, and released buffers are recycled by the producer
+struct sam_activation_queue {
+    struct item {
+        size_t idx;
+        std::vector<float> data;
+    };
+
+    explicit sam_activation_queue(size_t capacity) : capacity(capacity) {}
+
+    // get an empty buffer of n floats, blocks while `capacity` buffers are in flight
+    std::vector<float> acquire(size_t n) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return n_in_flight < capacity; });
+        n_in_flight++;
+
+        std::vector<float> res;
+        if (!free.empty()) {
+            res = std::move(free.back());
+            free.pop_back();
+        }
+        res.resize(n);
+
+        return res;
+    }
+
+    void push(size_t idx, std::vector<float> && data) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back({ idx, std::move(data) });
+        }
+        cv.notify_all();
+    }
+
+    // returns false once the producer has closed the queue and it is drained
+    bool pop(item & res) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+
+        res = std::move(items.front());
+        items.pop_front();
+
+        return true;
+    }
+
+    void release(std::vector<float> && data) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free.push_back(std::move(data));
+            n_in_flight--;
+        }
+        cv.notify_all();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        cv.notify_all();
+    }
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::deque<item>                items;
+    std::vector<std::vector<float>> free;
+
+    size_t capacity;
+    size_t n_in_flight = 0;
+    bool   closed      = false;
+};
+
+// a contiguous range of encoder blocks with its own graph, compute buffer and pinned workers
+struct sam_encoder_stage {
+    int  il0   = 0; // first block
+    int  il1   = 0; // one past the last block
+    bool first = false;
+    bool last  = false;
+
+    sam_workers workers;
+
+    std::vector<uint8_t>  buf_compute;
+    struct ggml_context * ctx0   = {};
+    struct ggml_cgraph  * gf     = {};
+    struct ggml_tensor  * inp    = {};
+    struct ggml_tensor  * out    = {};
+    ggml_gallocr_t        allocr = {};
+};
+
+// split the encoder blocks into contiguous stages of roughly equal cost
+// global attention blocks attend over all 64x64 tokens and cost more than the windowed ones
+static std::vector<std::pair<int, int>> sam_encoder_split_stages(const sam_hparams & hparams, int n_stages) {
+    const int n_enc_layer = hparams.n_enc_layer;
+
+    n_stages = std::max(1, std::min(n_stages, n_enc_layer));
+
+    std::vector<float> cost(n_enc_layer);
+    float cost_total = 0.0f;
+    for (int il = 0; il < n_enc_layer; ++il) {
+        cost[il] = hparams.is_global_attn(il) ? 1.25f : 1.0f;
+        cost_total += cost[il];
+    }
+
+    std::vector<std::pair<int, int>> res;
+
+    int   il0 = 0;
+    float acc = 0.0f;
+    for (int il = 0; il < n_enc_layer; ++il) {
+        acc += cost[il];
+
+        const int n_stages_left = n_stages - (int) res.size() - 1;
+        const int n_blocks_left = n_enc_layer - il - 1;
+
+        const bool full = acc >= cost_total*(res.size() + 1)/n_stages - 0.5f*cost[il];
+        if (n_stages_left > 0 && (full || n_blocks_left == n_stages_left)) {
+            res.push_back({ il0, il + 1 });
+            il0 = il + 1;
+        }
+    }
+    res.push_back({ il0, n_enc_layer });
+
+    return res;
+}
+
+static bool sam_encoder_stage_init(const sam_ggml_model & model, sam_encoder_stage & stage) {
+    const auto & hparams = model.hparams;
+
+    const int32_t n_enc_state = hparams.n_enc_state;
+    const int32_t n_img_size  = hparams.n_img_size();
+    const int32_t n_img_embd  = hparams.n_img_embd();
+
+    stage.buf_compute.resize(ggml_tensor_overhead()*SAM_ENC_GRAPH_SIZE + ggml_graph_overhead_custom(SAM_ENC_GRAPH_SIZE, false));
+
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ stage.buf_compute.size(),
+        /*.mem_buffer =*/ stage.buf_compute.data(),
+        /*.no_alloc   =*/ true, // skip allocating as we use ggml_alloc to allocate exact memory requirements
+    };
+
+    stage.ctx0 = ggml_init(ggml_params);
+    stage.gf   = ggml_new_graph_custom(stage.ctx0, SAM_ENC_GRAPH_SIZE, false);
+
+    struct ggml_tensor * cur = {};
+    if (stage.first) {
+        stage.inp = ggml_new_tensor_4d(stage.ctx0, GGML_TYPE_F32, n_img_size, n_img_size, 3, 1);
+        ggml_set_input(stage.inp);
+
+        cur = sam_encode_image_patch_embd(model, stage.ctx0, stage.inp);
+    } else {
+        stage.inp = ggml_new_tensor_4d(stage.ctx0, GGML_TYPE_F32, n_enc_state, n_img_embd, n_img_embd, 1);
+        ggml_set_input(stage.inp);
+
+        cur = stage.inp;
+    }
+
+    for (int il = stage.il0; il < stage.il1; ++il) {
+        cur = sam_encode_image_block(model, stage.ctx0, il, cur);
+    }
+
+    if (stage.last) {
+        cur = sam_encode_image_neck(model, stage.ctx0, cur);
+    }
+
+    stage.out = cur;
+    ggml_set_output(stage.out);
+
+    ggml_build_forward_expand(stage.gf, stage.out);
+
+    // the graph is built once and its allocation is kept for all the images
+    stage.allocr = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    if (!ggml_gallocr_alloc_graph(stage.allocr, stage.gf)) {
+        fprintf(stderr, "%s: failed to allocate stage for blocks [%d, %d)\n", __func__, stage.il0, stage.il1);
+        return false;
+    }
+
+    return true;
+}
+
+static void sam_encoder_stage_free(sam_encoder_stage & stage) {
+    if (stage.allocr) {
+        ggml_gallocr_free(stage.allocr);
+    }
+    if (stage.ctx0) {
+        ggml_free(stage.ctx0);
+    }
+    if (stage.workers.threadpool) {
+        ggml_threadpool_free(stage.workers.threadpool);
+    }
+}
+
+bool sam_compute_embd_imgs_pipelined(
+        const std::vector<sam_image_u8> & imgs,
+                                    int   n_threads,
+                                    int   n_stages,
+                              sam_state & state,
+            const sam_embd_img_callback & on_embd) {
+
+    if (!state.model || !state.state) {
+        return false;
+    }
+
+    if (imgs.empty()) {
+        return true;
+    }
+
+    const int64_t t_start_ms = ggml_time_ms();
+
+    const auto & model   = *state.model;
+    const auto & hparams = model.hparams;
+
+    const auto ranges = sam_encoder_split_stages(hparams, n_stages);
+    n_stages = ranges.size();
+
+    const int n_threads_stage = std::max(1, n_threads/n_stages);
+
+    // each stage gets its own group of cores
+    std::vector<sam_encoder_stage> stages(n_stages);
+    for (int is = 0; is < n_stages; ++is) {
+        auto & stage = stages[is];
+
+        stage.il0   = ranges[is].first;
+        stage.il1   = ranges[is].second;
+        stage.first = is == 0;
+        stage.last  = is == n_stages - 1;
+
+        // stay within the cores of the session (e.g. its NUMA node) if it has any
+        const auto & cpus_session = state.state->workers.cpus;
+
+        std::vector<int> cpus;
+        for (int i = 0; i < n_threads_stage; ++i) {
+            const int k = is*n_threads_stage + i;
+            cpus.push_back(cpus_session.empty() ? k : cpus_session[k % cpus_session.size()]);
+        }
+
+        stage.workers.threadpool = sam_threadpool_new(n_threads_stage, state.state->workers.poll, true, cpus);
+        stage.workers.n_threads  = n_threads_stage;
+        stage.workers.poll       = state.state->workers.poll;
+
+        if (!stage.workers.threadpool || !sam_encoder_stage_init(model, stage)) {
+            for (auto & s : stages) {
+                sam_encoder_stage_free(s);
+            }
+            return false;
+        }
+
+        fprintf(stderr, "%s: stage %d: blocks [%2d, %2d), %d threads on cores [%d, %d]\n", __func__,
+                is, stage.il0, stage.il1, n_threads_stage, cpus.front(), cpus.back());
+    }
+
+    const size_t n_act = ggml_nelements(stages[0].out);
+
+    // queues[is] connects stage is to stage is + 1
+    // two buffers per queue, so that a stage can compute the next image while its successor consumes the previous one
+    std::vector<std::unique_ptr<sam_activation_queue>> queues;
+    for (int is = 0; is < n_stages - 1; ++is) {
+        queues.emplace_back(new sam_activation_queue(2));
+    }
+
+    // set by the first stage when an image cannot be preprocessed: it stops and closes its queue,
+    // the next stages finish the images already in flight and stop in turn
+    std::atomic<bool> failed(false);
+
+    auto run_stage = [&](int is) {
+        auto & stage = stages[is];
+
+        sam_activation_queue * q_inp = stage.first ? nullptr : queues[is - 1].get();
+        sam_activation_queue * q_out = stage.last  ? nullptr : queues[is].get();
+
+        size_t idx_next = 0;
+        while (true) {
+            size_t idx = 0;
+
+            if (stage.first) {
+                if (idx_next == imgs.size()) {
+                    break;
+                }
+                idx = idx_next++;
+
+                sam_image_f32 img1;
+                if (!sam_image_preprocess(imgs[idx], img1, stage.workers, n_threads_stage)) {
+                    fprintf(stderr, "%s: failed to preprocess image %zu\n", __func__, idx);
+                    failed = true;
+                    break;
+                }
+                sam_image_to_planar(img1, (float *) stage.inp->data, stage.workers, n_threads_stage);
+            } else {
+                sam_activation_queue::item item;
+                if (!q_inp->pop(item)) {
+                    break;
+                }
+                idx = item.idx;
+
+                memcpy(stage.inp->data, item.data.data(), ggml_nbytes(stage.inp));
+                q_inp->release(std::move(item.data));
+            }
+
+            ggml_graph_compute_helper(stage.workers.work_buffer, stage.gf, n_threads_stage, stage.workers.threadpool);
+
+            if (stage.last) {
+                on_embd(idx, (const float *) stage.out->data, ggml_nelements(stage.out));
+            } else {
+                std::vector<float> data = q_out->acquire(n_act);
+                memcpy(data.data(), stage.out->data, ggml_nbytes(stage.out));
+                q_out->push(idx, std::move(data));
+            }
+        }
+
+        if (q_out) {
+            q_out->close();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int is = 0; is < n_stages; ++is) {
+        threads.emplace_back(run_stage, is);
+    }
+    for (auto & t : threads) {
+        t.join();
+    }
+
+    for (auto & stage : stages) {
+        sam_encoder_stage_free(stage);
+    }
+
+    if (failed) {
+        return false;
+    }
+
+    state.t_compute_img_ms = ggml_time_ms() - t_start_ms;
+    fprintf(stderr, "%s: encoded %zu images in %i ms (%.2f images/s)\n", __func__,
+            imgs.size(), state.t_compute_img_ms, 1e3*imgs.size()/std::max(1, state.t_compute_img_ms));
+
+    return true;
+}
+
+// compute the decoder input of the image embedding `embd`, unless it is the one of the last decode:
+// the embedding plus the no-mask dense prompt, flattened and permuted to tokens
+static bool sam_dec_inputs_prepare(
+  const sam_ggml_model & model,
+        sam_ggml_state & st,
+  const sam_image_embd & embd,
+                   int   n_threads) {
+
+    if (st.dec_src && st.dec_src_id == embd.id) {
+        return true;
+    }
+
+    const auto & hparams = model.hparams;
+
+    const int64_t n_chans  = hparams.n_enc_out_chans;
+    const int64_t n_tokens = hparams.n_img_embd()*hparams.n_img_embd();
+
+    if (!st.ctx_dec_inp) {
+        const size_t buf_size = ggml_tensor_overhead() + ggml_row_size(GGML_TYPE_F32, n_chans)*n_tokens;
+
+        if (!sam_mem_fit(model, st, buf_size, embd.embd)) {
+            return false;
+        }
+
+        struct ggml_init_params ggml_params = {
+            /*.mem_size   =*/ buf_size,
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ false,
+        };
+
+        st.ctx_dec_inp = ggml_init(ggml_params);
+
+        st.dec_src = ggml_new_tensor_2d(st.ctx_dec_inp, GGML_TYPE_F32, n_chans, n_tokens);
+    }
+
+    st.dec_src_id = 0;
+
+    std::vector<uint8_t> buf_graph(ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
+
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ buf_graph.size(),
+        /*.mem_buffer =*/ buf_graph.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(ggml_params);
+    struct ggml_cgraph  * gf   = ggml_new_graph(ctx0);
+
+    // src = embd_img + dense_prompt, flattened & permuted
+    // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/mask_decoder.py#L125
+    // ref: https://github.com/facebookresearch/segment-anything/blob/6fdee8f2727f4506cfbbe553e23b895e27956588/segment_anything/modeling/transformer.py#L83
+    {
+        struct ggml_tensor * cur = embd.embd;
+        if (cur->type != GGML_TYPE_F32) {
+            cur = sam_embd_dequantize(ctx0, cur);
+        }
+
+        cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.enc_prompt.no_mask_embd_w, 1, 1, n_chans));
+        cur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, cur, n_tokens, n_chans));
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, cur, st.dec_src));
+    }
+
+    ggml_free(ctx0);
+
+    ggml_gallocr_t allocr = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    ggml_gallocr_alloc_graph(allocr, gf);
+
+    // from sam_embd_dequantize
+    if (struct ggml_tensor * rows = ggml_graph_get_tensor(gf, "embd_rows")) {
+        int32_t * data = (int32_t *) rows->data;
+        for (int64_t i = 0; i < rows->ne[0]; ++i) {
+            data[i] = i;
+        }
+    }
+
+    const size_t extra = ggml_gallocr_get_buffer_size(allocr, 0) + sam_mem_work_extra(st.workers, gf, sam_n_threads(st.workers, n_threads));
+    if (!sam_mem_fit(model, st, extra, embd.embd)) {
+        ggml_gallocr_free(allocr);
+        return false;
+    }
+
+    ggml_graph_compute_helper(st.workers.work_buffer, gf, sam_n_threads(st.workers, n_threads), st.workers.threadpool);
+
+    ggml_gallocr_free(allocr);
+
+    st.dec_src_id = embd.id;
+
+    return true;
+}
+
+// decode the masks of an nx x ny image from its embedding `embd_img`, for all the prompts in a single decoder pass
+// mask_in:  optional low-res logits of a previous mask, the dense prompt of the whole batch
+// mask_out: optional, the low-res logits of the best mask of the first prompt
+static std::vector<std::vector<sam_image_u8>> sam_compute_masks_batch_impl(
+                                          int   nx,
+                                          int   ny,
+                                          int   n_threads,
+  const std::vector<std::vector<sam_point>> & prompts,
+                                    sam_state & state,
+                         const sam_image_embd & embd_img,
+                                          int   mask_on_val,
+                                          int   mask_off_val,
+                                  const float * mask_in,
+                           std::vector<float> * mask_out) {
+
+    if (!embd_img.embd) {
+        fprintf(stderr, "%s: the image is not encoded\n", __func__);
+        return {};
+    }
+
+    if (prompts.empty()) {
+        fprintf(stderr, "%s: no prompts provided\n", __func__);
+        return {};
+    }
+
+    for (const auto & points : prompts) {
+        if (points.empty()) {
+            fprintf(stderr, "%s: no points provided\n", __func__);
+            return {};
+        }
+        if (!sam_prompt_check(points)) {
+            return {};
+        }
+    }
+
+    const int n_prompts = prompts.size();
+
+    const int64_t t_start_ms = ggml_time_ms();
+
+    auto& st = *state.state;
+    auto& model = *state.model;
+
+    if (mask_in && !model.enc_prompt.has_mask_down) {
+        fprintf(stderr, "%s: the model has no mask prompt encoder, convert it again to use mask prompts\n", __func__);
+        return {};
+    }
+
+    const int n_enc_out_chans = model.hparams.n_enc_out_chans;
+
+    if (!sam_dec_inputs_prepare(model, st, embd_img, n_threads)) {
+        return {};
+    }
+
+    // TODO: more varied prompts
+    size_t n_tokens = 0;
+    for (int ip = 0; ip < n_prompts; ++ip) {
+        fprintf(stderr, "prompt %d:\n", ip);
+        for (const auto& pt: prompts[ip]) {
+            fprintf(stderr, "        (%f, %f, %d)\n", pt.x, pt.y, pt.label);
+        }
+        n_tokens = std::max(n_tokens, sam_prompt_n_tokens(prompts[ip]));
+    }
+
+    if (!sam_dec_graph_prepare(model, st, sam_dec_n_pt(n_tokens), n_prompts, mask_in != nullptr)) {
+        return {};
+    }
+
+    struct ggml_cgraph * gf = st.gf_dec;
+
+    if (!sam_mem_fit(model, st, sam_mem_work_extra(st.workers, gf, sam_n_threads(st.workers, n_threads)), embd_img.embd)) {
+        sam_dec_graph_free(st);
+        return {};
+    }
+
+    sam_fast_graph_set_inputs(model, gf, nx, ny, prompts, mask_in);
+
+    ggml_graph_compute_helper(st.workers.work_buffer, gf, sam_n_threads(st.workers, n_threads), st.workers.threadpool);
+
+    //print_t_f32("iou_predictions", state.iou_predictions);
+    //print_t_f32("low_res_masks", state.low_res_masks);
+
+    std::vector<std::vector<sam_image_u8>> masks(n_prompts);
+    for (int ip = 0; ip < n_prompts; ++ip) {
+        int i_best = -1;
+        masks[ip] = sam_postprocess_masks(model.hparams,
+                nx, ny, st, ip, n_threads, mask_on_val, mask_off_val, &i_best);
+
+        if (ip == 0 && mask_out) {
+            mask_out->clear();
+            if (i_best >= 0) {
+                const float * data = (const float *) st.low_res_masks->data;
+                const int64_t n = n_enc_out_chans*n_enc_out_chans;
+                mask_out->assign(data + i_best*n, data + (i_best + 1)*n);
+            }
+        }
+    }
+
+    // the graph is kept for the next decode
+
+    state.t_compute_masks_ms = ggml_time_ms() - t_start_ms;
+    fprintf(stderr, "%s: mask compute time %i ms (%d prompts)\n", __func__, state.t_compute_masks_ms, n_prompts);
+
+    return masks;
+}
+
+// decode the masks of a single prompt
+static std::vector<sam_image_u8> sam_compute_masks_impl(
+                       int   nx,
+                       int   ny,
+                       int   n_threads,
+    std::vector<sam_point>   points,
+                 sam_state & state,
+    const sam_image_embd   & embd_img,
+                       int   mask_on_val,
+                       int   mask_off_val) {
+
+    auto masks = sam_compute_masks_batch_impl(nx, ny, n_threads, { std::move(points) }, state,
+            embd_img, mask_on_val, mask_off_val, nullptr, nullptr);
+    if (masks.empty()) {
+        return {};
+    }
+
+    return std::move(masks[0]);
+}
+
+std::vector<sam_image_u8> sam_compute_masks(
+              sam_image_u8 & img,
+                       int   n_threads,
+    std::vector<sam_point>   points,
+                 sam_state & state,
+                       int   mask_on_val,
+                       int   mask_off_val) {
+
+    if (!state.model || !state.state) {
+        fprintf(stderr, "%s: model or state is not initialized\n", __func__);
+        return {};
+    }
+
+    auto & st = *state.state;
+
+    auto it = st.embds.find(st.embd_cur);
+    if (it == st.embds.end()) {
+        fprintf(stderr, "%s: the image is not encoded\n", __func__);
+        return {};
+    }
+
+    it->second.t_used = ++st.embd_clock;
+
+    return sam_compute_masks_impl(img.nx, img.ny, n_threads, std::move(points), state,
+            it->second.embd, mask_on_val, mask_off_val);
+}
+
+std::vector<sam_image_u8> sam_compute_masks(
+          sam_image_handle   handle,
+                       int   n_threads,
+    std::vector<sam_point>   points,
+                 sam_state & state,
+                       int   mask_on_val,
+                       int   mask_off_val) {
+
+    if (!state.model || !state.state) {
+        fprintf(stderr, "%s: model or state is not initialized\n", __func__);
+        return {};
+    }
+
+    auto & st = *state.state;
+
+    auto it = st.embds.find(handle);
+    if (it == st.embds.end()) {
+        fprintf(stderr, "%s: no resident image embedding %d\n", __func__, handle);
+        return {};
+    }
+
+    it->second.t_used = ++st.embd_clock;
+
+    return sam_compute_masks_impl(it->second.nx, it->second.ny, n_threads, std::move(points), state,
+            it->second.embd, mask_on_val, mask_off_val);
+}
+
+std::vector<sam_image_u8> sam_compute_masks(
+          sam_image_handle   handle,
+                       int   n_threads,
+             const sam_box & box,
+    std::vector<sam_point>   points,
+                 sam_state & state,
+                       int   mask_on_val,
+                       int   mask_off_val) {
+
+    points.push_back({ std::min(box.x0, box.x1), std::min(box.y0, box.y1), SAM_POINT_LABEL_BOX_TL });
+    points.push_back({ std::max(box.x0, box.x1), std::max(box.y0, box.y1), SAM_POINT_LABEL_BOX_BR });
+
+    return sam_compute_masks(handle, n_threads, std::move(points), state, mask_on_val, mask_off_val);
+}
+
+std::vector<std::vector<sam_image_u8>> sam_compute_masks_batch(
+                             sam_image_handle   handle,
+                                          int   n_threads,
+  const std::vector<std::vector<sam_point>> & prompts,
+                                    sam_state & state,
+                                          int   mask_on_val,
+                                          int   mask_off_val) {
+
+    if (!state.model || !state.state) {
+        fprintf(stderr, "%s: model or state is not initialized\n", __func__);
+        return {};
+    }
+
+    auto & st = *state.state;
+
+    auto it = st.embds.find(handle);
+    if (it == st.embds.end()) {
+        fprintf(stderr, "%s: no resident image embedding %d\n", __func__, handle);
+        return {};
+    }
+
+    it->second.t_used = ++st.embd_clock;
+
+    return sam_compute_masks_batch_impl(it->second.nx, it->second.ny, n_threads, prompts, state,
+            it->second.embd, mask_on_val, mask_off_val, nullptr, nullptr);
+}
+
+std::vector<sam_image_u8> sam_compute_masks_refine(
+          sam_image_handle   handle,
+                       int   n_threads,
+    std::vector<sam_point>   points,
+                 sam_state & state,
+                       int   mask_on_val,
+                       int   mask_off_val) {
+
+    if (!state.model || !state.state) {
+        fprintf(stderr, "%s: model or state is not initialized\n", __func__);
+        return {};
+    }
+
+    auto & st = *state.state;
+
+    auto it = st.embds.find(handle);
+    if (it == st.embds.end()) {
+        fprintf(stderr, "%s: no resident image embedding %d\n", __func__, handle);
+        return {};
+    }
+
+    it->second.t_used = ++st.embd_clock;
+
+    const sam_image_embd & embd = it->second.embd;
+
+    // a session on another embedding starts over
+    if (st.mask_logits_id != embd.id) {
+        st.mask_logits.clear();
+        st.mask_logits_id = embd.id;
+    }
+
+    // the first decode of a session has no previous mask, nor has a model converted without the mask prompt encoder
+    const float * mask_in = nullptr;
+    if (!st.mask_logits.empty() && state.model->enc_prompt.has_mask_down) {
+        mask_in = st.mask_logits.data();
+    }
+
+    std::vector<float> mask_out;
+    auto masks = sam_compute_masks_batch_impl(it->second.nx, it->second.ny, n_threads, { std::move(points) }, state,
+            embd, mask_on_val, mask_off_val, mask_in, &mask_out);
+    if (masks.empty()) {
+        return {};
+    }
+
+    st.mask_logits = std::move(mask_out);
+
+    return std::move(masks[0]);
+}
+
+void sam_refine_reset(sam_state & state) {
+    if (!state.state) {
+        return;
+    }
+
+    state.state->mask_logits.clear();
+    state.state->mask_logits_id = 0;
+}
+
+sam_image_u8 sam_refine_mask_roi(
+              sam_image_u8 & img,
+        const sam_image_u8 & mask,
+                       int   n_threads,
+    std::vector<sam_point>   points,
+                 sam_state & state,
+                     float   margin,
+                       int   mask_on_val,
+                       int   mask_off_val) {
+
+    if (!state.model || !state.state) {
+        fprintf(stderr, "%s: model or state is not initialized\n", __func__);
+        return {};
+    }
+
+    if (mask.nx != img.nx || mask.ny != img.ny || (int) mask.data.size() != img.nx*img.ny) {
+        fprintf(stderr, "%s: mask (%d x %d) does not match the image (%d x %d)\n", __func__, mask.nx, mask.ny, img.nx, img.ny);
+        return {};
+    }
+
+    // bounding box of the mask
+    int x0 = img.nx;
+    int y0 = img.ny;
+    int x1 = -1;
+    int y1 = -1;
+    for (int iy = 0; iy < img.ny; ++iy) {
+        for (int ix = 0; ix < img.nx; ++ix) {
+            if (mask.data[iy*img.nx + ix] != mask_off_val) {
+                x0 = std::min(x0, ix);
+                y0 = std::min(y0, iy);
+                x1 = std::max(x1, ix);
+                y1 = std::max(y1, iy);
+            }
+        }
+    }
+
+    if (x1 < 0) {
+        fprintf(stderr, "%s: the mask is empty\n", __func__);
+        return {};
+    }
+
+    // the refined mask replaces the input one inside its bounding box only
+    const int bx0 = x0;
+    const int by0 = y0;
+    const int bx1 = x1;
+    const int by1 = y1;
+
+    // grow the box by the margin on every side, so the decoder sees some context around the object
+    {
+        const int n_min = 16; // one patch of the encoder
+
+        const int pad = std::max(n_min/2, int(margin*std::max(x1 - x0 + 1, y1 - y0 + 1) + 0.5f));
+
+        x0 = std::max(0, x0 - pad);
+        y0 = std::max(0, y0 - pad);
+        x1 = std::min(img.nx - 1, x1 + pad);
+        y1 = std::min(img.ny - 1, y1 + pad);
+    }
+
+    sam_image_u8 crop;
+    crop.nx = x1 - x0 + 1;
+    crop.ny = y1 - y0 + 1;
+    crop.data.resize(3*crop.nx*crop.ny);
+    for (int iy = 0; iy < crop.ny; ++iy) {
+        memcpy(crop.data.data() + 3*iy*crop.nx, img.data.data() + 3*((y0 + iy)*img.nx + x0), 3*crop.nx);
+    }
+
+    // the prompts in crop coordinates, the points outside of the crop are dropped and the box corners are clamped to it
+    std::vector<sam_point> points_crop;
+    for (const auto & pt : points) {
+        if (pt.label == SAM_POINT_LABEL_BOX_TL || pt.label == SAM_POINT_LABEL_BOX_BR) {
+            points_crop.push_back({
+                std::min(std::max(pt.x, float(x0)), float(x1 + 1)) - x0,
+                std::min(std::max(pt.y, float(y0)), float(y1 + 1)) - y0, pt.label });
+        } else if (pt.x >= x0 && pt.x <= x1 + 1 && pt.y >= y0 && pt.y <= y1 + 1) {
+            points_crop.push_back({ pt.x - x0, pt.y - y0, pt.label });
+        }
+    }
+
+    if (points_crop.empty()) {
+        fprintf(stderr, "%s: no prompt point inside the region (%d, %d) - (%d, %d)\n", __func__, x0, y0, x1, y1);
+        return {};
+    }
+
+    fprintf(stderr, "%s: refining region (%d, %d) - (%d, %d)\n", __func__, x0, y0, x1, y1);
+
+    // the crop is encoded up to the model resolution, into its own embedding to keep the full image one
+    const int64_t t_start_ms = ggml_time_ms();
+
+    if (!sam_encode_image_embd(crop, n_threads, *state.model, *state.state, state.state->embd_roi)) {
+        return {};
+    }
+
+    state.t_compute_img_ms = ggml_time_ms() - t_start_ms;
+
+    std::vector<sam_image_u8> masks_crop = sam_compute_masks_impl(crop.nx, crop.ny, n_threads, points_crop, state,
+            state.state->embd_roi, mask_on_val, mask_off_val);
+
+    // the refined mask replaces the input one inside its bounding box, in the margin around it the two are OR-ed,
+    // so the refinement can grow the object but does not erase what the input mask had there
+    sam_image_u8 res = mask;
+    if (masks_crop.empty()) {
+        fprintf(stderr, "%s: no mask in the region, keeping the input mask\n", __func__);
+        return res;
+    }
+
+    const sam_image_u8 & best = masks_crop[0];
+    for (int iy = 0; iy < crop.ny; ++iy) {
+        const int y = y0 + iy;
+        for (int ix = 0; ix < crop.nx; ++ix) {
+            const int x = x0 + ix;
+
+            const uint8_t v = best.data[iy*crop.nx + ix];
+            if (x >= bx0 && x <= bx1 && y >= by0 && y <= by1) {
+                res.data[y*res.nx + x] = v;
+            } else if (v != mask_off_val) {
+                res.data[y*res.nx + x] = v;
+            }
+        }
+    }
+
+    return res;
+}
+
+void sam_deinit(
+        sam_state & state) {
+
+   if (state.state) {
+        for (auto & it : state.state->embds) {
+            sam_image_embd_free(it.second.embd);
+        }
+        state.state->embds.clear();
+        sam_image_embd_free(state.state->embd_roi);
+        if (state.state->ctx_dec_inp) {
+            ggml_free(state.state->ctx_dec_inp);
+        }
+        sam_dec_graph_free(*state.state);
+#ifdef SAM_USE_BLAS
+        if (state.model) {
+            sam_backend_sched_free(*state.model, *state.state);
+        }
+#endif
+        if (state.state->workers.threadpool) {
+            ggml_threadpool_free(state.state->workers.threadpool);
+        }
+        if (state.model && state.model->ctx_pre) {
+            ggml_free(state.model->ctx_pre);
+        }
+        if (state.model && state.model->ctx) {
+            ggml_free(state.model->ctx);
+            sam_numa_free(state.model->buf_numa, state.model->buf_numa_size);
         }
         state.model.reset();
         state.state.reset();
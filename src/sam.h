@@ -8,15 +8,32 @@
 
 #include <string>
 #include <vector>
+#include <functional>
+#include <memory>
 #include <thread>
 #include <cinttypes>
 
+// labels of sam_point: a box is given as its two corners, with their own labels
+enum sam_point_label {
+    SAM_POINT_LABEL_NEG    = 0,
+    SAM_POINT_LABEL_POS    = 1,
+    SAM_POINT_LABEL_BOX_TL = 2,
+    SAM_POINT_LABEL_BOX_BR = 3,
+};
+
 struct sam_point {
     float x;
     float y;
     int label;
 };
 
+struct sam_box {
+    float x0;
+    float y0;
+    float x1;
+    float y1;
+};
+
 // RGB uint8 image
 struct sam_image_u8 {
     int nx;
@@ -25,9 +42,28 @@ struct sam_image_u8 {
     std::vector<uint8_t> data;
 };
 
+// storage type of the image embeddings
+enum sam_embd_type {
+    SAM_EMBD_TYPE_F32  = 0, // 4 MB per image
+    SAM_EMBD_TYPE_F16  = 1, // 2 MB per image
+    SAM_EMBD_TYPE_Q8_0 = 2, // blocks of 32 8-bit values with a scale, ~1.1 MB per image
+};
+
+// masks returned by sam_compute_masks
+enum sam_mask_output {
+    SAM_MASK_OUTPUT_MULTI  = 0, // the 3 masks of the ambiguity-aware heads, best first
+    SAM_MASK_OUTPUT_SINGLE = 1, // the mask of the single-mask head only (SAM's multimask_output=False)
+    SAM_MASK_OUTPUT_BEST   = 2, // the best of the 3 masks only: the others are not upscaled
+};
+
 struct sam_params {
     int32_t seed      = -1; // RNG seed
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    int32_t poll      = 50;    // thread pool polling level before sleeping (0 - no polling, 100 - aggressive)
+    bool    cpu_strict = false; // pin each thread pool worker to its own core
+    int32_t numa_node  = -1;    // run the session on this NUMA node: pinned threads, node-local weights and buffers (-1 - off)
+                                // the thread calling the computes takes part in them and is not pinned: run it on the node
+    bool    numa_interleave = false; // with numa_node: interleave the weights over all nodes instead of a node-local copy
 
     std::string model     = "sam_vit_b-ggml-model-f16.bin"; // model path
     std::string fname_inp = "img.jpg";
@@ -38,6 +74,17 @@ struct sam_params {
     float   stability_score_offset    = 1.0f;
     float   eps                       = 1e-6f;
     float   eps_decoder_transformer   = 1e-5f;
+    bool    gelu_fast                 = false; // x*sigmoid(1.702*x) instead of the tanh GELU in the encoder MLPs
+    float   flat_window_threshold     = 0.0f;  // approximate: skip the local attention in windows whose pixel range is within this (0 - exact)
+    sam_mask_output mask_output       = SAM_MASK_OUTPUT_MULTI;
+    bool    dec_attn_f16              = false; // keys and values of the mask decoder attention in F16
+
+    int32_t     mem_max_mb        = 0;    // memory limit of the session: weights, embeddings, graph and work buffers (0 - unlimited)
+    int32_t     embd_mem_max_mb   = 64;   // memory budget of the image embeddings resident in the session
+    sam_embd_type embd_type       = SAM_EMBD_TYPE_F32; // also the type of the cached and exported embeddings
+
+    std::string embd_cache_dir    = "";   // directory of the on-disk image embedding cache (empty - off)
+    int32_t     embd_cache_max_mb = 1024; // size limit of the cache, the least recently used embeddings are evicted first
     sam_point pt = { 414.375f, 162.796875f, 1 };
 }; 
 
@@ -53,22 +100,165 @@ struct sam_state {
     int t_compute_masks_ms = 0;
 };
 
+// memory of a session in bytes
+struct sam_memory_usage {
+    size_t weights    = 0; // weights and the tensors precomputed from them
+    size_t embeddings = 0; // resident image embeddings
+    size_t compute    = 0; // buffers of the largest of the encoder and mask decoder graphs
+    size_t work       = 0; // work buffers of the worker threads
+
+    size_t total() const { return weights + embeddings + compute + work; }
+};
+
 // load the model's weights from a file
 std::shared_ptr<sam_state> sam_load_model(
     const sam_params & params);
 
+// the online NUMA nodes and the cores of a node, read from sysfs (empty if unknown)
+std::vector<int> sam_numa_nodes();
+std::vector<int> sam_numa_node_cpus(int node);
+
+// handle of an image embedding resident in the session (< 0 - none)
+using sam_image_handle = int32_t;
+
 bool sam_compute_embd_img(
     sam_image_u8 & img,
     int n_threads,
     sam_state & state);
 
+// called with the embedding of imgs[idx]: n_img_embd x n_img_embd x n_enc_out_chans floats
+using sam_embd_img_callback = std::function<void(size_t idx, const float * data, size_t n)>;
+
+// throughput mode: encode several images with the encoder blocks split into n_stages pipeline stages
+// each stage runs on its own group of n_threads/n_stages pinned cores and up to n_stages images are in flight
+// on_embd is called from the thread of the last stage, in the order of imgs
+// the stages run the exact encoder on the CPU backend and hand over F32 embeddings, outside of the session's memory:
+// flat_window_threshold, the BLAS backend, embd_type and mem_max_mb do not apply
+// returns false if an image cannot be preprocessed: the images before it may have been passed to on_embd already
+bool sam_compute_embd_imgs_pipelined(
+    const std::vector<sam_image_u8> & imgs,
+    int n_threads,
+    int n_stages,
+    sam_state & state,
+    const sam_embd_img_callback & on_embd);
+
 // returns masks sorted by the sum of the iou_score 
 // and stability_score in descending order
+// the prompt is padded with not-a-point entries to a fixed capacity (8 tokens, then doubled), so that the decoder graph
+// of the session is built once and the next decodes only set its inputs
+std::vector<sam_image_u8> sam_compute_masks(
+    sam_image_u8 & img,
+    int n_threads,
+    std::vector<sam_point> points,
+    sam_state & state,
+    int mask_on_val = 255,
+    int mask_off_val = 0);
+
+// the embedding of `img`, resident in the session until it is released or evicted:
+// the session keeps the embeddings within sam_params::embd_mem_max_mb, least recently used first out,
+// and an image that is already resident is not encoded again, so switching between images costs nothing
+// returns -1 on failure
+sam_image_handle sam_compute_embd_img_handle(
+    sam_image_u8 & img,
+    int n_threads,
+    sam_state & state);
+
+// masks of the image of the embedding `handle`, see sam_compute_masks above
+// returns no mask if the embedding is not resident anymore
+std::vector<sam_image_u8> sam_compute_masks(
+    sam_image_handle handle,
+    int n_threads,
+    std::vector<sam_point> points,
+    sam_state & state,
+    int mask_on_val = 255,
+    int mask_off_val = 0);
+
+// masks of a box, with optional points, decoded in a single pass
+// the box is added to the points as its two corners (SAM_POINT_LABEL_BOX_TL / _BR), which any prompt may contain
 std::vector<sam_image_u8> sam_compute_masks(
+    sam_image_handle handle,
+    int n_threads,
+    const sam_box & box,
+    std::vector<sam_point> points,
+    sam_state & state,
+    int mask_on_val = 255,
+    int mask_off_val = 0);
+
+// masks of several prompts on the image of the embedding `handle`, decoded in a single decoder pass:
+// the prompts are padded to the same number of points, the image embedding is shared by the whole batch
+// returns the masks of each prompt, in the order of prompts, or nothing on failure
+std::vector<std::vector<sam_image_u8>> sam_compute_masks_batch(
+    sam_image_handle handle,
+    int n_threads,
+    const std::vector<std::vector<sam_point>> & prompts,
+    sam_state & state,
+    int mask_on_val = 255,
+    int mask_off_val = 0);
+
+// iterative refinement on the image of the embedding `handle`: the low-res logits of the best mask of the previous call
+// are fed back to the decoder as a mask prompt, as in SAM's interactive predictor, so a few corrective clicks
+// converge on the object; `points` may be all the clicks so far or only the new ones
+// the session starts over on another embedding, or after sam_refine_reset
+std::vector<sam_image_u8> sam_compute_masks_refine(
+    sam_image_handle handle,
+    int n_threads,
+    std::vector<sam_point> points,
+    sam_state & state,
+    int mask_on_val = 255,
+    int mask_off_val = 0);
+
+// forget the previous mask of the refinement session
+void sam_refine_reset(
+    sam_state & state);
+
+void sam_release_embd_img(
+    sam_image_handle handle,
+    sam_state & state);
+
+// current memory of the session, within sam_params::mem_max_mb when set:
+// with a limit, the least recently used embeddings are evicted to make room for a graph or a new embedding,
+// and the call fails if that is not enough
+sam_memory_usage sam_get_memory_usage(
+    const sam_state & state);
+
+// serialize the resident embedding `handle`, with the identity of the model, the size of the image and a version tag
+// (the format of the on-disk cache: a 64-byte header followed by the data)
+bool sam_export_embd_img(
+    sam_image_handle handle,
+    const sam_state & state,
+    std::vector<uint8_t> & buf);
+
+bool sam_export_embd_img_file(
+    sam_image_handle handle,
+    const sam_state & state,
+    const std::string & fname);
+
+// make a serialized embedding resident, without running the encoder
+// it also becomes the embedding used by sam_compute_masks(img, ...)
+// fails if it was computed by a different model or with different encoder settings
+// returns -1 on failure
+sam_image_handle sam_import_embd_img(
+    const uint8_t * data,
+    size_t size,
+    sam_state & state);
+
+sam_image_handle sam_import_embd_img_file(
+    const std::string & fname,
+    sam_state & state);
+
+// region-of-interest refinement of a mask of `img` (e.g. from sam_compute_masks for the same points):
+// the bounding box of `mask`, grown by `margin` times its size on every side, is cropped from `img` and encoded on its own,
+// so a small object gets the full encoder resolution; the points are decoded in the crop and the best mask is merged
+// into a copy of `mask`, which is returned (empty on failure): it replaces `mask` inside the bounding box, and is OR-ed
+// with it in the margin, where the refinement can only add pixels
+// the embedding of the full image is kept, so sam_compute_masks keeps working on it
+sam_image_u8 sam_refine_mask_roi(
     sam_image_u8 & img,
+    const sam_image_u8 & mask,
     int n_threads,
     std::vector<sam_point> points,
     sam_state & state,
+    float margin = 0.1f,
     int mask_on_val = 255,
     int mask_off_val = 0);
 